@@ -0,0 +1,331 @@
+// Copyright...
+
+#include "asset_archive.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "trace.h"
+
+using std::string;
+using std::vector;
+
+namespace pdfsketch {
+
+namespace {
+const char kIndexHeader[] = "pdfsketch-assets 2";
+const size_t kTarBlockSize = 512;
+
+uint64_t ParseOctal(const char* field, size_t len) {
+  uint64_t ret = 0;
+  for (size_t i = 0; i < len && field[i]; i++) {
+    if (field[i] == ' ')
+      continue;
+    if (field[i] < '0' || field[i] > '7')
+      break;
+    ret = ret * 8 + (field[i] - '0');
+  }
+  return ret;
+}
+
+// A header field, which is NUL terminated unless it fills the field
+string Field(const char* field, size_t len) {
+  return string(field, strnlen(field, len));
+}
+
+// Record 'key' ("path", "linkpath") of a pax extended header, if it has
+// one
+string PaxRecord(const char* data, size_t size, const string& key) {
+  size_t pos = 0;
+  while (pos < size) {
+    char* end = NULL;
+    size_t len = strtoul(data + pos, &end, 10);
+    if (len == 0 || pos + len > size || *end != ' ')
+      break;
+    const char* record_start = end + 1;
+    string record(record_start, data + pos + len - 1);  // drop the newline
+    if (record.compare(0, key.size() + 1, key + "=") == 0)
+      return record.substr(key.size() + 1);
+    pos += len;
+  }
+  return string();
+}
+
+// Drops leading "./" and "/", and trailing "/"
+string NormalizePath(string path) {
+  while (true) {
+    if (path.compare(0, 2, "./") == 0)
+      path.erase(0, 2);
+    else if (path.compare(0, 1, "/") == 0)
+      path.erase(0, 1);
+    else
+      break;
+  }
+  while (!path.empty() && path[path.size() - 1] == '/')
+    path.erase(path.size() - 1);
+  if (path == ".")
+    path.clear();
+  return path;
+}
+
+bool ReadWholeFile(const string& path, string* out) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file)
+    return false;
+  char buf[4096];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), file)) > 0)
+    out->append(buf, len);
+  bool ok = !ferror(file);
+  fclose(file);
+  return ok;
+}
+
+void MakeDirs(const string& path) {
+  for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+    string dir = path.substr(0, slash);
+    if (mkdir(dir.c_str(), 0777) && errno != EEXIST)
+      printf("%s: can't make %s: %s\n", __func__, dir.c_str(),
+             strerror(errno));
+    if (slash == string::npos)
+      return;
+  }
+}
+}  // namespace {}
+
+AssetArchive::~AssetArchive() {
+  if (tar_fd_ >= 0)
+    close(tar_fd_);
+}
+
+bool AssetArchive::BuildIndex(const char* tar, size_t size, string* out) {
+  *out = kIndexHeader;
+  *out += '\n';
+  string long_name;
+  string long_link_name;
+  // Where each regular file's data is, for hard links to it
+  std::map<string, std::pair<uint64_t, uint64_t>> files;
+  size_t pos = 0;
+  while (pos + kTarBlockSize <= size) {
+    const char* header = tar + pos;
+    if (header[0] == '\0')
+      break;  // end of archive
+    if (memcmp(header + 257, "ustar", 5)) {
+      printf("%s: no ustar header at %zu\n", __func__, pos);
+      return false;
+    }
+    uint64_t entry_size = ParseOctal(header + 124, 12);
+    char type = header[156];
+    size_t data = pos + kTarBlockSize;
+    if (entry_size > size - data) {
+      printf("%s: entry at %zu is truncated\n", __func__, pos);
+      return false;
+    }
+    pos = data + (entry_size + kTarBlockSize - 1) / kTarBlockSize *
+        kTarBlockSize;
+    if (type == 'L') {
+      // GNU long name for the next entry
+      long_name = Field(tar + data, entry_size);
+      continue;
+    }
+    if (type == 'K') {
+      // GNU long link target for the next entry
+      long_link_name = Field(tar + data, entry_size);
+      continue;
+    }
+    if (type == 'x') {
+      long_name = PaxRecord(tar + data, entry_size, "path");
+      long_link_name = PaxRecord(tar + data, entry_size, "linkpath");
+      continue;
+    }
+    string name;
+    name.swap(long_name);
+    if (name.empty()) {
+      name = Field(header + 345, 155);  // ustar prefix
+      if (!name.empty())
+        name += '/';
+      name += Field(header, 100);
+    }
+    string link_name;
+    link_name.swap(long_link_name);
+    if (link_name.empty())
+      link_name = Field(header + 157, 100);
+    // Only files are listed; directories are implied by them. Hard
+    // links (which tar -h makes for files it reaches twice through
+    // symlinks) share the data of the file they link to, stored earlier.
+    if (type != '0' && type != '\0' && type != '1')
+      continue;
+    name = NormalizePath(name);
+    if (name.empty() || name.find('\n') != string::npos)
+      continue;
+    uint64_t offset = data;
+    if (type == '1') {
+      std::map<string, std::pair<uint64_t, uint64_t>>::const_iterator
+          target = files.find(NormalizePath(link_name));
+      if (target == files.end()) {
+        printf("%s: %s links to missing %s\n", __func__, name.c_str(),
+               link_name.c_str());
+        continue;
+      }
+      offset = target->second.first;
+      entry_size = target->second.second;
+    } else {
+      files[name] = std::make_pair(offset, entry_size);
+    }
+    char line[96];
+    snprintf(line, sizeof(line), "%llu %llu %llu ",
+             static_cast<unsigned long long>(offset),
+             static_cast<unsigned long long>(entry_size),
+             static_cast<unsigned long long>(ParseOctal(header + 136, 12)));
+    *out += line;
+    *out += name;
+    *out += '\n';
+  }
+  return true;
+}
+
+bool AssetArchive::Open(const string& index_path, const string& tar_path) {
+  TRACE_EVENT("AssetArchive::Open");
+  string index;
+  if (!ReadWholeFile(index_path, &index)) {
+    printf("%s: can't read %s\n", __func__, index_path.c_str());
+    return false;
+  }
+  size_t pos = index.find('\n');
+  if (pos == string::npos || index.compare(0, pos, kIndexHeader)) {
+    printf("%s: %s isn't an asset index\n", __func__, index_path.c_str());
+    return false;
+  }
+  dirs_[""];
+  for (pos++; pos < index.size(); ) {
+    size_t end = index.find('\n', pos);
+    if (end == string::npos)
+      end = index.size();
+    string line = index.substr(pos, end - pos);
+    pos = end + 1;
+    unsigned long long offset = 0;
+    unsigned long long size = 0;
+    unsigned long long mtime = 0;
+    int path_start = 0;
+    if (sscanf(line.c_str(), "%llu %llu %llu %n", &offset, &size, &mtime,
+               &path_start) < 3 || !path_start) {
+      printf("%s: bad index line: %s\n", __func__, line.c_str());
+      return false;
+    }
+    string path = line.substr(path_start);
+    Entry& entry = files_[path];
+    entry.offset = offset;
+    entry.size = size;
+    entry.mtime = mtime;
+    // Add the file to its directory, and directories to theirs, until
+    // reaching one that was already known and no older than the file.
+    while (true) {
+      size_t slash = path.rfind('/');
+      string parent = slash == string::npos ? "" : path.substr(0, slash);
+      bool known = dirs_.count(parent);
+      Dir& dir = dirs_[parent];
+      dir.names.insert(path.substr(slash == string::npos ? 0 : slash + 1));
+      if (known && dir.mtime >= entry.mtime)
+        break;
+      dir.mtime = std::max(dir.mtime, entry.mtime);
+      if (parent.empty())
+        break;
+      path = parent;
+    }
+  }
+  tar_fd_ = open(tar_path.c_str(), O_RDONLY);
+  if (tar_fd_ < 0) {
+    printf("%s: can't open %s\n", __func__, tar_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool AssetArchive::Stat(const string& path, bool* is_dir, uint64_t* size,
+                        time_t* mtime) const {
+  std::map<string, Entry>::const_iterator file = files_.find(path);
+  if (file != files_.end()) {
+    *is_dir = false;
+    *size = file->second.size;
+    *mtime = file->second.mtime;
+    return true;
+  }
+  std::map<string, Dir>::const_iterator dir = dirs_.find(path);
+  if (dir != dirs_.end()) {
+    *is_dir = true;
+    *size = 0;
+    *mtime = dir->second.mtime;
+    return true;
+  }
+  return false;
+}
+
+bool AssetArchive::List(const string& path, vector<string>* out) const {
+  std::map<string, Dir>::const_iterator dir = dirs_.find(path);
+  if (dir == dirs_.end())
+    return false;
+  out->assign(dir->second.names.begin(), dir->second.names.end());
+  return true;
+}
+
+ssize_t AssetArchive::Read(const string& path, uint64_t offset, char* buf,
+                           size_t size) const {
+  std::map<string, Entry>::const_iterator file = files_.find(path);
+  if (file == files_.end())
+    return -1;
+  if (offset >= file->second.size)
+    return 0;
+  size = std::min<uint64_t>(size, file->second.size - offset);
+  // pread doesn't move a shared file position, so readers don't need to
+  // take turns.
+  for (size_t done = 0; done < size; ) {
+    ssize_t len = pread(tar_fd_, buf + done, size - done,
+                        file->second.offset + offset + done);
+    if (len <= 0) {
+      printf("%s: can't read %s\n", __func__, path.c_str());
+      return -1;
+    }
+    done += len;
+  }
+  return size;
+}
+
+bool AssetArchive::Extract(const string& path, const string& dest) {
+  TRACE_EVENT("AssetArchive::Extract");
+  string prefix = path.empty() ? path : path + "/";
+  bool ok = true;
+  for (std::map<string, Entry>::const_iterator it =
+           files_.lower_bound(prefix);
+       it != files_.end() && it->first.compare(0, prefix.size(), prefix) == 0;
+       ++it) {
+    vector<char> contents(it->second.size);
+    string out_path = dest + "/" + it->first;
+    MakeDirs(out_path.substr(0, out_path.rfind('/')));
+    FILE* file = NULL;
+    if (Read(it->first, 0, contents.data(), contents.size()) !=
+            static_cast<ssize_t>(contents.size()) ||
+        !(file = fopen(out_path.c_str(), "wb")) ||
+        fwrite(contents.data(), 1, contents.size(), file) != contents.size()) {
+      printf("%s: can't extract %s\n", __func__, it->first.c_str());
+      ok = false;
+    }
+    if (file) {
+      fclose(file);
+      // fontconfig checks its caches against the mtimes.
+      struct utimbuf times;
+      times.actime = times.modtime = it->second.mtime;
+      utime(out_path.c_str(), &times);
+    }
+  }
+  return ok;
+}
+
+}  // namespace pdfsketch
@@ -0,0 +1,75 @@
+// Copyright...
+
+#ifndef PDFSKETCH_ASSET_ARCHIVE_H__
+#define PDFSKETCH_ASSET_ARCHIVE_H__
+
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+#include <time.h>
+#include <vector>
+
+namespace pdfsketch {
+
+// Read-only access to the files in a tar (system.tar: fonts and
+// fontconfig's configuration) without unpacking it. An index made when
+// packaging (system.idx, see BuildIndex()) gives each file's offset, so
+// a file can be read with ranged reads instead of going through the
+// whole tar. Nothing read is kept; the OS caches the tar's pages.
+//
+// Index format: a "pdfsketch-assets 2" line, then a line of
+// "<offset> <size> <mtime> <path>" for each regular file, offset and
+// size in bytes, mtime in seconds since the epoch as in the tar, and path
+// relative to the archive root.
+
+class AssetArchive {
+ public:
+  AssetArchive() {}
+  ~AssetArchive();
+
+  // Makes an index of 'tar' in 'out'. Returns false if 'tar' isn't a
+  // tar file this can read (ustar, with GNU or pax long names).
+  static bool BuildIndex(const char* tar, size_t size, std::string* out);
+
+  // Reads the index. File data is read from 'tar_path' when asked for.
+  bool Open(const std::string& index_path, const std::string& tar_path);
+
+  // Looks up a file or directory; 'path' is relative to the archive
+  // root, without leading or trailing slashes ("" is the root). A
+  // directory's mtime is the newest of the entries in it.
+  bool Stat(const std::string& path, bool* is_dir, uint64_t* size,
+            time_t* mtime) const;
+  // Names of the entries directly in directory 'path'.
+  bool List(const std::string& path, std::vector<std::string>* out) const;
+  // Reads up to 'size' bytes at 'offset' in file 'path' into 'buf'.
+  // Returns the number of bytes read, which is less than 'size' only at
+  // the end of the file, or -1 on error. Thread safe.
+  ssize_t Read(const std::string& path, uint64_t offset, char* buf,
+               size_t size) const;
+  // Writes the files under directory 'path' to the same paths under
+  // directory 'dest' (no trailing slash, so "" is the root), making
+  // directories as needed.
+  bool Extract(const std::string& path, const std::string& dest);
+
+ private:
+  struct Entry {
+    uint64_t offset;
+    uint64_t size;
+    time_t mtime;
+  };
+  struct Dir {
+    std::set<std::string> names;
+    time_t mtime{0};
+  };
+
+  std::map<std::string, Entry> files_;
+  // Every directory that has something in it, including the root ("")
+  std::map<std::string, Dir> dirs_;
+  int tar_fd_{-1};
+};
+
+}  // namespace pdfsketch
+
+#endif  // PDFSKETCH_ASSET_ARCHIVE_H__
@@ -0,0 +1,144 @@
+// Copyright...
+
+#include "asset_fs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <vector>
+
+#include <nacl_io/fuse.h>
+#include <nacl_io/nacl_io.h>
+
+using std::string;
+using std::vector;
+
+namespace pdfsketch {
+
+namespace {
+AssetArchive* g_archive = NULL;
+// Directory of g_archive that's mounted
+string* g_archive_dir = NULL;
+
+// FUSE passes paths from the root of the mount, starting with a slash.
+string ArchivePath(const char* path) {
+  string ret = *g_archive_dir;
+  while (*path == '/')
+    path++;
+  if (*path) {
+    if (!ret.empty())
+      ret += '/';
+    ret += path;
+  }
+  return ret;
+}
+
+int AssetGetattr(const char* path, struct stat* stbuf) {
+  bool is_dir = false;
+  uint64_t size = 0;
+  time_t mtime = 0;
+  if (!g_archive->Stat(ArchivePath(path), &is_dir, &size, &mtime))
+    return -ENOENT;
+  memset(stbuf, 0, sizeof(*stbuf));
+  stbuf->st_mode = is_dir ? (S_IFDIR | 0555) : (S_IFREG | 0444);
+  stbuf->st_nlink = 1;
+  stbuf->st_size = size;
+  // fontconfig only uses its prebuilt caches if these match.
+  stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = mtime;
+  return 0;
+}
+
+int AssetFgetattr(const char* path, struct stat* stbuf,
+                  struct fuse_file_info* info) {
+  return AssetGetattr(path, stbuf);
+}
+
+int AssetAccess(const char* path, int mode) {
+  struct stat stbuf;
+  int ret = AssetGetattr(path, &stbuf);
+  if (ret)
+    return ret;
+  return (mode & W_OK) ? -EROFS : 0;
+}
+
+int AssetOpen(const char* path, struct fuse_file_info* info) {
+  if ((info->flags & O_ACCMODE) != O_RDONLY)
+    return -EROFS;
+  struct stat stbuf;
+  int ret = AssetGetattr(path, &stbuf);
+  if (ret)
+    return ret;
+  return S_ISDIR(stbuf.st_mode) ? -EISDIR : 0;
+}
+
+int AssetRead(const char* path, char* buf, size_t size, off_t offset,
+              struct fuse_file_info* info) {
+  if (offset < 0)
+    return -EINVAL;
+  ssize_t len = g_archive->Read(ArchivePath(path), offset, buf, size);
+  return len < 0 ? -EIO : len;
+}
+
+int AssetRelease(const char* path, struct fuse_file_info* info) {
+  return 0;
+}
+
+int AssetOpendir(const char* path, struct fuse_file_info* info) {
+  struct stat stbuf;
+  int ret = AssetGetattr(path, &stbuf);
+  if (ret)
+    return ret;
+  return S_ISDIR(stbuf.st_mode) ? 0 : -ENOTDIR;
+}
+
+int AssetReaddir(const char* path, void* buf, fuse_fill_dir_t filler,
+                 off_t offset, struct fuse_file_info* info) {
+  vector<string> names;
+  if (!g_archive->List(ArchivePath(path), &names))
+    return -ENOENT;
+  filler(buf, ".", NULL, 0);
+  filler(buf, "..", NULL, 0);
+  for (const string& name : names) {
+    if (filler(buf, name.c_str(), NULL, 0))
+      break;
+  }
+  return 0;
+}
+}  // namespace {}
+
+bool MountAssetArchive(AssetArchive* archive, const string& archive_dir,
+                       const char* mount_point) {
+  if (g_archive) {
+    printf("%s: an asset archive is already mounted\n", __func__);
+    return false;
+  }
+  g_archive = archive;
+  g_archive_dir = new string(archive_dir);
+
+  static struct fuse_operations ops;
+  memset(&ops, 0, sizeof(ops));
+  ops.getattr = AssetGetattr;
+  ops.fgetattr = AssetFgetattr;
+  ops.access = AssetAccess;
+  ops.open = AssetOpen;
+  ops.read = AssetRead;
+  ops.release = AssetRelease;
+  ops.opendir = AssetOpendir;
+  ops.readdir = AssetReaddir;
+  ops.releasedir = AssetRelease;
+  if (nacl_io_register_fs_type("assetfs", &ops)) {
+    printf("%s: can't register assetfs\n", __func__);
+    return false;
+  }
+  if (mount("", mount_point, "assetfs", 0, NULL)) {
+    printf("%s: mounting %s failed: %s\n", __func__, mount_point,
+           strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+}  // namespace pdfsketch
@@ -0,0 +1,23 @@
+// Copyright...
+
+#ifndef PDFSKETCH_ASSET_FS_H__
+#define PDFSKETCH_ASSET_FS_H__
+
+#include <string>
+
+#include "asset_archive.h"
+
+namespace pdfsketch {
+
+// Serves a directory of an AssetArchive as a read-only file system,
+// through nacl_io's FUSE support, so each file is only fetched from the
+// archive when something (fontconfig, FreeType) reads it.
+//
+// There's one asset file system per process, so this can only be called
+// once. 'archive' must outlive the mount.
+bool MountAssetArchive(AssetArchive* archive, const std::string& archive_dir,
+                       const char* mount_point);
+
+}  // namespace pdfsketch
+
+#endif  // PDFSKETCH_ASSET_FS_H__
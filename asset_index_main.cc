@@ -0,0 +1,34 @@
+// Copyright...
+
+// Makes the index that lets the app read single files out of
+// system.tar (see AssetArchive). Run when packaging:
+//
+// Usage: asset_index system.tar system.idx
+
+#include <stdio.h>
+#include <string>
+
+#include "asset_archive.h"
+#include "byte_buffer.h"
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    printf("Usage: %s TAR INDEX\n", argv[0]);
+    return 1;
+  }
+  pdfsketch::ByteBuffer tar = pdfsketch::ByteBuffer::MapFile(argv[1]);
+  if (tar.empty()) {
+    printf("can't read %s\n", argv[1]);
+    return 1;
+  }
+  std::string index;
+  if (!pdfsketch::AssetArchive::BuildIndex(tar.data(), tar.size(), &index))
+    return 1;
+  FILE* out = fopen(argv[2], "w");
+  if (!out || fwrite(index.data(), 1, index.size(), out) != index.size()) {
+    printf("can't write %s\n", argv[2]);
+    return 1;
+  }
+  fclose(out);
+  return 0;
+}
@@ -0,0 +1,87 @@
+// Copyright...
+
+#include "byte_buffer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+using std::function;
+using std::string;
+using std::vector;
+
+namespace pdfsketch {
+
+struct ByteBuffer::Storage {
+  ~Storage() {
+    if (release)
+      release();
+  }
+  vector<char> bytes;
+  function<void ()> release;
+};
+
+ByteBuffer ByteBuffer::FromVector(vector<char>&& bytes) {
+  std::shared_ptr<Storage> storage(new Storage);
+  storage->bytes = std::move(bytes);
+  ByteBuffer ret;
+  ret.data_ = storage->bytes.data();
+  ret.size_ = storage->bytes.size();
+  ret.storage_ = storage;
+  return ret;
+}
+
+ByteBuffer ByteBuffer::Wrap(const char* data, size_t size,
+                            const function<void ()>& release) {
+  std::shared_ptr<Storage> storage(new Storage);
+  storage->release = release;
+  ByteBuffer ret;
+  ret.data_ = data;
+  ret.size_ = size;
+  ret.storage_ = storage;
+  return ret;
+}
+
+ByteBuffer ByteBuffer::MapFile(const string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    printf("%s: can't open %s: %s\n", __func__, path.c_str(),
+           strerror(errno));
+    return ByteBuffer();
+  }
+  struct stat stbuf;
+  if (fstat(fd, &stbuf) < 0 || stbuf.st_size <= 0) {
+    close(fd);
+    return ByteBuffer();
+  }
+  size_t size = stbuf.st_size;
+  void* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid after the fd is closed
+  close(fd);
+  if (addr == MAP_FAILED) {
+    printf("%s: can't map %s: %s\n", __func__, path.c_str(),
+           strerror(errno));
+    return ByteBuffer();
+  }
+  return Wrap(static_cast<const char*>(addr), size,
+              [addr, size] () { munmap(addr, size); });
+}
+
+ByteBuffer ByteBuffer::Slice(size_t offset, size_t size) const {
+  ByteBuffer ret;
+  if (offset > size_)
+    offset = size_;
+  if (size > size_ - offset)
+    size = size_ - offset;
+  ret.storage_ = storage_;
+  ret.data_ = data_ + offset;
+  ret.size_ = size;
+  return ret;
+}
+
+}  // namespace pdfsketch
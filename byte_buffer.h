@@ -0,0 +1,51 @@
+// Copyright...
+
+#ifndef PDFSKETCH_BYTE_BUFFER_H__
+#define PDFSKETCH_BYTE_BUFFER_H__
+
+#include <functional>
+#include <memory>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+namespace pdfsketch {
+
+// An immutable, reference counted run of bytes. Copies and slices share
+// the underlying memory, so a document can be handed to FileIO, poppler,
+// the tile rasterizer and the save path without duplicating it. Safe to
+// share between threads.
+
+class ByteBuffer {
+ public:
+  ByteBuffer() {}
+
+  // Takes over 'bytes' without copying them.
+  static ByteBuffer FromVector(std::vector<char>&& bytes);
+  // Refers to memory owned elsewhere. 'release' is called, on whichever
+  // thread drops the last reference, once no buffer refers to it.
+  static ByteBuffer Wrap(const char* data, size_t size,
+                         const std::function<void ()>& release);
+  // Maps the file at 'path' into memory read-only, so pages are only
+  // read in as they're used. Returns an empty buffer on failure.
+  static ByteBuffer MapFile(const std::string& path);
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  // Returns 'size' bytes starting at 'offset', sharing this buffer's
+  // memory. The range is clipped to this buffer.
+  ByteBuffer Slice(size_t offset, size_t size) const;
+
+ private:
+  struct Storage;
+
+  std::shared_ptr<const Storage> storage_;
+  const char* data_{nullptr};
+  size_t size_{0};
+};
+
+}  // namespace pdfsketch
+
+#endif  // PDFSKETCH_BYTE_BUFFER_H__
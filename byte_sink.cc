@@ -0,0 +1,73 @@
+// Copyright...
+
+#include "byte_sink.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+using std::vector;
+
+namespace pdfsketch {
+
+bool VectorByteSink::Reserve(uint64_t size) {
+  if (size > out_->max_size() - out_->size())
+    return false;
+  out_->reserve(out_->size() + size);
+  return true;
+}
+
+bool VectorByteSink::Write(const char* data, size_t len) {
+  out_->insert(out_->end(), data, data + len);
+  return true;
+}
+
+bool MemoryByteSink::Write(const char* data, size_t len) {
+  if (len > size_ - used_) {
+    printf("%s: out of room\n", __func__);
+    return false;
+  }
+  memcpy(data_ + used_, data, len);
+  used_ += len;
+  return true;
+}
+
+bool FdByteSink::Write(const char* data, size_t len) {
+  if (failed_)
+    return false;
+  if (buffer_.size() + len <= kBufferSize) {
+    buffer_.insert(buffer_.end(), data, data + len);
+    return true;
+  }
+  // Large writes skip the buffer
+  return Flush() && WriteFully(data, len);
+}
+
+bool FdByteSink::Flush() {
+  if (failed_)
+    return false;
+  if (buffer_.empty())
+    return true;
+  bool ret = WriteFully(&buffer_[0], buffer_.size());
+  buffer_.clear();
+  return ret;
+}
+
+bool FdByteSink::WriteFully(const char* data, size_t len) {
+  while (len) {
+    ssize_t rc = write(fd_, data, len);
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      printf("%s: write failed: %s\n", __func__, strerror(errno));
+      failed_ = true;
+      return false;
+    }
+    data += rc;
+    len -= rc;
+  }
+  return true;
+}
+
+}  // namespace pdfsketch
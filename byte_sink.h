@@ -0,0 +1,72 @@
+// Copyright...
+
+#ifndef PDFSKETCH_BYTE_SINK_H__
+#define PDFSKETCH_BYTE_SINK_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+
+namespace pdfsketch {
+
+// Destination for a stream of bytes, so that files can be written out
+// piece by piece rather than assembled in memory first.
+
+class ByteSink {
+ public:
+  virtual ~ByteSink() {}
+  // Called at most once, before any Write(), with the total number of
+  // bytes that will be written. Sinks may use it to preallocate.
+  virtual bool Reserve(uint64_t size) { return true; }
+  virtual bool Write(const char* data, size_t len) = 0;
+  // Pushes out any buffered bytes.
+  virtual bool Flush() { return true; }
+};
+
+// Appends to a vector.
+class VectorByteSink : public ByteSink {
+ public:
+  explicit VectorByteSink(std::vector<char>* out) : out_(out) {}
+  virtual bool Reserve(uint64_t size);
+  virtual bool Write(const char* data, size_t len);
+
+ private:
+  std::vector<char>* out_;
+};
+
+// Fills a fixed region of memory, e.g. an mmap()ed file. Fails rather
+// than write past the end.
+class MemoryByteSink : public ByteSink {
+ public:
+  MemoryByteSink(char* data, size_t size) : data_(data), size_(size) {}
+  virtual bool Write(const char* data, size_t len);
+  size_t bytes_written() const { return used_; }
+
+ private:
+  char* data_;
+  size_t size_;
+  size_t used_{0};
+};
+
+// Writes to a file descriptor, which the caller owns. Small writes are
+// buffered; call Flush() when done.
+class FdByteSink : public ByteSink {
+ public:
+  explicit FdByteSink(int fd) : fd_(fd) {}
+  virtual ~FdByteSink() { Flush(); }
+  virtual bool Write(const char* data, size_t len);
+  virtual bool Flush();
+
+ private:
+  static const size_t kBufferSize = 64 * 1024;
+
+  bool WriteFully(const char* data, size_t len);
+
+  int fd_;
+  std::vector<char> buffer_;
+  bool failed_{false};
+};
+
+}  // namespace pdfsketch
+
+#endif  // PDFSKETCH_BYTE_SINK_H__
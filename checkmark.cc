@@ -2,6 +2,8 @@
 
 #include "checkmark.h"
 
+#include "trace.h"
+
 namespace pdfsketch {
 
 void Checkmark::Serialize(pdfsketchproto::Graphic* out) const {
@@ -21,13 +23,18 @@ void Checkmark::PlaceUpdate(const Point& location) {
   SetNeedsDisplay(false);
 }
 
-void Checkmark::Draw(cairo_t* cr, bool selected) {
-  stroke_color_.CairoSetSourceRGBA(cr);
-  cairo_set_line_width(cr, line_width_);
+void Checkmark::BuildPath(cairo_t* cr) const {
   frame_.UpperLeft().CairoMoveTo(cr);
   frame_.LowerRight().CairoLineTo(cr);
   frame_.UpperRight().CairoMoveTo(cr);
   frame_.LowerLeft().CairoLineTo(cr);
+}
+
+void Checkmark::Draw(cairo_t* cr, bool selected) {
+  TRACE_EVENT("Checkmark::Draw");
+  stroke_color_.CairoSetSourceRGBA(cr);
+  cairo_set_line_width(cr, line_width_);
+  AppendCachedPath(cr);
   cairo_stroke(cr);
 }
 
@@ -18,6 +18,9 @@ class Checkmark : public Graphic {
   virtual void PlaceUpdate(const Point& location);
   virtual bool PlaceComplete() { return false; }
   virtual void Draw(cairo_t* cr, bool selected);
+
+ protected:
+  virtual void BuildPath(cairo_t* cr) const;
 };
 
 }  // namespace pdfsketch
@@ -2,6 +2,8 @@
 
 #include "circle.h"
 
+#include "trace.h"
+
 namespace pdfsketch {
 
 void Circle::Serialize(pdfsketchproto::Graphic* out) const {
@@ -9,13 +11,18 @@ void Circle::Serialize(pdfsketchproto::Graphic* out) const {
   out->set_type(pdfsketchproto::Graphic::CIRCLE);
 }
 
-void Circle::Draw(cairo_t* cr, bool selected) {
+void Circle::BuildPath(cairo_t* cr) const {
   cairo_save(cr);
   cairo_move_to(cr, frame_.Right(), (frame_.Top() + frame_.Bottom()) / 2.0);
   cairo_translate(cr, frame_.Left(), frame_.Top());
   cairo_scale(cr, frame_.size_.width_, frame_.size_.height_);
   cairo_arc(cr, 0.5, 0.5, 0.5, 0, 2 * M_PI);
   cairo_restore(cr);
+}
+
+void Circle::Draw(cairo_t* cr, bool selected) {
+  TRACE_EVENT("Circle::Draw");
+  AppendCachedPath(cr);
   fill_color_.CairoSetSourceRGBA(cr);
   cairo_fill_preserve(cr);
   stroke_color_.CairoSetSourceRGBA(cr);
@@ -14,6 +14,9 @@ class Circle : public Graphic {
       : Graphic(msg) {}
   virtual void Serialize(pdfsketchproto::Graphic* out) const;
   virtual void Draw(cairo_t* cr, bool selected);
+
+ protected:
+  virtual void BuildPath(cairo_t* cr) const;
 };
 
 }  // namespace pdfsketch
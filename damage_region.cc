@@ -0,0 +1,58 @@
+// Copyright...
+
+#include "damage_region.h"
+
+namespace pdfsketch {
+
+namespace {
+// Two rects are merged if their union is at most this much bigger
+// than the two areas combined.
+const double kMergeSlack = 1.25;
+}  // namespace {}
+
+void DamageRegion::Add(const Rect& rect) {
+  Rect add = rect.RoundedOut();
+  if (add.Empty())
+    return;
+  // Merging can make the new rect overlap others, so repeat until
+  // nothing merges.
+  bool merged = true;
+  while (merged) {
+    merged = false;
+    for (size_t i = 0; i < rects_.size(); i++) {
+      Rect both = rects_[i].Union(add);
+      if (both.Area() <= (rects_[i].Area() + add.Area()) * kMergeSlack) {
+        add = both;
+        rects_.erase(rects_.begin() + i);
+        merged = true;
+        break;
+      }
+    }
+  }
+  if (rects_.size() >= kMaxRects) {
+    // Out of room. Merge with whichever rect grows the least.
+    size_t best = 0;
+    double best_growth = -1.0;
+    for (size_t i = 0; i < rects_.size(); i++) {
+      double growth = rects_[i].Union(add).Area() - rects_[i].Area();
+      if (best_growth < 0.0 || growth < best_growth) {
+        best = i;
+        best_growth = growth;
+      }
+    }
+    add = rects_[best].Union(add);
+    rects_.erase(rects_.begin() + best);
+    Add(add);
+    return;
+  }
+  rects_.push_back(add);
+}
+
+double DamageRegion::Area() const {
+  double ret = 0.0;
+  for (const Rect& rect : rects_)
+    ret += rect.Area();
+  return ret;
+}
+
+}  // namespace pdfsketch
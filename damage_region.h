@@ -0,0 +1,37 @@
+// Copyright...
+
+#ifndef PDFSKETCH_DAMAGE_REGION_H__
+#define PDFSKETCH_DAMAGE_REGION_H__
+
+#include <stdlib.h>
+#include <vector>
+
+#include "view.h"
+
+namespace pdfsketch {
+
+// Accumulates the parts of a view that need to be redrawn, as a short
+// list of non-nested rects with integral edges. Nearby rects are merged
+// when that doesn't add much area, and the list never grows past
+// kMaxRects, so that a burst of small invalidations (e.g. typing)
+// stays cheap to draw and push to the screen.
+
+class DamageRegion {
+ public:
+  static const size_t kMaxRects = 8;
+
+  void Add(const Rect& rect);
+  void Clear() { rects_.clear(); }
+  bool empty() const { return rects_.empty(); }
+  const std::vector<Rect>& rects() const { return rects_; }
+
+  // Total area of the rects
+  double Area() const;
+
+ private:
+  std::vector<Rect> rects_;
+};
+
+}  // namespace pdfsketch
+
+#endif  // PDFSKETCH_DAMAGE_REGION_H__
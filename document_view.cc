@@ -2,18 +2,20 @@
 
 #include "document_view.h"
 
+#include <map>
 #include <stdio.h>
 
 #include <cairo.h>
-#include <cairo-pdf.h>
 #include <google/protobuf/text_format.h>
 #include <poppler-page.h>
-#include <poppler-page-renderer.h>
 
 #include "graphic_factory.h"
 #include "rectangle.h"
+#include "trace.h"
+#include "worker_pool.h"
 
 using std::make_pair;
+using std::map;
 using std::pair;
 using std::set;
 using std::shared_ptr;
@@ -27,42 +29,57 @@ namespace {
 const double kSpacing = 20.0;  // between pages
 }  // namespace {}
 
-void DocumentView::LoadFromPDF(const char* pdf_doc, size_t pdf_doc_length) {
-  poppler_doc_data_.clear();
-  poppler_doc_data_.insert(poppler_doc_data_.begin(),
-                           pdf_doc,
-                           pdf_doc + pdf_doc_length);
-  poppler_doc_.reset(poppler::document::load_from_raw_data(&poppler_doc_data_[0], poppler_doc_data_.size()));
+void DocumentView::SetRenderThreadRunner(
+    const std::function<void (std::function<void ()>)>& runner) {
+  render_thread_runner_ = runner;
+  rasterizer_.reset(new TileRasterizer(WorkerPool::DefaultNumThreads()));
+  rasterizer_->SetDocument(poppler_doc_data_);
+  rasterizer_->SetTileReadyCallback([this] () {
+      render_thread_runner_([this] () { AcceptRasterizedTiles(); });
+    });
+}
 
+void DocumentView::LoadFromPDF(const ByteBuffer& pdf_doc,
+                               unique_ptr<poppler::document> parsed) {
+  // poppler reads from the buffer as needed rather than copying it.
+  poppler_doc_data_ = pdf_doc;
+  if (!parsed.get())
+    parsed.reset(poppler::document::load_from_raw_data(
+        pdf_doc.data(), pdf_doc.size()));
+  poppler_doc_ = std::move(parsed);
+  tile_cache_.Clear();
+  if (rasterizer_.get())
+    rasterizer_->SetDocument(poppler_doc_data_);
+
+  LoadPageGeometry();
   UpdateSize();
 
   SetNeedsDisplay();
 }
 
-void DocumentView::GetPDFData(const char** out_buf,
-                              size_t* out_len) const {
+void DocumentView::LoadPageGeometry() {
+  pages_.clear();
   if (!poppler_doc_.get())
     return;
-  // *out_buf = doc_->buf();
-  // *out_len = doc_->buf_len();
-  *out_buf = &poppler_doc_data_[0];
-  *out_len = poppler_doc_data_.size();
+  pages_.resize(poppler_doc_->pages());
+  for (size_t i = 0; i < pages_.size(); i++) {
+    unique_ptr<poppler::page> ppage(poppler_doc_->create_page(i));
+    if (!ppage.get()) {
+      printf("Bug - null page3\n");
+      continue;
+    }
+    poppler::rectf rect = ppage->page_rect();
+    pages_[i].native_size = Size(rect.width(), rect.height());
+  }
 }
 
 void DocumentView::UpdateSize() {
-  // Update bounds
-  double max_page_width = 0.0;  // w/o spacing
-  double total_height = kSpacing;  // w/ spacing
-  page_y_.clear();
-  for (int i = 0; i < poppler_doc_->pages(); i++) {
-    Size size = PageSize(i).ScaledBy(zoom_).RoundedUp();
-    page_y_.push_back(make_pair(total_height, total_height + size.height_));
-    max_page_width = std::max(max_page_width, size.width_);
-    total_height += size.height_ + kSpacing;
-  }
-  SetSize(Size(max_page_width + 2 * kSpacing, total_height));
-  // invalidate cache
-  cached_subrect_ = Rect();
+  vector<Size> page_sizes;
+  page_sizes.reserve(pages_.size());
+  for (const PageGeometry& page : pages_)
+    page_sizes.push_back(page.native_size.ScaledBy(zoom_).RoundedUp());
+  page_index_.Layout(page_sizes, kSpacing);
+  SetSize(page_index_.size());
 }
 
 namespace {
@@ -83,8 +100,92 @@ void DocumentView::SerializeGraphics(
   }
 }
 
+void DocumentView::SerializeUnsavedChanges(
+    pdfsketchproto::DocumentDelta* msg) const {
+  vector<Graphic*> graphics(unsaved_graphics_.begin(),
+                            unsaved_graphics_.end());
+  if (editing_graphic_ && !unsaved_graphics_.count(editing_graphic_))
+    graphics.push_back(editing_graphic_);
+  graphic_index_.SortByZOrder(&graphics);
+  // Topmost first, so that each one's upper sibling is in place by the
+  // time it's applied.
+  for (auto it = graphics.rbegin(), e = graphics.rend(); it != e; ++it) {
+    Graphic* gr = *it;
+    gr->Serialize(msg->add_graphic());
+    msg->add_upper_sibling_id(gr->upper_sibling_ ?
+                              gr->upper_sibling_->id() : 0);
+  }
+  for (uint64_t id : unsaved_removed_ids_)
+    msg->add_removed_id(id);
+}
+
+void DocumentView::BeginSave(int id) {
+  SavingChanges& changes = saving_[id];
+  changes.graphics.swap(unsaved_graphics_);
+  changes.removed_ids.swap(unsaved_removed_ids_);
+}
+
+void DocumentView::FinishSave(int id, bool stored) {
+  map<int, SavingChanges>::iterator it = saving_.find(id);
+  if (it == saving_.end())
+    return;
+  if (!stored) {
+    unsaved_graphics_.insert(it->second.graphics.begin(),
+                             it->second.graphics.end());
+    unsaved_removed_ids_.insert(it->second.removed_ids.begin(),
+                                it->second.removed_ids.end());
+  }
+  saving_.erase(it);
+}
+
+void DocumentView::MarkSaved() {
+  unsaved_graphics_.clear();
+  unsaved_removed_ids_.clear();
+  saving_.clear();
+}
+
+void DocumentView::ApplyDelta(const pdfsketchproto::DocumentDelta& msg) {
+  std::map<uint64_t, Graphic*> graphics;
+  for (Graphic* gr = bottom_graphic_; gr; gr = gr->upper_sibling_)
+    graphics[gr->id()] = gr;
+  for (uint64_t id : msg.removed_id()) {
+    auto it = graphics.find(id);
+    if (it == graphics.end())
+      continue;
+    RemoveGraphic(it->second);
+    graphics.erase(it);
+  }
+  for (int i = 0; i < msg.graphic_size(); i++) {
+    const pdfsketchproto::Graphic& gr_msg = msg.graphic(i);
+    if (gr_msg.has_id()) {
+      auto it = graphics.find(gr_msg.id());
+      if (it != graphics.end()) {
+        RemoveGraphic(it->second);
+        graphics.erase(it);
+      }
+    }
+    shared_ptr<Graphic> gr = GraphicFactory::NewGraphic(gr_msg);
+    if (!gr) {
+      printf("%s: bad graphic\n", __func__);
+      continue;
+    }
+    Graphic* upper_sibling = NULL;
+    if (i < msg.upper_sibling_id_size() && msg.upper_sibling_id(i)) {
+      auto it = graphics.find(msg.upper_sibling_id(i));
+      if (it != graphics.end())
+        upper_sibling = it->second;
+    }
+    InsertGraphicAfter(gr, upper_sibling);
+    graphics[gr->id()] = gr.get();
+  }
+}
+
 void DocumentView::InsertImage(const char* data, size_t length) {
   shared_ptr<Graphic> new_graphic(GraphicFactory::NewImage(data, length));
+  if (!new_graphic) {
+    printf("%s: can't read image\n", __func__);
+    return;
+  }
   Point page_center;
   int page = 0;
   GetVisibleCenterPageAndPoint(&page_center, &page);
@@ -99,52 +200,32 @@ void DocumentView::InsertImage(const char* data, size_t length) {
 
 void DocumentView::SetZoom(double zoom) {
   zoom_ = zoom;
+  // Queued tiles are for the old zoom level
+  if (rasterizer_.get())
+    rasterizer_->CancelPending();
   UpdateSize();
 }
 
 Size DocumentView::PageSize(int page) const {
-  if (!poppler_doc_.get())
+  if (page < 0 || page >= static_cast<int>(pages_.size()))
     return Size();
-  unique_ptr<poppler::page> ppage(poppler_doc_->create_page(page));
-  if (!ppage.get())
-    printf("Bug - null page3\n");
-  poppler::rectf rect = ppage->page_rect();
-  return Size(rect.width(), rect.height());
-  // return Size(doc_->GetPageWidth(page), doc_->GetPageHeight(page));
+  return pages_[page].native_size;
 }
 
 Rect DocumentView::PageRect(int page) const {
-  Size page_size = PageSize(page).ScaledBy(zoom_).RoundedUp();
-  double offset = static_cast<int>(size_.width_ / 2 - page_size.width_ / 2);
-  return Rect(offset, page_y_[page].first,
-              page_size.width_, page_size.height_);
+  return page_index_.PageRect(page);
 }
 
 int DocumentView::MinPageForRect(const Rect& rect) const {
-  vector<pair<double, double>>::const_iterator it =
-      std::upper_bound(page_y_.begin(), page_y_.end(), rect.Top(),
-                       [] (double left, const pair<double, double>& right) {
-                         return left < right.second;
-                       });
-  return it - page_y_.begin();
+  return page_index_.MinPageForRect(rect);
 }
 
 int DocumentView::MaxPageForRect(const Rect& rect) const {
-  vector<pair<double, double>>::const_reverse_iterator it =
-      std::upper_bound(page_y_.rbegin(), page_y_.rend(), rect.Bottom(),
-                       [] (double left, const pair<double, double>& right) {
-                         return left > right.first;
-                       });
-  return it - page_y_.rbegin();
+  return page_index_.MaxPageForRect(rect);
 }
 
 int DocumentView::PageForPoint(const Point& point) const {
-  for (int i = 0; i < poppler_doc_->pages(); i++) {
-    Rect page_rect = PageRect(i);
-    if (point.y_ <= page_rect.Bottom())
-      return i;
-  }
-  return poppler_doc_->pages() - 1;
+  return page_index_.PageForPoint(point);
 }
 
 Point DocumentView::ConvertPointToPage(const Point& point, int page) const {
@@ -182,13 +263,21 @@ void DocumentView::InsertGraphicAfter(shared_ptr<Graphic> graphic,
     graphic->upper_sibling_ = NULL;
     top_graphic_ = graphic;
   } else {
-    if (upper_sibling->lower_sibling_.get())
+    if (upper_sibling->lower_sibling_.get()) {
       graphic->lower_sibling_ = upper_sibling->lower_sibling_;
-    else
+      graphic->lower_sibling_->upper_sibling_ = graphic.get();
+    } else {
       graphic->lower_sibling_.reset();
+      bottom_graphic_ = graphic.get();
+    }
     graphic->upper_sibling_ = upper_sibling;
     upper_sibling->lower_sibling_ = graphic;
   }
+  graphic_index_.Insert(graphic.get());
+  unsaved_removed_ids_.erase(graphic->id());
+  for (auto& saving : saving_)
+    saving.second.removed_ids.erase(graphic->id());
+  MarkUnsaved(graphic.get());
   graphic->SetNeedsDisplay(GraphicIsSelected(graphic.get()));
   printf("inserted graphic at page %d loc %s\n", graphic->Page(),
          graphic->Frame().String().c_str());
@@ -209,6 +298,12 @@ shared_ptr<Graphic> DocumentView::RemoveGraphic(Graphic* graphic) {
   if (GraphicIsSelected(graphic)) {
     selected_graphics_.erase(selected_graphics_.find(graphic));
   }
+  graphic_index_.Remove(graphic);
+  graphic_cache_.Remove(graphic);
+  unsaved_graphics_.erase(graphic);
+  unsaved_removed_ids_.insert(graphic->id());
+  for (auto& saving : saving_)
+    saving.second.graphics.erase(graphic);
   shared_ptr<Graphic> ret;
   if (graphic->upper_sibling_) {
     ret = graphic->upper_sibling_->lower_sibling_;
@@ -248,75 +343,182 @@ void DocumentView::RestoreGraphicUndo(Graphic* gr, const string& proto_msg) {
   msg.ParseFromString(proto_msg);
   gr->Restore(msg);
   gr->SetNeedsDisplay(false);
+  MarkUnsaved(gr);
 }
 
-void DocumentView::DrawRect(cairo_t* cr, const Rect& rect) {
-  // Do some caching
-  if (VisibleSubrect() != cached_subrect_ && poppler_doc_.get()) {
-    cached_subrect_ = VisibleSubrect();
-    if (cached_surface_) {
-      cairo_surface_finish(cached_surface_);
-      cairo_surface_destroy(cached_surface_);
-      cached_surface_ = NULL;
+namespace {
+// Tiles rendered synchronously in a single DrawRect() call. Any more
+// missing tiles are shown as placeholders and filled in on later frames,
+// so a scroll or zoom doesn't stall on rendering the whole viewport.
+const int kMaxTilesRenderedPerDraw = 4;
+
+// Computes the range of tiles (inclusive) that cover 'rect', which is
+// in view coords. 'factor' is device pixels per view unit for the tile
+// scale.
+void TileRangeForRect(const Rect& rect, const Rect& page_rect,
+                      double factor, int* x0, int* y0, int* x1, int* y1) {
+  const double tile_size = PageTileCache::kTileSize;
+  *x0 = static_cast<int>(
+      floor((rect.Left() - page_rect.Left()) * factor / tile_size));
+  *y0 = static_cast<int>(
+      floor((rect.Top() - page_rect.Top()) * factor / tile_size));
+  *x1 = static_cast<int>(
+      ceil((rect.Right() - page_rect.Left()) * factor / tile_size)) - 1;
+  *y1 = static_cast<int>(
+      ceil((rect.Bottom() - page_rect.Top()) * factor / tile_size)) - 1;
+}
+
+void PaintTile(cairo_t* cr, cairo_surface_t* tile, const Rect& tile_rect,
+               double factor) {
+  cairo_save(cr);
+  cairo_translate(cr, tile_rect.Left(), tile_rect.Top());
+  cairo_scale(cr, 1.0 / factor, 1.0 / factor);
+  cairo_set_source_surface(cr, tile, 0.0, 0.0);
+  cairo_paint(cr);
+  cairo_restore(cr);
+}
+}  // namespace {}
+
+Rect DocumentView::TileRect(const TileKey& key) const {
+  Rect page_rect = PageRect(key.page);
+  // view units per tile
+  double tile_len = PageTileCache::kTileSize * zoom_ /
+      PageTileCache::BucketScale(key.scale);
+  return Rect(page_rect.Left() + key.x * tile_len,
+              page_rect.Top() + key.y * tile_len,
+              tile_len, tile_len);
+}
+
+void DocumentView::DrawPlaceholderTiles(cairo_t* cr, int page,
+                                        const Rect& rect, int scale) {
+  Rect page_rect = PageRect(page);
+  double factor = PageTileCache::BucketScale(scale) / zoom_;
+  int x0, y0, x1, y1;
+  TileRangeForRect(rect, page_rect, factor, &x0, &y0, &x1, &y1);
+  cairo_save(cr);
+  rect.CairoRectangle(cr);
+  cairo_clip(cr);
+  for (int y = y0; y <= y1; y++) {
+    for (int x = x0; x <= x1; x++) {
+      TileKey key(page, scale, x, y);
+      cairo_surface_t* tile = tile_cache_.Get(key);
+      if (tile)
+        PaintTile(cr, tile, TileRect(key), factor);
     }
+  }
+  cairo_restore(cr);
+}
 
-    // Create new cache
-    double width = cached_subrect_.size_.width_;
-    double height = cached_subrect_.size_.height_;
-    cairo_user_to_device_distance(cr, &width, &height);
-    // Avoid divide by zero:
-    float device_zoom = cached_subrect_.size_.width_ > 0 ?
-        (width / cached_subrect_.size_.width_) : 1.0;
-    cached_surface_device_zoom_ = device_zoom;
-    cached_surface_ =
-        cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
-
-    cairo_t* cache_cr = cairo_create(cached_surface_);
-    cairo_translate(cache_cr, -cached_subrect_.Left() * device_zoom, -cached_subrect_.Top() * device_zoom);
-    poppler::page_renderer renderer;
-    for (int i = MinPageForRect(cached_subrect_),
-             e = MaxPageForRect(cached_subrect_); i <= e; i++) {
-      Rect page_rect = PageRect(i);
-      if (!cached_subrect_.Intersects(page_rect.ScaledBy(device_zoom)))
+void DocumentView::DrawPageTiles(cairo_t* cr, int page, const Rect& rect,
+                                 double device_zoom, int* tiles_rendered) {
+  Rect page_rect = PageRect(page);
+  int scale = PageTileCache::ScaleBucket(zoom_ * device_zoom);
+  double factor = PageTileCache::BucketScale(scale) / zoom_;
+  int x0, y0, x1, y1;
+  TileRangeForRect(rect, page_rect, factor, &x0, &y0, &x1, &y1);
+  unique_ptr<poppler::page> ppage;  // created only if a tile is missing
+  for (int y = y0; y <= y1; y++) {
+    for (int x = x0; x <= x1; x++) {
+      TileKey key(page, scale, x, y);
+      Rect tile_rect = TileRect(key);
+      cairo_surface_t* tile = tile_cache_.Get(key);
+      if (!tile && !rasterizer_.get() &&
+          *tiles_rendered < kMaxTilesRenderedPerDraw) {
+        if (!ppage.get()) {
+          TileRasterizer::LoadFontsForPage(*poppler_doc_, page);
+          ppage.reset(poppler_doc_->create_page(page));
+        }
+        tile = TileRasterizer::RenderTile(key, ppage.get());
+        tile_cache_.Put(key, tile);
+        (*tiles_rendered)++;
+      }
+      if (!tile) {
+        // Show a tile from another zoom level for now. The exact tile
+        // gets displayed when the rasterizer delivers it, or, when
+        // rendering synchronously, on the next frame.
+        Rect missing = tile_rect.Intersect(rect);
+        int placeholder_scale = tile_cache_.NearestCachedScale(page, scale);
+        if (placeholder_scale)
+          DrawPlaceholderTiles(cr, page, missing, placeholder_scale);
+        if (rasterizer_.get())
+          rasterizer_->Request(key, TileRasterizer::kVisible);
+        else
+          SetNeedsDisplayInRect(missing);
         continue;
-      // draw this page
-      cairo_save(cache_cr);
-      cairo_scale(cache_cr, device_zoom, device_zoom);
-      cairo_set_source_rgb(cache_cr, 0.0, 0.0, 0.0);
-      cairo_set_line_width(cache_cr, 1.0);
-      Rect outline = page_rect.InsetBy(-0.5);
-      outline.CairoRectangle(cache_cr);
-      cairo_stroke(cache_cr);
-
-      cairo_set_source_rgb(cache_cr, 1.0, 1.0, 1.0);
-      page_rect.CairoRectangle(cache_cr);
-      cairo_fill(cache_cr);
-      cairo_translate(cache_cr, page_rect.origin_.x_, page_rect.origin_.y_);
-      cairo_scale(cache_cr, zoom_, zoom_);
-
-      unique_ptr<poppler::page> page(poppler_doc_->create_page(i));
-      if (!page.get())
-        printf("BUG- null page in render\n");
-      renderer.cairo_render_page(cache_cr,
-                                 page.get(),
-                                 false);  // TODO(adlr): rotation?
-      cairo_restore(cache_cr);
+      }
+      PaintTile(cr, tile, tile_rect, factor);
     }
-    cairo_destroy(cache_cr);
   }
+}
 
-  if (cached_surface_) {
-    cairo_pattern_t* old_pattern = cairo_pattern_reference(cairo_get_source(cr));
-    cairo_save(cr);
-    cairo_scale(cr, 1.0 / cached_surface_device_zoom_,
-                1.0 / cached_surface_device_zoom_);
-    cairo_set_source_surface(cr, cached_surface_,
-                             cached_subrect_.Left() * cached_surface_device_zoom_,
-                             cached_subrect_.Top() * cached_surface_device_zoom_);
-    cairo_paint(cr);
-    cairo_set_source(cr, old_pattern);
-    cairo_pattern_destroy(old_pattern);
-    cairo_restore(cr);
+void DocumentView::PrefetchTiles(double device_zoom) {
+  // Earlier passes' prefetches may be for where the view no longer is.
+  rasterizer_->CancelPrefetch();
+  // Prefetch a screenful above and below what's visible
+  Rect visible = VisibleSubrect();
+  Rect prefetch(visible.Left(), visible.Top() - visible.size_.height_,
+                visible.size_.width_, visible.size_.height_ * 3.0);
+  int scale = PageTileCache::ScaleBucket(zoom_ * device_zoom);
+  double factor = PageTileCache::BucketScale(scale) / zoom_;
+  for (int i = MinPageForRect(prefetch), e = MaxPageForRect(prefetch);
+       i <= e; i++) {
+    Rect page_rect = PageRect(i);
+    if (!prefetch.Intersects(page_rect))
+      continue;
+    int x0, y0, x1, y1;
+    TileRangeForRect(prefetch.Intersect(page_rect), page_rect, factor,
+                     &x0, &y0, &x1, &y1);
+    for (int y = y0; y <= y1; y++) {
+      for (int x = x0; x <= x1; x++) {
+        TileKey key(i, scale, x, y);
+        if (!tile_cache_.Contains(key))
+          rasterizer_->Request(key, TileRasterizer::kPrefetch);
+      }
+    }
+  }
+}
+
+void DocumentView::AcceptRasterizedTiles() {
+  vector<pair<TileKey, cairo_surface_t*>> tiles;
+  rasterizer_->TakeFinished(&tiles);
+  for (auto& tile : tiles) {
+    tile_cache_.Put(tile.first, tile.second);
+    if (tile.first.page < static_cast<int>(pages_.size()))
+      SetNeedsDisplayInRect(TileRect(tile.first));
+  }
+}
+
+void DocumentView::DrawRect(cairo_t* cr, const Rect& rect) {
+  TRACE_EVENT("DocumentView::DrawRect");
+  // device pixels per view unit
+  double dx = 1.0;
+  double dy = 0.0;
+  cairo_user_to_device_distance(cr, &dx, &dy);
+  double device_zoom = sqrt(dx * dx + dy * dy);
+  if (poppler_doc_.get()) {
+    TRACE_EVENT("DocumentView::DrawRect tiles");
+    int tiles_rendered = 0;
+    for (int i = MinPageForRect(rect), e = MaxPageForRect(rect);
+         i <= e; i++) {
+      Rect page_rect = PageRect(i);
+      if (!rect.Intersects(page_rect))
+        continue;
+      cairo_save(cr);
+      cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
+      cairo_set_line_width(cr, 1.0);
+      page_rect.InsetBy(-0.5).CairoRectangle(cr);
+      cairo_stroke(cr);
+
+      Rect visible = page_rect.Intersect(rect);
+      visible.CairoRectangle(cr);
+      cairo_clip(cr);
+      cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
+      cairo_paint(cr);
+      DrawPageTiles(cr, i, visible, device_zoom, &tiles_rendered);
+      cairo_restore(cr);
+    }
+    if (rasterizer_.get())
+      PrefetchTiles(device_zoom);
   }
 
   if (!poppler_doc_.get()) {
@@ -335,33 +537,43 @@ void DocumentView::DrawRect(cairo_t* cr, const Rect& rect) {
     return;
   }
 
-  for (int i = MinPageForRect(rect), e = MaxPageForRect(rect); i <= e; i++) {
-    Rect page_rect = PageRect(i);
-    if (!rect.Intersects(page_rect))
-      continue;
-    // draw this page
-    cairo_save(cr);
-
-    page_rect.CairoRectangle(cr);
-    cairo_clip(cr);
-
-    cairo_translate(cr, page_rect.origin_.x_, page_rect.origin_.y_);
-    cairo_scale(cr, zoom_, zoom_);
-
-    // Draw graphics
-    for (Graphic* gr = bottom_graphic_; gr; gr = gr->upper_sibling_) {
-      if (gr->Page() != i)
+  {
+    TRACE_EVENT("DocumentView::DrawRect graphics");
+    for (int i = MinPageForRect(rect), e = MaxPageForRect(rect);
+         i <= e; i++) {
+      Rect page_rect = PageRect(i);
+      if (!rect.Intersects(page_rect))
         continue;
-      gr->Draw(cr, GraphicIsSelected(gr));
-    }
+      // draw this page
+      cairo_save(cr);
+
+      page_rect.CairoRectangle(cr);
+      cairo_clip(cr);
+
+      cairo_translate(cr, page_rect.origin_.x_, page_rect.origin_.y_);
+      cairo_scale(cr, zoom_, zoom_);
+
+      // Draw graphics. Pad by a point to cover antialiasing.
+      Rect page_dirty =
+          ConvertRectToPage(rect.Intersect(page_rect), i).InsetBy(-1.0);
+      vector<Graphic*> graphics;
+      graphic_index_.GraphicsInRect(i, page_dirty, &graphics);
+      for (Graphic* gr : graphics) {
+        // Graphics being worked on change too often to be worth caching.
+        if (gr->WantsRasterCache() && !GraphicIsSelected(gr) &&
+            gr != placing_graphic_ && gr != editing_graphic_)
+          graphic_cache_.Draw(cr, gr, zoom_ * device_zoom);
+        else
+          gr->Draw(cr, GraphicIsSelected(gr));
+      }
 
-    cairo_restore(cr);
+      cairo_restore(cr);
+    }
   }
 
   // draw knobs
-  for (Graphic* gr = bottom_graphic_; gr; gr = gr->upper_sibling_) {
-    if (selected_graphics_.find(gr) == selected_graphics_.end())
-      continue;
+  TRACE_EVENT("DocumentView::DrawRect knobs");
+  for (Graphic* gr : SelectedGraphicsInZOrder()) {
     cairo_save(cr);
     Rect page_rect = PageRect(gr->Page());
     cairo_translate(cr, page_rect.origin_.x_, page_rect.origin_.y_);
@@ -371,56 +583,12 @@ void DocumentView::DrawRect(cairo_t* cr, const Rect& rect) {
   }
 }
 
-namespace {
-cairo_status_t HandleCairoStreamWrite(void* closure,
-                                      const unsigned char *data,
-                                      unsigned int length) {
-  vector<char>* out = reinterpret_cast<vector<char>*>(closure);
-  out->insert(out->end(), data, data + length);
-  return CAIRO_STATUS_SUCCESS;
-}
-}  // namespace {}
-
-void DocumentView::ExportPDF(vector<char>* out) {
-  if (!poppler_doc_.get()) {
-    printf("can't export w/o a doc\n");
-    return;
-  }
-  cairo_surface_t *surface = cairo_pdf_surface_create_for_stream(
-      HandleCairoStreamWrite, out, 6 * 72, 6 * 72);
-  cairo_t* cr = cairo_create(surface);
-  poppler::page_renderer renderer;
-  for (int i = 0; i < poppler_doc_->pages(); i++) {
-    Size pg_size = PageSize(i);
-    cairo_pdf_surface_set_size(surface, pg_size.width_, pg_size.height_);
-    // for each page:
-    cairo_save(cr);
-    unique_ptr<poppler::page> page(poppler_doc_->create_page(i));
-    if (!page.get())
-      printf("BUG: NULL page during export\n");
-    renderer.cairo_render_page(cr,
-                               page.get(),
-                               true);  // TODO(adlr): rotation?
-    // Draw graphics
-    for (Graphic* gr = bottom_graphic_; gr; gr = gr->upper_sibling_) {
-      if (gr->Page() != i)
-        continue;
-      gr->Draw(cr, false);
-    }
-    cairo_restore(cr);
-    cairo_surface_show_page(surface);
-  }
-  cairo_destroy(cr);
-  cairo_surface_finish(surface);
-  cairo_surface_destroy(surface);
-}
-
 View* DocumentView::OnMouseDown(const MouseInputEvent& event) {
   if (!selected_graphics_.empty()) {
-    // See if we hit a knob
-    for (Graphic* gr = top_graphic_.get(); gr; gr = gr->lower_sibling_.get()) {
-      if (selected_graphics_.find(gr) == selected_graphics_.end())
-        continue;
+    // See if we hit a knob, top-most graphic first
+    vector<Graphic*> selected = SelectedGraphicsInZOrder();
+    for (auto it = selected.rbegin(), e = selected.rend(); it != e; ++it) {
+      Graphic* gr = *it;
       Point pos = ConvertPointToPage(event.position().TranslatedBy(0.5, 0.5),
                                      gr->Page());
       int knob = kKnobNone;
@@ -456,6 +624,7 @@ View* DocumentView::OnMouseDown(const MouseInputEvent& event) {
       printf("error serializing!\n");
     }
     if (old_graphic_state != new_graphic_state) {
+      MarkUnsaved(editing_graphic_);
       Graphic* editing_graphic = editing_graphic_;
       undo_manager_->AddClosure([this, editing_graphic, old_graphic_state] () {
           RestoreGraphicUndo(editing_graphic, old_graphic_state);
@@ -470,39 +639,52 @@ View* DocumentView::OnMouseDown(const MouseInputEvent& event) {
     return this;
 
   if (toolbox_->CurrentTool() == Toolbox::ARROW) {
-    // See if we hit a graphic
-    for (Graphic* gr = top_graphic_.get(); gr; gr = gr->lower_sibling_.get()) {
-      Point page_pos = ConvertPointToPage(event.position().TranslatedBy(0.5, 0.5),
-                                          gr->Page());
-      if (gr->frame_.Contains(page_pos)) {
-        if (event.ClickCount() == 1) {
-          if (!GraphicIsSelected(gr)) {
-            if (!(event.modifiers() & KeyboardInputEvent::kShift))
-              selected_graphics_.clear();
-            selected_graphics_.insert(gr);
-          }
-          start_move_page_ = last_move_page_ =
-              PageForPoint(event.position());
-          start_move_pos_ = last_move_pos_ =
-              ConvertPointToPage(event.position(), start_move_page_);
-        } else if (event.ClickCount() == 2 &&
-                   gr->Editable()) {
-          if (editing_graphic_) {
-            printf("Already editing!\n");
-            return this;
-          }
-          for (auto sel_gr : selected_graphics_) {
-            sel_gr->SetNeedsDisplay(false);
-          }
-          selected_graphics_.clear();
-          editing_graphic_ = gr;
-          editing_checkpoint_.reset(new pdfsketchproto::Graphic);
-          gr->Serialize(editing_checkpoint_.get());
-          gr->BeginEditing(undo_manager_);
+    // See if we hit a graphic. Graphics can hang over the edge of their
+    // page into the gap, so ones on the pages either side of the one
+    // under the mouse are candidates too. The top-most hit wins.
+    int point_page = PageForPoint(event.position());
+    vector<Graphic*> hits;
+    for (int page : { point_page - 1, point_page, point_page + 1 }) {
+      if (page < 0 || page >= static_cast<int>(pages_.size()))
+        continue;
+      Point page_pos = ConvertPointToPage(
+          event.position().TranslatedBy(0.5, 0.5), page);
+      vector<Graphic*> page_hits;
+      graphic_index_.GraphicsInRect(page, Rect(page_pos, Size()), &page_hits);
+      for (Graphic* gr : page_hits)
+        if (gr->frame_.Contains(page_pos))
+          hits.push_back(gr);
+    }
+    if (!hits.empty()) {
+      graphic_index_.SortByZOrder(&hits);
+      Graphic* gr = hits.back();
+      if (event.ClickCount() == 1) {
+        if (!GraphicIsSelected(gr)) {
+          if (!(event.modifiers() & KeyboardInputEvent::kShift))
+            selected_graphics_.clear();
+          selected_graphics_.insert(gr);
         }
-        gr->SetNeedsDisplay(true);
-        return this;
+        start_move_page_ = last_move_page_ =
+            PageForPoint(event.position());
+        start_move_pos_ = last_move_pos_ =
+            ConvertPointToPage(event.position(), start_move_page_);
+      } else if (event.ClickCount() == 2 &&
+                 gr->Editable()) {
+        if (editing_graphic_) {
+          printf("Already editing!\n");
+          return this;
+        }
+        for (auto sel_gr : selected_graphics_) {
+          sel_gr->SetNeedsDisplay(false);
+        }
+        selected_graphics_.clear();
+        editing_graphic_ = gr;
+        editing_checkpoint_.reset(new pdfsketchproto::Graphic);
+        gr->Serialize(editing_checkpoint_.get());
+        gr->BeginEditing(undo_manager_);
       }
+      gr->SetNeedsDisplay(true);
+      return this;
     }
     // Didn't hit any graphics. Select none.
     for (auto gr : selected_graphics_)
@@ -519,11 +701,14 @@ View* DocumentView::OnMouseDown(const MouseInputEvent& event) {
   }
 
   shared_ptr<Graphic> gr = GraphicFactory::NewGraphic(toolbox_->CurrentTool());
+  // Half a view unit (mouse positions are whole units)
+  gr->set_place_tolerance(0.5 / zoom_);
   AddGraphic(gr);
   int page = PageForPoint(event.position());
   Point page_pos = ConvertPointToPage(event.position().TranslatedBy(0.5, 0.5),
                                       page);
   gr->Place(page, page_pos);
+  GraphicBoundsChanged(gr.get());
   placing_graphic_ = gr.get();
   return this;
 }
@@ -540,6 +725,7 @@ void DocumentView::OnMouseDrag(const MouseInputEvent& event) {
     Point page_pos = ConvertPointToPage(event.position().TranslatedBy(0.5, 0.5),
                                         placing_graphic_->Page());
     placing_graphic_->PlaceUpdate(page_pos);
+    GraphicBoundsChanged(placing_graphic_);
     return;
   }
 
@@ -573,6 +759,7 @@ void DocumentView::OnMouseDrag(const MouseInputEvent& event) {
       (*it)->SetNeedsDisplay(true);
       (*it)->frame_.origin_ = (*it)->frame_.origin_.TranslatedBy(dx, dy);
       (*it)->SetNeedsDisplay(true);
+      MarkUnsaved(*it);
     }
     last_move_pos_ = pos;
   }
@@ -601,6 +788,7 @@ void DocumentView::OnMouseUp(const MouseInputEvent& event) {
     Rect original_frame = resize_graphic_original_frame_;
     Graphic* resizing_graphic = resizing_graphic_;
     if (original_frame != resizing_graphic_->Frame()) {
+      MarkUnsaved(resizing_graphic);
       // Generate undo op
       undo_manager_->AddClosure(
           [this, resizing_graphic, original_frame] () {
@@ -617,6 +805,8 @@ void DocumentView::OnMouseUp(const MouseInputEvent& event) {
     if (placing_graphic_->PlaceComplete()) {
       RemoveGraphic(placing_graphic_);
     } else {
+      GraphicBoundsChanged(placing_graphic_);
+      MarkUnsaved(placing_graphic_);
       if (undo_manager_) {
         set<Graphic*> gr;
         gr.insert(placing_graphic_);
@@ -695,6 +885,8 @@ bool DocumentView::OnPaste(const string& str) {
     for (int i = 0; i < msg.graphic_size(); i++) {
       const pdfsketchproto::Graphic& gr = msg.graphic(i);
       shared_ptr<Graphic> new_graphic(GraphicFactory::NewGraphic(gr));
+      // It's a copy, so it needs its own id
+      new_graphic->set_id(Graphic::NewId());
       // Set to current page
       new_graphic->SetPage(page);
       // Move the graphic a tad when pasting
@@ -739,6 +931,7 @@ void DocumentView::MoveGraphicsUndo(const std::set<Graphic*>& graphics,
     (*it)->frame_.origin_ = (*it)->frame_.origin_.TranslatedBy(dx, dy);
     (*it)->SetPage((*it)->Page() + dpage);
     (*it)->SetNeedsDisplay(true);
+    MarkUnsaved(*it);
   }
   if (!undo_manager_)
     return;
@@ -753,6 +946,7 @@ void DocumentView::SetGraphicFrameUndo(Graphic* gr, Rect frame) {
   gr->SetNeedsDisplay(true);
   gr->frame_ = frame;
   gr->SetNeedsDisplay(true);
+  MarkUnsaved(gr);
   undo_manager_->AddClosure([this, gr, prev_frame] () {
       SetGraphicFrameUndo(gr, prev_frame);
     });
@@ -822,6 +1016,7 @@ bool DocumentView::OnKeyDown(const KeyboardInputEvent& event) {
       gr->SetNeedsDisplay(true);
       gr->SetFrame(gr->Frame().TranslatedBy(dx, dy));
       gr->SetNeedsDisplay(true);
+      MarkUnsaved(gr);
     }
   }
   return true;
@@ -835,6 +1030,21 @@ bool DocumentView::OnKeyUp(const KeyboardInputEvent& event) {
   return true;
 }
 
+void DocumentView::GraphicBoundsChanged(Graphic* graphic) {
+  graphic_index_.Update(graphic);
+}
+
+void DocumentView::MarkUnsaved(Graphic* graphic) {
+  if (graphic_index_.Contains(graphic))
+    unsaved_graphics_.insert(graphic);
+}
+
+vector<Graphic*> DocumentView::SelectedGraphicsInZOrder() const {
+  vector<Graphic*> ret(selected_graphics_.begin(), selected_graphics_.end());
+  graphic_index_.SortByZOrder(&ret);
+  return ret;
+}
+
 void DocumentView::SetNeedsDisplayInPageRect(int page, const Rect& rect) {
   Rect local(ConvertPointFromPage(rect.UpperLeft(), page),
              ConvertPointFromPage(rect.LowerRight(), page));
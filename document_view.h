@@ -3,14 +3,24 @@
 #ifndef PDFSKETCH_DOCUMENT_VIEW_H__
 #define PDFSKETCH_DOCUMENT_VIEW_H__
 
+#include <functional>
+#include <map>
+#include <memory>
 #include <set>
 #include <stdlib.h>
 #include <vector>
 
 #include <poppler-document.h>
+#include <poppler-page.h>
 
+#include "byte_buffer.h"
 #include "graphic.h"
+#include "graphic_index.h"
+#include "graphic_raster_cache.h"
+#include "page_index.h"
+#include "page_tile_cache.h"
 #include "scroll_bar_view.h"
+#include "tile_rasterizer.h"
 #include "toolbox.h"
 #include "undo_manager.h"
 #include "view.h"
@@ -23,19 +33,54 @@ class DocumentView : public View,
   DocumentView() {}
   virtual std::string Name() const { return "DocumentView"; }
   virtual void DrawRect(cairo_t* cr, const Rect& rect);
-  void LoadFromPDF(const char* pdf_doc, size_t pdf_doc_length);
-  void GetPDFData(const char** out_buf, size_t* out_len) const;
+  // Shows the PDF in 'pdf_doc', which must stay unchanged while this
+  // view uses it. 'parsed' may be a poppler document already made from
+  // 'pdf_doc', to save parsing it again, or NULL.
+  void LoadFromPDF(const ByteBuffer& pdf_doc,
+                   std::unique_ptr<poppler::document> parsed);
+  const ByteBuffer& pdf_data() const { return poppler_doc_data_; }
+  int page_count() const { return pages_.size(); }
   void SetZoom(double zoom);
-  void ExportPDF(std::vector<char>* out);
   void Serialize(pdfsketchproto::Document* msg) const {
     SerializeGraphics(false, msg);
   }
+  // Incremental saves. Changes are tracked until a save that has them
+  // is stored. A graphic being edited is only recorded as changed when
+  // editing ends, but deltas made meanwhile include it.
+  bool HasUnsavedChanges() const {
+    return !unsaved_graphics_.empty() || !unsaved_removed_ids_.empty() ||
+        editing_graphic_;
+  }
+  void SerializeUnsavedChanges(pdfsketchproto::DocumentDelta* msg) const;
+  // Sets the changes so far aside as being written by save 'id'. Later
+  // changes are tracked apart from them.
+  void BeginSave(int id);
+  // Forgets the changes save 'id' had once it's stored, or, if it
+  // couldn't be, makes them unsaved again.
+  void FinishSave(int id, bool stored);
+  // Forgets all changes, e.g. after loading a file.
+  void MarkSaved();
+  // Applies changes read back from a file. Not undoable.
+  void ApplyDelta(const pdfsketchproto::DocumentDelta& msg);
   void SetToolbox(Toolbox* toolbox) {
     toolbox_ = toolbox;
   }
   void SetUndoManager(UndoManager* undo_manager) {
     undo_manager_ = undo_manager;
   }
+  // Limits the memory used to hold rendered page tiles.
+  void SetTileCacheBudget(size_t bytes) {
+    tile_cache_.SetByteBudget(bytes);
+  }
+  // Once set, page tiles are rendered on background threads. 'runner'
+  // must run the function passed to it on the thread that owns this
+  // view. Without it, tiles are rendered during DrawRect().
+  void SetRenderThreadRunner(
+      const std::function<void (std::function<void ()>)>& runner);
+  // Whether background rendering has tiles yet to deliver.
+  bool TilesOutstanding() {
+    return rasterizer_.get() && rasterizer_->HasOutstandingTiles();
+  }
 
   void AddGraphic(std::shared_ptr<Graphic> graphic) {
     InsertGraphicAfter(graphic, NULL);
@@ -43,6 +88,7 @@ class DocumentView : public View,
   void InsertImage(const char* data, size_t length);
   // GraphicDelegate methods
   virtual void SetNeedsDisplayInPageRect(int page, const Rect& rect);
+  virtual void GraphicBoundsChanged(Graphic* graphic);
   virtual Point ConvertPointFromGraphic(int page, const Point& point) {
     return ConvertPointFromPage(point, page);
   }
@@ -70,6 +116,9 @@ class DocumentView : public View,
   void SerializeGraphics(bool selected_only,
                          pdfsketchproto::Document* msg) const;
 
+  // Reads page sizes from poppler_doc_. Called once per document.
+  void LoadPageGeometry();
+  // Lays out pages at the current zoom.
   void UpdateSize();
   Size PageSize(int page) const;  // graphic/PDF coords
   Rect PageRect(int page) const;  // view coords
@@ -91,11 +140,29 @@ class DocumentView : public View,
   void GetVisibleCenterPageAndPoint(Point* out_point,
                                     int* out_page) const;
 
+  // Draws the part of 'page' within 'rect' (view coords) from page
+  // tiles, rendering missing tiles as the per-draw budget allows.
+  // 'device_zoom' is device pixels per view unit.
+  void DrawPageTiles(cairo_t* cr, int page, const Rect& rect,
+                     double device_zoom, int* tiles_rendered);
+  // Draws whichever tiles of 'page' exist at 'scale' over 'rect'.
+  // Used to show a scaled placeholder while exact tiles are missing.
+  void DrawPlaceholderTiles(cairo_t* cr, int page, const Rect& rect,
+                            int scale);
+  // Returns the view-coords rect of the given tile.
+  Rect TileRect(const TileKey& key) const;
+  // Queues tiles just outside of the visible area for rendering.
+  void PrefetchTiles(double device_zoom);
+  // Moves tiles from rasterizer_ into the cache and displays them.
+  void AcceptRasterizedTiles();
+
   void InsertGraphicAfter(std::shared_ptr<Graphic> graphic,
                           Graphic* upper_sibling);
   void InsertGraphicAfterUndo(std::shared_ptr<Graphic> graphic,
                               Graphic* upper_sibling);
 
+  std::vector<Graphic*> SelectedGraphicsInZOrder() const;
+
   bool GraphicIsSelected(Graphic* graphic) {
     return selected_graphics_.find(graphic) != selected_graphics_.end();
   }
@@ -114,19 +181,47 @@ class DocumentView : public View,
   std::shared_ptr<Graphic> RemoveGraphic(Graphic* graphic);
 
   // poppler::SimpleDocument* doc_;
-  std::vector<char> poppler_doc_data_;
+  ByteBuffer poppler_doc_data_;
   std::unique_ptr<poppler::document> poppler_doc_;
-  float cached_surface_device_zoom_{1.0};
-  Rect cached_subrect_;
-  cairo_surface_t* cached_surface_{nullptr};  // TODO(adlr): free in dtor
-
-  // Cached page top/bottoms
-  std::vector<std::pair<double, double>> page_y_;
+  PageTileCache tile_cache_;
+  // Images of graphics that are slow to draw
+  GraphicRasterCache graphic_cache_;
+  std::unique_ptr<TileRasterizer> rasterizer_;
+  std::function<void (std::function<void ()>)> render_thread_runner_;
+
+  // Geometry of each page, so that coordinate conversions don't need
+  // to touch poppler.
+  struct PageGeometry {
+    // graphic/PDF coords. Page rotation isn't applied (see
+    // TileRasterizer::RenderTile()).
+    Size native_size;
+  };
+  std::vector<PageGeometry> pages_;
+  // Page positions in view coords, at the current zoom
+  PageIndex page_index_;
+
+  // Records a change to 'graphic' for the next save. Called where
+  // graphics are changed, not where they're redisplayed, as selecting
+  // a graphic or moving a caret doesn't need saving.
+  void MarkUnsaved(Graphic* graphic);
+
+  // Changed/removed since the last BeginSave(). A graphic leaves
+  // unsaved_graphics_ (and saving_) when it's removed.
+  std::set<Graphic*> unsaved_graphics_;
+  std::set<uint64_t> unsaved_removed_ids_;
+  // Changes that saves being written have, by save id
+  struct SavingChanges {
+    std::set<Graphic*> graphics;
+    std::set<uint64_t> removed_ids;
+  };
+  std::map<int, SavingChanges> saving_;
 
   double zoom_{1.0};
   Toolbox* toolbox_{nullptr};
   std::shared_ptr<Graphic> top_graphic_;
   Graphic* bottom_graphic_{nullptr};
+  // Where the graphics above are, by page
+  GraphicIndex graphic_index_;
   Graphic* placing_graphic_{nullptr};
   Graphic* editing_graphic_{nullptr};
   // When editing starts, we keep a checkpoint here for undo purposes:
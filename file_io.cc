@@ -2,16 +2,21 @@
 
 #include "file_io.h"
 
+#include <algorithm>
+#include <map>
 #include <memory>
+#include <utility>
 
-#include <podofo/doc/PdfFileSpec.h>
-#include <podofo/doc/PdfMemDocument.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 #include <poppler/cpp/poppler-document.h>
 #include <poppler/cpp/poppler-embedded-file.h>
 
 #include "document.pb.h"
 #include "document_view.h"
 #include "graphic_factory.h"
+#include "pdf_exporter.h"
+#include "trace.h"
 
 using std::make_shared;
 using std::string;
@@ -23,17 +28,30 @@ using std::vector;
 // All integers are big endian.
 //
 // char[4] magic:     'skch'
-// uint32  version:   1
-// uint32  num_pdfs:  Number of PDFs embedded. Must be 1 for now.
-// uint64  pdf_len:   Number of bytes in PDF
-// char[pdf_len] pdf: PDF Data
+// uint32  version:   2 (1 is still read; it has no delta records)
+// uint32  num_pdfs:  Number of PDFs embedded: 1, or 0 for a file
+//                    embedded in the PDF it annotates
+// uint64  pdf_len:   Number of bytes in PDF. With no PDF embedded, the
+//                    length of the prefix of the host PDF that is the
+//                    original (exports only append an update to it).
+// char[pdf_len] pdf: PDF Data; absent if num_pdfs is 0
 // uint64  overlay_len: Length of overlay protobuf
-// char[overlay_len] overlays: Overlays protobuf data
+// char[overlay_len] overlays: Overlays protobuf data (Document)
+//
+// Then, to the end of the file, zero or more delta records, each
+// appended by an incremental save:
+// uint64  delta_len: Length of delta protobuf
+// char[delta_len] delta: DocumentDelta protobuf data
+//
+// A truncated final record (e.g. from an interrupted save) is ignored.
 
 namespace pdfsketch {
 
 namespace {
 const char kMagic[] = {'s', 'k', 'c', 'h'};
+const uint32_t kVersion = 2;
+// Name of the .pdfsketch file embedded in exported PDFs
+const char kEmbeddedFileName[] = "source.pdfsketch";
 uint32_t DecodeUInt32(const unsigned char* buf) {
   return
       (static_cast<uint32_t>(buf[0]) << (8 * 3)) |
@@ -68,16 +86,60 @@ void EncodeUInt64(uint64_t num, char* out) {
   out[6] = (num >> (8 * 1)) & 0xff;
   out[7] = (num >> (8 * 0)) & 0xff;
 }
-void PushUInt32(uint32_t num, vector<char>* out) {
+bool PushUInt32(uint32_t num, ByteSink* out) {
   char buf[4];
   EncodeUInt32(num, buf);
-  out->insert(out->end(), buf, buf + sizeof(buf));
+  return out->Write(buf, sizeof(buf));
 }
-void PushUInt64(uint32_t num, vector<char>* out) {
+bool PushUInt64(uint64_t num, ByteSink* out) {
   char buf[8];
   EncodeUInt64(num, buf);
-  out->insert(out->end(), buf, buf + sizeof(buf));
+  return out->Write(buf, sizeof(buf));
 }
+
+// Lets protobuf serialize straight into a ByteSink
+class SinkOutputStream
+    : public google::protobuf::io::CopyingOutputStream {
+ public:
+  explicit SinkOutputStream(ByteSink* sink) : sink_(sink) {}
+  virtual bool Write(const void* buffer, int size) {
+    return sink_->Write(static_cast<const char*>(buffer), size);
+  }
+
+ private:
+  ByteSink* sink_;
+};
+
+size_t MessageSize(const google::protobuf::MessageLite& msg) {
+#if GOOGLE_PROTOBUF_VERSION >= 3004000
+  return msg.ByteSizeLong();
+#else
+  return msg.ByteSize();
+#endif
+}
+
+// Writes the length of 'msg' and then 'msg'. 'msg_len' must be the
+// result of MessageSize(msg).
+bool PushMessage(const google::protobuf::MessageLite& msg, size_t msg_len,
+                 ByteSink* out) {
+  if (!PushUInt64(msg_len, out))
+    return false;
+  SinkOutputStream sink_stream(out);
+  google::protobuf::io::CopyingOutputStreamAdaptor adaptor(&sink_stream);
+  {
+    google::protobuf::io::CodedOutputStream coded(&adaptor);
+    msg.SerializeWithCachedSizes(&coded);
+    if (coded.HadError()) {
+      printf("%s: error serializing\n", __func__);
+      return false;
+    }
+  }
+  return adaptor.Flush();
+}
+
+// PDF data is written in pieces this big, so that sinks that buffer
+// never hold much of it at once.
+const size_t kPDFChunkSize = 1024 * 1024;
 // Returns buf advanced past the parsed item
 const char* ParseUInt32(const char* buf, uint32_t* out) {
   *out = DecodeUInt32(reinterpret_cast<const unsigned char*>(buf));
@@ -87,21 +149,54 @@ const char* ParseUInt64(const char* buf, uint64_t* out) {
   *out = DecodeUInt64(reinterpret_cast<const unsigned char*>(buf));
   return buf + 8;
 }
+
+// Writes a .pdfsketch file with no delta records. If 'embed_pdf' is
+// false, the PDF is left out and only its length recorded, for a file
+// embedded in a PDF that starts with the original.
+bool WriteSkch(const DocumentSnapshot& doc, bool embed_pdf,
+               const ProgressFunction& progress, ByteSink* out) {
+  const pdfsketchproto::Document& msg = doc.graphics;
+  // Also caches sizes for SerializeWithCachedSizes() below
+  size_t msg_len = MessageSize(msg);
+  const ByteBuffer& pdfdata = doc.pdf;
+  size_t embedded_len = embed_pdf ? pdfdata.size() : 0;
+  uint64_t total = sizeof(kMagic) + 4 + 4 + 8 + embedded_len + 8 + msg_len;
+  if (!out->Reserve(total)) {
+    printf("%s: can't reserve %llu bytes\n", __func__,
+           static_cast<unsigned long long>(total));
+    return false;
+  }
+
+  if (!out->Write(kMagic, sizeof(kMagic)) ||
+      !PushUInt32(kVersion, out) ||
+      !PushUInt32(embed_pdf ? 1 : 0, out) ||  // number of pdfs
+      !PushUInt64(pdfdata.size(), out))
+    return false;
+  for (size_t pos = 0; pos < embedded_len; pos += kPDFChunkSize) {
+    if (progress && !progress(pos, total))
+      return false;
+    size_t len = std::min(kPDFChunkSize, embedded_len - pos);
+    if (!out->Write(pdfdata.data() + pos, len))
+      return false;
+  }
+  if (!PushMessage(msg, msg_len, out) || !out->Flush())
+    return false;
+  return !progress || progress(total, total);
+}
 }  // namespace {}
 
-void FileIO::OpenPDF(const char* doc, size_t doc_len,
-                     DocumentView* document_view) {
+void FileIO::OpenPDF(const ByteBuffer& doc, DocumentView* document_view) {
   const char kMagic[] = {'s', 'k', 'c', 'h'};
-  if (doc_len < sizeof(kMagic))
+  if (doc.size() < sizeof(kMagic))
     return;
-  if (!strncmp(doc, kMagic, sizeof(kMagic))) {
+  if (!strncmp(doc.data(), kMagic, sizeof(kMagic))) {
     printf("loading saved file\n");
-    OpenSkch(doc, doc_len, document_view);
+    OpenSkch(doc, document_view);
   } else {
     // Loading PDF. Check for embedded save file
 
     unique_ptr<poppler::document> poppler_doc(
-        poppler::document::load_from_raw_data(doc, doc_len));
+        poppler::document::load_from_raw_data(doc.data(), doc.size()));
     if (!poppler_doc.get()) {
       printf("can't make poppler doc from data\n");
       return;
@@ -109,23 +204,34 @@ void FileIO::OpenPDF(const char* doc, size_t doc_len,
     if (poppler_doc->has_embedded_files()) {
       for (auto file : poppler_doc->embedded_files()) {
         if (file->is_valid() &&
-            file->name() == "source.pdfsketch" &&
-            file->size() > sizeof(kMagic)) {
+            file->name() == kEmbeddedFileName &&
+            file->size() > static_cast<int>(sizeof(kMagic))) {
           printf("loading embedded save file\n");
-          vector<char> data = file->data();
-          OpenSkch(&data[0], data.size(), document_view);
+          // poppler only hands out a copy. It's small: the PDF it
+          // annotates is the start of 'doc'.
+          ByteBuffer data = ByteBuffer::FromVector(file->data());
+          poppler_doc.reset();
+          OpenSkch(data, document_view, doc);
           return;
         }
       }
     }
     printf("no save file found. making new doc\n");
-    document_view->LoadFromPDF(doc, doc_len);
+    document_view->LoadFromPDF(doc, std::move(poppler_doc));
   }
 }
 
-void FileIO::OpenSkch(const char* buf, size_t len,
-                      DocumentView* doc) {
+void FileIO::OpenSkch(const ByteBuffer& file, DocumentView* doc,
+                      const ByteBuffer& host_pdf) {
+  TRACE_EVENT("FileIO::OpenSkch");
+  const char* buf = file.data();
+  size_t len = file.size();
   size_t start = (size_t)buf;
+  // magic, version, num_pdfs, pdf_len
+  if (len < sizeof(kMagic) + 4 + 4 + 8) {
+    printf("%s: File too short\n", __func__);
+    return;
+  }
   if (strncmp(buf, kMagic, sizeof(kMagic))) {
     printf("%s: Missing magic\n", __func__);
     return;
@@ -135,7 +241,7 @@ void FileIO::OpenSkch(const char* buf, size_t len,
   uint32_t version = 0;
   buf = ParseUInt32(buf, &version);
   printf("now at (after version parse) %zu\n", ((size_t)buf) - start);
-  if (version != 1) {
+  if (version != 1 && version != kVersion) {
     printf("%s: Invalid version\n", __func__);
     return;
   }
@@ -143,22 +249,26 @@ void FileIO::OpenSkch(const char* buf, size_t len,
   printf("parsing at offset %zu: %d %d %d %d\n", ((size_t)buf) - start,
          buf[0], buf[1], buf[2], buf[3]);
   buf = ParseUInt32(buf, &num_pdfs);
-  if (num_pdfs != 1) {
+  if (num_pdfs > 1 || (num_pdfs == 0 && host_pdf.empty())) {
     printf("%s: Invalid PDF count: %d\n", __func__, num_pdfs);
     return;
   }
   uint64_t pdfdata_len = 0;
   buf = ParseUInt64(buf, &pdfdata_len);
-  if (pdfdata_len > len) {
+  size_t pdf_offset = ((size_t)buf) - start;
+  size_t embedded_len = num_pdfs ? pdfdata_len : 0;
+  if (len - pdf_offset < 8 || embedded_len > len - pdf_offset - 8 ||
+      (!num_pdfs && pdfdata_len > host_pdf.size())) {
     // sanity check
     printf("%s: PDF too big\n", __func__);
     return;
   }
-  const char* pdf_doc = buf;
-  buf += pdfdata_len;
+  ByteBuffer pdf = num_pdfs ? file.Slice(pdf_offset, pdfdata_len) :
+      host_pdf.Slice(0, pdfdata_len);
+  buf += embedded_len;
   uint64_t overlay_len = 0;
   buf = ParseUInt64(buf, &overlay_len);
-  if (overlay_len > len) {
+  if (overlay_len > len - (((size_t)buf) - start)) {
     // sanity check
     printf("%s: overlays too big\n", __func__);
     return;
@@ -168,30 +278,100 @@ void FileIO::OpenSkch(const char* buf, size_t len,
     printf("protobuf decode failed\n");
     return;
   }
-  doc->LoadFromPDF(pdf_doc, pdfdata_len);
+  doc->LoadFromPDF(pdf, nullptr);
   for (int i = 0; i < msg.graphic_size(); i++) {
     const pdfsketchproto::Graphic& gr = msg.graphic(i);
     doc->AddGraphic(GraphicFactory::NewGraphic(gr));
   }
+  buf += overlay_len;
+
+  int deltas = 0;
+  while (version >= 2) {
+    size_t remaining = len - (((size_t)buf) - start);
+    if (remaining == 0)
+      break;
+    uint64_t delta_len = 0;
+    if (remaining >= 8)
+      buf = ParseUInt64(buf, &delta_len);
+    if (remaining < 8 || delta_len > remaining - 8) {
+      printf("%s: ignoring truncated delta record\n", __func__);
+      break;
+    }
+    pdfsketchproto::DocumentDelta delta;
+    if (!delta.ParseFromArray(buf, delta_len)) {
+      printf("%s: ignoring bad delta record\n", __func__);
+      break;
+    }
+    doc->ApplyDelta(delta);
+    buf += delta_len;
+    deltas++;
+  }
+  if (deltas)
+    printf("%s: applied %d delta records\n", __func__, deltas);
+  doc->MarkSaved();
 }
 
-void FileIO::Save(const DocumentView& doc, std::vector<char>* out) {
-  out->insert(out->end(), kMagic, kMagic + sizeof(kMagic));
-  PushUInt32(1, out);  // version
-  PushUInt32(1, out);  // number of pdfs
-  const char* pdfdata = NULL;
-  size_t pdfdata_len = 0;
-  doc.GetPDFData(&pdfdata, &pdfdata_len);
-  PushUInt64(pdfdata_len, out);
-  out->insert(out->end(), pdfdata, pdfdata + pdfdata_len);  // pdf data
-  pdfsketchproto::Document msg;
-  doc.Serialize(&msg);
-  string msg_buf;
-  if (!msg.SerializeToString(&msg_buf)) {
-    printf("error serializing to string\n");
+void FileIO::Snapshot(const DocumentView& doc, DocumentSnapshot* out) {
+  TRACE_EVENT("FileIO::Snapshot");
+  out->pdf = doc.pdf_data();
+  doc.Serialize(&out->graphics);
+}
+
+bool FileIO::Save(const DocumentSnapshot& doc,
+                  const ProgressFunction& progress, ByteSink* out) {
+  TRACE_EVENT("FileIO::Save");
+  return WriteSkch(doc, true, progress, out);
+}
+
+bool FileIO::Save(const DocumentView& doc, ByteSink* out) {
+  DocumentSnapshot snapshot;
+  Snapshot(doc, &snapshot);
+  return Save(snapshot, ProgressFunction(), out);
+}
+
+bool FileIO::SaveDelta(const DocumentView& doc, ByteSink* out) {
+  TRACE_EVENT("FileIO::SaveDelta");
+  pdfsketchproto::DocumentDelta msg;
+  doc.SerializeUnsavedChanges(&msg);
+  size_t msg_len = MessageSize(msg);
+  return out->Reserve(8 + msg_len) &&
+      PushMessage(msg, msg_len, out) && out->Flush();
+}
+
+bool FileIO::ExportPDF(const DocumentSnapshot& doc, int num_threads,
+                       const ProgressFunction& progress, ByteSink* out) {
+  TRACE_EVENT("FileIO::ExportPDF");
+  if (doc.pdf.empty()) {
+    printf("%s: can't export w/o a doc\n", __func__);
+    return false;
   }
-  PushUInt64(msg_buf.size(), out);
-  out->insert(out->end(), msg_buf.begin(), msg_buf.end());
+  // The exported PDF starts with doc.pdf unchanged, so the embedded
+  // file needs only the overlays and the original's length.
+  vector<char> source;
+  VectorByteSink source_sink(&source);
+  if (!WriteSkch(doc, false, ProgressFunction(), &source_sink))
+    return false;
+
+  // Indexes into doc.graphics of each annotated page's graphics
+  std::map<int, vector<int>> page_graphics;
+  for (int i = 0; i < doc.graphics.graphic_size(); i++)
+    page_graphics[doc.graphics.graphic(i).page()].push_back(i);
+  vector<int> pages;
+  for (const auto& it : page_graphics)
+    pages.push_back(it.first);
+  // Each worker rebuilds the page's graphics for itself. They have no
+  // delegate, so nothing is shared with the document or other workers.
+  auto draw = [&doc, &page_graphics] (int page, cairo_t* cr) {
+    for (int i : page_graphics.find(page)->second) {
+      std::shared_ptr<Graphic> gr =
+          GraphicFactory::NewGraphic(doc.graphics.graphic(i));
+      if (gr)
+        gr->Draw(cr, false);
+    }
+  };
+  return PDFExporter::Export(doc.pdf, pages, draw, kEmbeddedFileName,
+                             ByteBuffer::FromVector(std::move(source)),
+                             num_threads, progress, out);
 }
 
 }  // namespace pdfsketch
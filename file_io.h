@@ -5,17 +5,49 @@
 
 #include <vector>
 
+#include "byte_buffer.h"
+#include "byte_sink.h"
+#include "document.pb.h"
 #include "document_view.h"
+#include "progress.h"
 
 namespace pdfsketch {
 
+// What saving or exporting needs from a document. Cheap to take, since
+// the PDF is shared rather than copied, and lets the work run on
+// another thread while the document keeps changing.
+struct DocumentSnapshot {
+  ByteBuffer pdf;
+  // All graphics, bottom first
+  pdfsketchproto::Document graphics;
+};
+
 class FileIO {
  public:
-  static void OpenPDF(const char* doc, size_t doc_len,
-                      DocumentView* document_view);
-  static void OpenSkch(const char* buf, size_t len,
-                       DocumentView* doc);
-  static void Save(const DocumentView& doc, std::vector<char>* out);
+  // Opens a PDF, or a saved file, whether bare or embedded in a PDF.
+  // The document view keeps a reference to (part of) 'doc' rather than
+  // a copy.
+  static void OpenPDF(const ByteBuffer& doc, DocumentView* document_view);
+  // 'host_pdf' is the PDF 'buf' was embedded in, if any; files embedded
+  // by ExportPDF() refer to it rather than carrying their own copy.
+  static void OpenSkch(const ByteBuffer& buf, DocumentView* doc,
+                       const ByteBuffer& host_pdf = ByteBuffer());
+  static void Snapshot(const DocumentView& doc, DocumentSnapshot* out);
+  // Writes 'doc' in .pdfsketch format, as a full snapshot with no delta
+  // records. Returns false if 'out' fails or 'progress' cancels.
+  static bool Save(const DocumentSnapshot& doc,
+                   const ProgressFunction& progress, ByteSink* out);
+  static bool Save(const DocumentView& doc, ByteSink* out);
+  // Writes a record of the changes to 'doc' that no save has stored, to
+  // be appended to the file last written for it. Call BeginSave() on
+  // 'doc' as it's handed off to be stored.
+  static bool SaveDelta(const DocumentView& doc, ByteSink* out);
+  // Writes the PDF with the graphics drawn on it and the overlays
+  // embedded as a .pdfsketch file, so it can be opened again for
+  // editing. Pages are
+  // drawn on 'num_threads' worker threads; progress is in pages.
+  static bool ExportPDF(const DocumentSnapshot& doc, int num_threads,
+                        const ProgressFunction& progress, ByteSink* out);
 };
 
 }  // namespace pdfsketch
@@ -0,0 +1,98 @@
+// Copyright...
+
+#include "font_manager.h"
+
+#include "trace.h"
+
+using std::function;
+using std::lock_guard;
+using std::make_tuple;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+
+namespace pdfsketch {
+
+namespace {
+// Zooming through many scales would otherwise grow the cache forever.
+// Contexts hold their own references, so dropping the cache is safe.
+const size_t kMaxScaledFonts = 64;
+}  // namespace {}
+
+FontManager* FontManager::Get() {
+  static FontManager* manager = new FontManager();
+  return manager;
+}
+
+void FontManager::SetFontLoader(const function<void ()>& loader) {
+  lock_guard<mutex> guard(lock_);
+  loader_ = loader;
+}
+
+void FontManager::EnsureFontsLoaded() {
+  std::call_once(load_once_, [this] () {
+      function<void ()> loader;
+      {
+        lock_guard<mutex> guard(lock_);
+        loader = loader_;
+      }
+      if (loader) {
+        TRACE_EVENT("FontManager::LoadFonts");
+        loader();
+      }
+      fonts_loaded_ = true;
+    });
+}
+
+cairo_font_options_t* FontManager::NewFontOptions() {
+  cairo_font_options_t* options = cairo_font_options_create();
+  cairo_font_options_set_hint_metrics(options, CAIRO_HINT_METRICS_OFF);
+  cairo_font_options_set_hint_style(options, CAIRO_HINT_STYLE_NONE);
+  return options;
+}
+
+shared_ptr<TextShaper> FontManager::Shaper(const string& family,
+                                           cairo_font_slant_t slant,
+                                           cairo_font_weight_t weight,
+                                           double size) {
+  EnsureFontsLoaded();
+  FaceKey face_key = make_tuple(family, static_cast<int>(slant),
+                                static_cast<int>(weight));
+  lock_guard<mutex> guard(lock_);
+  shared_ptr<TextShaper>& shaper = shapers_[make_tuple(face_key, size)];
+  if (shaper)
+    return shaper;
+  cairo_font_face_t*& face = faces_[face_key];
+  if (!face)
+    face = cairo_toy_font_face_create(family.c_str(), slant, weight);
+  cairo_font_options_t* options = NewFontOptions();
+  shaper.reset(new TextShaper(face, size, options));
+  cairo_font_options_destroy(options);
+  return shaper;
+}
+
+void FontManager::SetFont(cairo_t* cr, cairo_font_face_t* face, double size) {
+  cairo_matrix_t ctm;
+  cairo_get_matrix(cr, &ctm);
+  ctm.x0 = ctm.y0 = 0.0;
+  ScaledFontKey key = make_tuple(face, size, ctm.xx, ctm.yx, ctm.xy, ctm.yy);
+  lock_guard<mutex> guard(lock_);
+  std::map<ScaledFontKey, cairo_scaled_font_t*>::iterator it =
+      scaled_fonts_.find(key);
+  if (it == scaled_fonts_.end()) {
+    if (scaled_fonts_.size() >= kMaxScaledFonts) {
+      for (auto& entry : scaled_fonts_)
+        cairo_scaled_font_destroy(entry.second);
+      scaled_fonts_.clear();
+    }
+    cairo_matrix_t font_matrix;
+    cairo_matrix_init_scale(&font_matrix, size, size);
+    cairo_font_options_t* options = NewFontOptions();
+    it = scaled_fonts_.insert(std::make_pair(key, cairo_scaled_font_create(
+        face, &font_matrix, &ctm, options))).first;
+    cairo_font_options_destroy(options);
+  }
+  cairo_set_scaled_font(cr, it->second);
+}
+
+}  // namespace pdfsketch
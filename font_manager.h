@@ -0,0 +1,76 @@
+// Copyright...
+
+#ifndef PDFSKETCH_FONT_MANAGER_H__
+#define PDFSKETCH_FONT_MANAGER_H__
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+
+#include <cairo.h>
+
+#include "text_shaper.h"
+
+namespace pdfsketch {
+
+// Process-wide cache of fonts, shared by all text graphics on all
+// threads. Faces are resolved (through fontconfig) once, and scaled
+// fonts for drawing are kept per face, size and device transform, so
+// painting text doesn't look anything up.
+//
+// The system fonts themselves aren't needed until something asks for a
+// font, so they're made available then, by the loader, rather than at
+// startup.
+
+class FontManager {
+ public:
+  static FontManager* Get();
+
+  // Sets the function that makes the system fonts available. It runs at
+  // most once, on whichever thread first needs fonts, before any face is
+  // resolved, so set it before anything can draw text.
+  void SetFontLoader(const std::function<void ()>& loader);
+  // Runs the loader if it hasn't run yet. Also for code that reaches
+  // fontconfig some other way, such as poppler rendering pages whose
+  // fonts aren't embedded.
+  void EnsureFontsLoaded();
+  bool fonts_loaded() const { return fonts_loaded_; }
+
+  // The shaper for laying out text in this font.
+  std::shared_ptr<TextShaper> Shaper(const std::string& family,
+                                     cairo_font_slant_t slant,
+                                     cairo_font_weight_t weight,
+                                     double size);
+
+  // Selects 'face' at 'size' into 'cr', using a cached scaled font for
+  // the current transform of 'cr'.
+  void SetFont(cairo_t* cr, cairo_font_face_t* face, double size);
+
+ private:
+  FontManager() {}
+  // Unhinted, so metrics are the same at every scale.
+  static cairo_font_options_t* NewFontOptions();
+
+  std::once_flag load_once_;
+  std::atomic<bool> fonts_loaded_{false};
+  std::function<void ()> loader_;
+
+  // Protects members below.
+  std::mutex lock_;
+  typedef std::tuple<std::string, int, int> FaceKey;
+  std::map<FaceKey, cairo_font_face_t*> faces_;
+  std::map<std::tuple<FaceKey, double>, std::shared_ptr<TextShaper>>
+      shapers_;
+  // Keyed by face, size and the scale/rotation part of the transform
+  typedef std::tuple<cairo_font_face_t*, double,
+                     double, double, double, double> ScaledFontKey;
+  std::map<ScaledFontKey, cairo_scaled_font_t*> scaled_fonts_;
+};
+
+}  // namespace pdfsketch
+
+#endif  // PDFSKETCH_FONT_MANAGER_H__
@@ -0,0 +1,75 @@
+// Copyright...
+
+#include "frame_buffer_pool.h"
+
+#include <stdio.h>
+
+using std::unique_ptr;
+using std::vector;
+
+namespace pdfsketch {
+
+void FrameBufferPool::SetSize(const pp::Size& device_size) {
+  if (device_size == size_)
+    return;
+  Clear();
+  size_ = device_size;
+}
+
+FrameBufferPool::FrameBuffer* FrameBufferPool::Acquire(
+    vector<Rect>* stale) {
+  if (size_.width() <= 0 || size_.height() <= 0)
+    return NULL;
+  if (buffers_.size() < kNumBuffers && next_ == buffers_.size()) {
+    unique_ptr<FrameBuffer> buffer(new FrameBuffer);
+    buffer->image_data = pp::ImageData(instance_,
+                                       PP_IMAGEDATAFORMAT_BGRA_PREMUL,
+                                       size_,
+                                       true);
+    if (buffer->image_data.is_null()) {
+      printf("%s: failed to allocate frame buffer\n", __func__);
+      return NULL;
+    }
+    buffer->surface = cairo_image_surface_create_for_data(
+        static_cast<unsigned char*>(buffer->image_data.data()),
+        CAIRO_FORMAT_ARGB32,
+        size_.width(),
+        size_.height(),
+        buffer->image_data.stride());
+    buffer->cr = cairo_create(buffer->surface);
+    // Nothing has been drawn into it yet
+    buffer->stale.Add(Rect(0.0, 0.0, size_.width(), size_.height()));
+    buffers_.push_back(std::move(buffer));
+  }
+  FrameBuffer* buffer = buffers_[next_].get();
+  next_ = (next_ + 1) % kNumBuffers;
+  stale->insert(stale->end(), buffer->stale.rects().begin(),
+                buffer->stale.rects().end());
+  buffer->stale.Clear();
+  cairo_reset_clip(buffer->cr);
+  cairo_identity_matrix(buffer->cr);
+  return buffer;
+}
+
+void FrameBufferPool::Present(FrameBuffer* buffer,
+                              const vector<Rect>& damage) {
+  cairo_surface_flush(buffer->surface);
+  for (auto& other : buffers_) {
+    if (other.get() == buffer)
+      continue;
+    for (const Rect& rect : damage)
+      other->stale.Add(rect);
+  }
+}
+
+void FrameBufferPool::Clear() {
+  for (auto& buffer : buffers_) {
+    cairo_destroy(buffer->cr);
+    cairo_surface_finish(buffer->surface);
+    cairo_surface_destroy(buffer->surface);
+  }
+  buffers_.clear();
+  next_ = 0;
+}
+
+}  // namespace pdfsketch
@@ -0,0 +1,66 @@
+// Copyright...
+
+#ifndef PDFSKETCH_FRAME_BUFFER_POOL_H__
+#define PDFSKETCH_FRAME_BUFFER_POOL_H__
+
+#include <memory>
+#include <vector>
+
+#include <cairo.h>
+#include <ppapi/cpp/image_data.h>
+#include <ppapi/cpp/instance.h>
+#include <ppapi/cpp/size.h>
+
+#include "damage_region.h"
+#include "view.h"
+
+namespace pdfsketch {
+
+// A small set of frame buffers that are drawn into in turn, each with
+// its own cairo surface and context, so that drawing a frame doesn't
+// allocate or clear any pixels. Buffers are only recreated when the
+// size changes.
+//
+// A buffer that's handed out again still holds the frame it last
+// showed, so the pool tracks what changed on screen since then. The
+// caller must redraw those 'stale' rects along with the new damage.
+
+class FrameBufferPool {
+ public:
+  static const size_t kNumBuffers = 2;
+
+  struct FrameBuffer {
+    pp::ImageData image_data;
+    cairo_surface_t* surface{nullptr};
+    cairo_t* cr{nullptr};
+    // Rects that changed in frames shown from other buffers
+    DamageRegion stale;
+  };
+
+  explicit FrameBufferPool(pp::Instance* instance) : instance_(instance) {}
+  ~FrameBufferPool() { Clear(); }
+
+  // Drops all buffers if 'device_size' differs from the current size.
+  void SetSize(const pp::Size& device_size);
+  const pp::Size& size() const { return size_; }
+
+  // Returns the buffer to draw the next frame into, with its context
+  // reset to an identity transform and no clip. Appends to 'stale' the
+  // rects that must be redrawn to bring it up to date.
+  FrameBuffer* Acquire(std::vector<Rect>* stale);
+  // Records that 'buffer' was shown with 'damage' redrawn.
+  void Present(FrameBuffer* buffer, const std::vector<Rect>& damage);
+
+ private:
+  void Clear();
+
+  pp::Instance* instance_;
+  pp::Size size_;
+  std::vector<std::unique_ptr<FrameBuffer>> buffers_;
+  // Index of the buffer to hand out next
+  size_t next_{0};
+};
+
+}  // namespace pdfsketch
+
+#endif  // PDFSKETCH_FRAME_BUFFER_POOL_H__
@@ -2,13 +2,67 @@
 
 #include "graphic.h"
 
+#include <math.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "page_tile_cache.h"
+#include "trace.h"
+
 namespace pdfsketch {
 
 namespace {
 const double kKnobEdgeLength = 7.0;
 const double kKnobLineWidth = 1.0;
+// Next id to hand out. Above every id seen so far. Atomic since export
+// rebuilds graphics on worker threads.
+std::atomic<uint64_t> g_next_graphic_id(1);
+
+// Bucketed user-to-device scale of 'cr'. The larger axis is used, so a
+// path built for one zoom level isn't reused at another.
+int DeviceScaleBucket(cairo_t* cr) {
+  double xx = 1.0, xy = 0.0, yx = 0.0, yy = 1.0;
+  cairo_user_to_device_distance(cr, &xx, &xy);
+  cairo_user_to_device_distance(cr, &yx, &yy);
+  return PageTileCache::ScaleBucket(std::max(hypot(xx, xy), hypot(yx, yy)));
+}
 }  // namespace {}
 
+uint64_t Graphic::NewId() {
+  return g_next_graphic_id++;
+}
+
+void Graphic::set_id(uint64_t id) {
+  id_ = id;
+  uint64_t next = g_next_graphic_id.load();
+  while (id >= next &&
+         !g_next_graphic_id.compare_exchange_weak(next, id + 1)) {}
+}
+
+void Graphic::AppendCachedPath(cairo_t* cr) {
+  cairo_new_path(cr);
+  int scale = DeviceScaleBucket(cr);
+  if (path_ && path_key_.scale == scale && path_key_.frame == frame_ &&
+      path_key_.natural_size == natural_size_ &&
+      path_key_.h_flip == h_flip_ && path_key_.v_flip == v_flip_) {
+    cairo_append_path(cr, path_.get());
+    return;
+  }
+  TRACE_EVENT("Graphic::BuildPath");
+  BuildPath(cr);
+  path_.reset(cairo_copy_path(cr), cairo_path_destroy);
+  if (path_->status != CAIRO_STATUS_SUCCESS) {
+    path_.reset();
+    return;
+  }
+  path_key_.scale = scale;
+  path_key_.frame = frame_;
+  path_key_.natural_size = natural_size_;
+  path_key_.h_flip = h_flip_;
+  path_key_.v_flip = v_flip_;
+}
+
 void Graphic::Serialize(pdfsketchproto::Graphic* out) const {
   frame_.Serialize(out->mutable_frame());
   natural_size_.Serialize(out->mutable_natural_size());
@@ -18,6 +72,7 @@ void Graphic::Serialize(pdfsketchproto::Graphic* out) const {
   out->set_line_width(line_width_);
   out->set_h_flip(h_flip_);
   out->set_v_flip(v_flip_);
+  out->set_id(id_);
 }
 
 Rect Graphic::DrawingFrame() const {
@@ -97,9 +152,11 @@ int Graphic::PointInKnob(const Point& location) const {
   return kKnobNone;
 }
 
-void Graphic::SetNeedsDisplay(bool withKnobs) const {
+void Graphic::SetNeedsDisplay(bool withKnobs) {
+  display_generation_++;
   if (!delegate_)
     return;
+  delegate_->GraphicBoundsChanged(this);
   delegate_->SetNeedsDisplayInPageRect(Page(),
                                        withKnobs ?
                                        DrawingFrameWithKnobs() :
@@ -193,9 +250,7 @@ void Graphic::UpdateResize(const Point& location) {
         break;
     }
   }
-  if (delegate_) {
-    delegate_->SetNeedsDisplayInPageRect(Page(), DrawingFrameWithKnobs());
-  }
+  SetNeedsDisplay(true);
 }
 void Graphic::EndResize() {
   resizing_knob_ = kKnobNone;
@@ -4,6 +4,7 @@
 #define PDFSKETCH_GRAPHIC_H__
 
 #include <memory>
+#include <stdint.h>
 
 #include <cairo.h>
 
@@ -57,9 +58,13 @@ inline bool KnobIsCorner(int knob) {
   return false;
 }
 
+class Graphic;
+
 class GraphicDelegate {
  public:
   virtual void SetNeedsDisplayInPageRect(int page, const Rect& rect) = 0;
+  // Called when the page or frame of 'graphic' may have changed.
+  virtual void GraphicBoundsChanged(Graphic* graphic) = 0;
   virtual Point ConvertPointFromGraphic(int page, const Point& point) = 0;
   virtual Point ConvertPointToGraphic(int page, const Point& point) = 0;
   virtual double GetZoom() = 0;
@@ -89,13 +94,27 @@ class Graphic {
     line_width_ = msg.line_width();
     h_flip_ = msg.h_flip();
     v_flip_ = msg.v_flip();
+    if (msg.has_id())
+      set_id(msg.id());
   }
 
+  // Identifies this graphic across saves and loads. Never 0.
+  uint64_t id() const { return id_; }
+  void set_id(uint64_t id);
+  // Returns an id no graphic has used yet.
+  static uint64_t NewId();
+
   void SetDelegate(GraphicDelegate* delegate) {
     delegate_ = delegate;
   }
 
   // Placement
+  // How far off, in page units, input positions can be without it
+  // showing at the zoom placement happens at. Graphics may drop detail
+  // finer than this.
+  void set_place_tolerance(double tolerance) {
+    place_tolerance_ = tolerance;
+  }
   virtual void Place(int page, const Point& location);
   virtual void PlaceUpdate(const Point& location);
   // Returns true if this graphic should be deleted.
@@ -126,6 +145,14 @@ class Graphic {
 
   virtual void Draw(cairo_t* cr, bool selected) {}
   void DrawKnobs(cairo_t* cr);
+  // Graphics that are slow to draw return true to be drawn from a
+  // cached image (see GraphicRasterCache), which is redrawn after each
+  // SetNeedsDisplay(). Draw() must only depend on the graphic's own
+  // state, the selected flag and the scale.
+  virtual bool WantsRasterCache() const { return false; }
+  // Changes on every SetNeedsDisplay(), so images of the graphic can
+  // tell they're out of date.
+  uint64_t display_generation() const { return display_generation_; }
   int Page() const { return page_; }
   void SetPage(int page) { page_ = page; }
 
@@ -142,13 +169,16 @@ class Graphic {
   Rect KnobFrame(int knob) const;
   Rect DrawingKnobFrame(int knob) const;
 
-  void SetNeedsDisplay(bool withKnobs) const;
+  // Also tells the delegate that the bounds may have changed, so call
+  // this after changing the page or frame.
+  void SetNeedsDisplay(bool withKnobs);
   Rect frame_;  // location in page
   Size natural_size_;
   int page_{1};
   Color fill_color_;
   Color stroke_color_;
   double line_width_{1.0};
+  double place_tolerance_{0.5};
 
   // if should be drawn horizontall/vertically flipped
   bool h_flip_:1;
@@ -162,11 +192,34 @@ class Graphic {
  protected:
   virtual int Knobs() const { return kAllKnobs; }
 
+  // Graphics drawn as a path override this to build it into 'cr', in
+  // page coordinates. AppendCachedPath() keeps a copy, so it's only
+  // rebuilt when the frame, natural size, flips or device scale change,
+  // or after InvalidatePath() (e.g. when the graphic's own points
+  // change).
+  virtual void BuildPath(cairo_t* cr) const {}
+  // Makes the current path of 'cr' the graphic's path.
+  void AppendCachedPath(cairo_t* cr);
+  void InvalidatePath() { path_.reset(); }
+
  private:
+  // What the cached path was built for
+  struct PathKey {
+    int scale;  // see PageTileCache::ScaleBucket()
+    Rect frame;
+    Size natural_size;
+    bool h_flip;
+    bool v_flip;
+  };
+  std::shared_ptr<cairo_path_t> path_;
+  PathKey path_key_;
+
   int resizing_knob_{kKnobNone};  // kKnobNone if no resize in progress
   GraphicDelegate* delegate_{nullptr};
 
   bool editing_{false};  // is being edited
+  uint64_t id_{NewId()};
+  uint64_t display_generation_{0};
 };
 
 }  // namespace pdfsketch
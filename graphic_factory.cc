@@ -63,7 +63,10 @@ std::shared_ptr<Graphic> GraphicFactory::NewText(
 
 std::shared_ptr<Graphic> GraphicFactory::NewImage(
     const char* data, size_t length) {
-  return make_shared<Image>(data, length);
+  std::shared_ptr<Image> ret(make_shared<Image>(data, length));
+  if (!ret->Readable())
+    return std::shared_ptr<Graphic>();
+  return ret;
 }
 
 }  // namespace pdfsketch
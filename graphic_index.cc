@@ -0,0 +1,196 @@
+// Copyright...
+
+#include "graphic_index.h"
+
+#include <algorithm>
+#include <math.h>
+
+using std::map;
+using std::unordered_map;
+using std::vector;
+
+namespace pdfsketch {
+
+namespace {
+// Graphics far off the page all land in the border cells, which keeps
+// the number of cells per graphic bounded.
+const int kMinCell = -8;
+const int kMaxCell = 64;
+
+int ClampCell(double coord) {
+  double cell = floor(coord / GraphicIndex::kCellSize);
+  return static_cast<int>(std::max<double>(kMinCell,
+                                           std::min<double>(kMaxCell, cell)));
+}
+
+// Like Rect::Intersects(), but true for rects that only share an edge,
+// so that zero-size rects (e.g. points) work.
+bool Touches(const Rect& a, const Rect& b) {
+  return !(a.Left() > b.Right() || b.Left() > a.Right() ||
+           a.Top() > b.Bottom() || b.Top() > a.Bottom());
+}
+}  // namespace {}
+
+GraphicIndex::Cells GraphicIndex::CellsForRect(const Rect& rect) {
+  Cells ret;
+  ret.x0 = ClampCell(rect.Left());
+  ret.y0 = ClampCell(rect.Top());
+  ret.x1 = ClampCell(rect.Right());
+  ret.y1 = ClampCell(rect.Bottom());
+  return ret;
+}
+
+void GraphicIndex::Insert(Graphic* graphic) {
+  if (entries_.find(graphic) != entries_.end()) {
+    printf("%s: graphic already in index\n", __func__);
+    return;
+  }
+  unordered_map<Graphic*, Entry>::const_iterator lower =
+      entries_.find(graphic->lower_sibling_.get());
+  unordered_map<Graphic*, Entry>::const_iterator upper =
+      entries_.find(graphic->upper_sibling_);
+  bool has_lower = lower != entries_.end();
+  bool has_upper = upper != entries_.end();
+  bool renumber = false;
+  Entry entry;
+  if (has_lower && has_upper) {
+    entry.z = (lower->second.z + upper->second.z) / 2.0;
+    // Out of precision between the neighbors?
+    renumber = !(lower->second.z < entry.z && entry.z < upper->second.z);
+  } else if (has_lower) {
+    entry.z = lower->second.z + 1.0;
+  } else if (has_upper) {
+    entry.z = upper->second.z - 1.0;
+  } else {
+    entry.z = 0.0;
+  }
+  entry.page = graphic->Page();
+  entry.bounds = graphic->DrawingFrame();
+  entry.cells = CellsForRect(entry.bounds);
+  entries_[graphic] = entry;
+  AddToCells(graphic, entry);
+  if (renumber)
+    RenumberZOrder(graphic);
+}
+
+void GraphicIndex::Remove(Graphic* graphic) {
+  unordered_map<Graphic*, Entry>::iterator it = entries_.find(graphic);
+  if (it == entries_.end())
+    return;
+  RemoveFromCells(graphic, it->second);
+  entries_.erase(it);
+}
+
+void GraphicIndex::Update(Graphic* graphic) {
+  unordered_map<Graphic*, Entry>::iterator it = entries_.find(graphic);
+  if (it == entries_.end())
+    return;
+  Entry* entry = &it->second;
+  Rect bounds = graphic->DrawingFrame();
+  Cells cells = CellsForRect(bounds);
+  if (entry->page == graphic->Page() &&
+      entry->cells.x0 == cells.x0 && entry->cells.y0 == cells.y0 &&
+      entry->cells.x1 == cells.x1 && entry->cells.y1 == cells.y1) {
+    // Common case: small move within the same cells
+    entry->bounds = bounds;
+    return;
+  }
+  RemoveFromCells(graphic, *entry);
+  entry->page = graphic->Page();
+  entry->bounds = bounds;
+  entry->cells = cells;
+  AddToCells(graphic, *entry);
+}
+
+void GraphicIndex::Clear() {
+  entries_.clear();
+  pages_.clear();
+}
+
+void GraphicIndex::GraphicsInRect(int page, const Rect& rect,
+                                  vector<Graphic*>* out) const {
+  map<int, Page>::const_iterator page_it = pages_.find(page);
+  if (page_it == pages_.end())
+    return;
+  const Page& cell_page = page_it->second;
+  Cells cells = CellsForRect(rect);
+  vector<Graphic*> found;
+  for (int y = cells.y0; y <= cells.y1; y++) {
+    for (int x = cells.x0; x <= cells.x1; x++) {
+      unordered_map<uint64_t, vector<Graphic*>>::const_iterator cell =
+          cell_page.cells.find(CellKey(x, y));
+      if (cell == cell_page.cells.end())
+        continue;
+      for (Graphic* graphic : cell->second) {
+        if (Touches(entries_.find(graphic)->second.bounds, rect))
+          found.push_back(graphic);
+      }
+    }
+  }
+  SortAndUnique(&found);
+  out->insert(out->end(), found.begin(), found.end());
+}
+
+void GraphicIndex::SortByZOrder(vector<Graphic*>* graphics) const {
+  std::sort(graphics->begin(), graphics->end(),
+            [this] (Graphic* left, Graphic* right) {
+              double left_z = entries_.find(left)->second.z;
+              double right_z = entries_.find(right)->second.z;
+              if (left_z != right_z)
+                return left_z < right_z;
+              return left < right;
+            });
+}
+
+void GraphicIndex::AddToCells(Graphic* graphic, const Entry& entry) {
+  Page& page = pages_[entry.page];
+  for (int y = entry.cells.y0; y <= entry.cells.y1; y++)
+    for (int x = entry.cells.x0; x <= entry.cells.x1; x++)
+      page.cells[CellKey(x, y)].push_back(graphic);
+}
+
+void GraphicIndex::RemoveFromCells(Graphic* graphic, const Entry& entry) {
+  map<int, Page>::iterator page_it = pages_.find(entry.page);
+  if (page_it == pages_.end()) {
+    printf("%s: missing page %d\n", __func__, entry.page);
+    return;
+  }
+  Page& page = page_it->second;
+  for (int y = entry.cells.y0; y <= entry.cells.y1; y++) {
+    for (int x = entry.cells.x0; x <= entry.cells.x1; x++) {
+      unordered_map<uint64_t, vector<Graphic*>>::iterator cell =
+          page.cells.find(CellKey(x, y));
+      if (cell == page.cells.end())
+        continue;
+      vector<Graphic*>& list = cell->second;
+      list.erase(std::remove(list.begin(), list.end(), graphic), list.end());
+      if (list.empty())
+        page.cells.erase(cell);
+    }
+  }
+  // Every graphic is in at least one cell
+  if (page.cells.empty())
+    pages_.erase(page_it);
+}
+
+void GraphicIndex::RenumberZOrder(Graphic* graphic) {
+  Graphic* bottom = graphic;
+  while (bottom->lower_sibling_)
+    bottom = bottom->lower_sibling_.get();
+  double z = 0.0;
+  for (Graphic* gr = bottom; gr; gr = gr->upper_sibling_) {
+    unordered_map<Graphic*, Entry>::iterator it = entries_.find(gr);
+    if (it == entries_.end())
+      continue;
+    it->second.z = z;
+    z += 1.0;
+  }
+}
+
+void GraphicIndex::SortAndUnique(vector<Graphic*>* graphics) const {
+  SortByZOrder(graphics);
+  graphics->erase(std::unique(graphics->begin(), graphics->end()),
+                  graphics->end());
+}
+
+}  // namespace pdfsketch
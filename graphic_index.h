@@ -0,0 +1,82 @@
+// Copyright...
+
+#ifndef PDFSKETCH_GRAPHIC_INDEX_H__
+#define PDFSKETCH_GRAPHIC_INDEX_H__
+
+#include <map>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+#include "graphic.h"
+#include "view.h"
+
+namespace pdfsketch {
+
+// Spatial index of the graphics in a document, so that drawing and hit
+// testing only need to look at graphics near the rect of interest.
+// Each page has a uniform grid of kCellSize x kCellSize (page units)
+// cells; a graphic is listed in every cell its drawing frame touches.
+// The index also tracks z-order, so results come back bottom-most
+// first, matching the order of DocumentView's graphic list.
+//
+// Graphics are keyed by pointer and aren't owned by the index. Callers
+// must call Update() whenever a graphic's page or frame changes.
+
+class GraphicIndex {
+ public:
+  static const int kCellSize = 128;
+
+  // Adds 'graphic', which must already be linked into the z-order list
+  // (via its upper_sibling_/lower_sibling_).
+  void Insert(Graphic* graphic);
+  void Remove(Graphic* graphic);
+  // Re-reads the page and frame of 'graphic', if it's in the index.
+  void Update(Graphic* graphic);
+  void Clear();
+  bool Contains(Graphic* graphic) const {
+    return entries_.find(graphic) != entries_.end();
+  }
+
+  // Appends to 'out' the graphics on 'page' whose drawing frames touch
+  // 'rect' (page coords), bottom-most first.
+  void GraphicsInRect(int page, const Rect& rect,
+                      std::vector<Graphic*>* out) const;
+
+  // Sorts 'graphics' bottom-most first. All must be in the index.
+  void SortByZOrder(std::vector<Graphic*>* graphics) const;
+
+ private:
+  struct Cells {
+    int x0, y0, x1, y1;  // inclusive
+  };
+  struct Entry {
+    int page;
+    Rect bounds;
+    Cells cells;
+    double z;
+  };
+  struct Page {
+    std::unordered_map<uint64_t, std::vector<Graphic*>> cells;
+  };
+
+  static Cells CellsForRect(const Rect& rect);
+  static uint64_t CellKey(int x, int y) {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(x)) << 32) |
+        static_cast<uint32_t>(y);
+  }
+
+  void AddToCells(Graphic* graphic, const Entry& entry);
+  void RemoveFromCells(Graphic* graphic, const Entry& entry);
+  // Gives every graphic a new, evenly spaced z value, walking the list
+  // that 'graphic' is in.
+  void RenumberZOrder(Graphic* graphic);
+  void SortAndUnique(std::vector<Graphic*>* graphics) const;
+
+  std::unordered_map<Graphic*, Entry> entries_;
+  std::map<int, Page> pages_;
+};
+
+}  // namespace pdfsketch
+
+#endif  // PDFSKETCH_GRAPHIC_INDEX_H__
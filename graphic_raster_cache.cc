@@ -0,0 +1,121 @@
+// Copyright...
+
+#include "graphic_raster_cache.h"
+
+#include <math.h>
+
+#include "page_tile_cache.h"
+#include "trace.h"
+
+using std::map;
+
+namespace pdfsketch {
+
+void GraphicRasterCache::SetByteBudget(size_t byte_budget) {
+  byte_budget_ = byte_budget;
+  EvictToBudget();
+}
+
+void GraphicRasterCache::Draw(cairo_t* cr, Graphic* graphic, double scale) {
+  int bucket = PageTileCache::ScaleBucket(scale);
+  map<Graphic*, Entry>::iterator it = entries_.find(graphic);
+  if (it != entries_.end() &&
+      (it->second.display_generation != graphic->display_generation() ||
+       !(it->second.frame == graphic->Frame()) ||
+       it->second.scale != bucket)) {
+    Erase(it);
+    it = entries_.end();
+  }
+  if (it == entries_.end()) {
+    // Whole device pixels covering the drawing frame, padded by a point
+    // to cover antialiasing.
+    Rect bounds = graphic->DrawingFrame().InsetBy(-1.0);
+    int x = static_cast<int>(floor(bounds.Left() * scale));
+    int y = static_cast<int>(floor(bounds.Top() * scale));
+    int width = static_cast<int>(ceil(bounds.Right() * scale)) - x;
+    int height = static_cast<int>(ceil(bounds.Bottom() * scale)) - y;
+    size_t bytes = static_cast<size_t>(width) * height * 4;
+    if (width <= 0 || height <= 0 || bytes > byte_budget_ / 4) {
+      graphic->Draw(cr, false);
+      return;
+    }
+    TRACE_EVENT("GraphicRasterCache::Render");
+    Entry entry;
+    // Drawing can call SetNeedsDisplay() (text areas resize to fit), in
+    // which case this image is used once and redrawn next time.
+    entry.display_generation = graphic->display_generation();
+    entry.surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                               width, height);
+    cairo_t* image_cr = cairo_create(entry.surface);
+    cairo_translate(image_cr, -x, -y);
+    cairo_scale(image_cr, scale, scale);
+    graphic->Draw(image_cr, false);
+    cairo_destroy(image_cr);
+    cairo_surface_flush(entry.surface);
+    entry.bytes = cairo_image_surface_get_stride(entry.surface) * height;
+    entry.frame = graphic->Frame();
+    entry.scale = bucket;
+    entry.exact_scale = scale;
+    entry.x = x;
+    entry.y = y;
+    lru_.push_front(graphic);
+    entry.lru_it = lru_.begin();
+    it = entries_.insert(std::make_pair(graphic, entry)).first;
+    bytes_used_ += entry.bytes;
+  } else {
+    // Move to front of LRU list
+    lru_.splice(lru_.begin(), lru_, it->second.lru_it);
+  }
+
+  const Entry& entry = it->second;
+  int width = cairo_image_surface_get_width(entry.surface);
+  int height = cairo_image_surface_get_height(entry.surface);
+  cairo_save(cr);
+  if (entry.exact_scale == scale) {
+    // The page's origin is generally at a fraction of a device pixel,
+    // so the image is moved to the nearest whole one, where it can be
+    // copied as is.
+    double x = entry.x / scale;
+    double y = entry.y / scale;
+    cairo_user_to_device(cr, &x, &y);
+    x = round(x);
+    y = round(y);
+    cairo_identity_matrix(cr);
+    cairo_set_source_surface(cr, entry.surface, x, y);
+    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
+    cairo_rectangle(cr, x, y, width, height);
+  } else {
+    cairo_scale(cr, 1.0 / scale, 1.0 / scale);
+    cairo_set_source_surface(cr, entry.surface, entry.x, entry.y);
+    cairo_rectangle(cr, entry.x, entry.y, width, height);
+  }
+  cairo_fill(cr);
+  cairo_restore(cr);
+  EvictToBudget();
+}
+
+void GraphicRasterCache::Remove(Graphic* graphic) {
+  map<Graphic*, Entry>::iterator it = entries_.find(graphic);
+  if (it != entries_.end())
+    Erase(it);
+}
+
+void GraphicRasterCache::Clear() {
+  while (!entries_.empty())
+    Erase(entries_.begin());
+}
+
+void GraphicRasterCache::Erase(map<Graphic*, Entry>::iterator it) {
+  bytes_used_ -= it->second.bytes;
+  lru_.erase(it->second.lru_it);
+  cairo_surface_destroy(it->second.surface);
+  entries_.erase(it);
+}
+
+void GraphicRasterCache::EvictToBudget() {
+  // Always keep the most recently used image, as it was just drawn.
+  while (bytes_used_ > byte_budget_ && lru_.size() > 1)
+    Erase(entries_.find(lru_.back()));
+}
+
+}  // namespace pdfsketch
@@ -0,0 +1,75 @@
+// Copyright...
+
+#ifndef PDFSKETCH_GRAPHIC_RASTER_CACHE_H__
+#define PDFSKETCH_GRAPHIC_RASTER_CACHE_H__
+
+#include <list>
+#include <map>
+#include <stdint.h>
+
+#include <cairo.h>
+
+#include "graphic.h"
+#include "view.h"
+
+namespace pdfsketch {
+
+// Holds an image of each graphic that's slow to draw (see
+// Graphic::WantsRasterCache()), rendered at the scale it was last
+// drawn at, so repaints are a blit. An image is redrawn when the
+// graphic has called SetNeedsDisplay() since, or when the scale
+// changes bucket. At the scale it was drawn at, an image is copied to
+// the nearest whole device pixel, unfiltered, so it stays sharp; within
+// the bucket at other scales (mid-zoom), it's resampled. When the total
+// memory used by images exceeds the byte budget, least recently used
+// ones are evicted.
+//
+// Graphics are keyed by pointer and aren't owned by the cache. Callers
+// must call Remove() when a graphic leaves the document.
+
+class GraphicRasterCache {
+ public:
+  static const size_t kDefaultByteBudget = 32 * 1024 * 1024;
+
+  explicit GraphicRasterCache(size_t byte_budget = kDefaultByteBudget)
+      : byte_budget_(byte_budget) {}
+  ~GraphicRasterCache() { Clear(); }
+
+  void SetByteBudget(size_t byte_budget);
+  size_t bytes_used() const { return bytes_used_; }
+
+  // Draws 'graphic', unselected, into 'cr', whose user space is page
+  // coordinates, at 'scale' device pixels per page unit. Graphics whose
+  // image would take more than a quarter of the budget are drawn
+  // directly.
+  void Draw(cairo_t* cr, Graphic* graphic, double scale);
+
+  void Remove(Graphic* graphic);
+  void Clear();
+
+ private:
+  typedef std::list<Graphic*> LRUList;
+  struct Entry {
+    cairo_surface_t* surface;
+    size_t bytes;
+    // What the image was drawn for
+    uint64_t display_generation;
+    Rect frame;
+    int scale;  // see PageTileCache::ScaleBucket()
+    double exact_scale;
+    // Where the image goes, in device pixels from the page's origin
+    int x, y;
+    LRUList::iterator lru_it;
+  };
+  void Erase(std::map<Graphic*, Entry>::iterator it);
+  void EvictToBudget();
+
+  std::map<Graphic*, Entry> entries_;
+  LRUList lru_;  // front is most recently used
+  size_t byte_budget_;
+  size_t bytes_used_{0};
+};
+
+}  // namespace pdfsketch
+
+#endif  // PDFSKETCH_GRAPHIC_RASTER_CACHE_H__
@@ -2,7 +2,22 @@
 
 #include "image.h"
 
+#include <algorithm>
 #include <cairo.h>
+#include <math.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern "C" {
+#include <jpeglib.h>
+}
+
+#include "trace.h"
+
+using std::lock_guard;
+using std::mutex;
 
 namespace pdfsketch {
 
@@ -23,49 +38,347 @@ cairo_status_t ImageRead(void* closure,
   return CAIRO_STATUS_SUCCESS;
 }
 
+namespace {
+uint32_t ReadBigEndian32(const char* data) {
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+  return (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+}
+
+// libjpeg reports fatal errors by calling error_exit, which mustn't
+// return, so it jumps back to the caller.
+struct JPEGError {
+  jpeg_error_mgr manager;
+  jmp_buf jump;
+};
+
+void JPEGErrorExit(j_common_ptr cinfo) {
+  char message[JMSG_LENGTH_MAX];
+  cinfo->err->format_message(cinfo, message);
+  printf("image load err: %s\n", message);
+  longjmp(reinterpret_cast<JPEGError*>(cinfo->err)->jump, 1);
+}
+
+// Warnings are about files that are slightly off but still decode.
+void JPEGOutputMessage(j_common_ptr cinfo) {}
+
+// Sets up 'cinfo' to report errors through 'error'. Call setjmp() on
+// 'error' right after, then OpenJPEG().
+void InitJPEGError(jpeg_decompress_struct* cinfo, JPEGError* error) {
+  memset(cinfo, 0, sizeof(*cinfo));
+  cinfo->err = jpeg_std_error(&error->manager);
+  error->manager.error_exit = JPEGErrorExit;
+  error->manager.output_message = JPEGOutputMessage;
+}
+
+void OpenJPEG(const char* data, size_t len, jpeg_decompress_struct* cinfo) {
+  jpeg_create_decompress(cinfo);
+  jpeg_mem_src(cinfo,
+               reinterpret_cast<unsigned char*>(const_cast<char*>(data)),
+               len);
+}
+
+uint32_t ReadExifInt(const unsigned char* data, int bytes, bool big_endian) {
+  uint32_t ret = 0;
+  for (int i = 0; i < bytes; i++)
+    ret |= data[big_endian ? i : bytes - 1 - i] << (8 * (bytes - 1 - i));
+  return ret;
+}
+
+// The orientation (1-8) in an Exif APP1 marker, or 1 if it has none
+int ExifOrientation(const unsigned char* data, size_t len) {
+  if (len < 14 || memcmp(data, "Exif\0\0", 6))
+    return 1;
+  // A TIFF header, then the first IFD: a count of 12 byte entries
+  const unsigned char* tiff = data + 6;
+  size_t size = len - 6;
+  bool big_endian = !memcmp(tiff, "MM", 2);
+  if (!big_endian && memcmp(tiff, "II", 2))
+    return 1;
+  uint32_t ifd = ReadExifInt(tiff + 4, 4, big_endian);
+  if (ifd > size - 2)
+    return 1;
+  int count = ReadExifInt(tiff + ifd, 2, big_endian);
+  for (int i = 0; i < count; i++) {
+    size_t entry = ifd + 2 + i * 12;
+    if (entry + 12 > size)
+      break;
+    const int kOrientationTag = 0x0112;
+    if (ReadExifInt(tiff + entry, 2, big_endian) == kOrientationTag) {
+      int orientation = ReadExifInt(tiff + entry + 8, 2, big_endian);
+      return orientation >= 1 && orientation <= 8 ? orientation : 1;
+    }
+  }
+  return 1;
+}
+
+// Reads the size, number of color components and Exif orientation of a
+// JPEG. Returns false if libjpeg can't read it.
+bool ReadJPEGHeader(const char* data, size_t len, int* width, int* height,
+                    int* components, int* orientation) {
+  jpeg_decompress_struct cinfo;
+  JPEGError error;
+  InitJPEGError(&cinfo, &error);
+  if (setjmp(error.jump)) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+  OpenJPEG(data, len, &cinfo);
+  jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xffff);
+  jpeg_read_header(&cinfo, TRUE);
+  *width = cinfo.image_width;
+  *height = cinfo.image_height;
+  *components = cinfo.num_components;
+  *orientation = 1;
+  for (jpeg_saved_marker_ptr marker = cinfo.marker_list; marker;
+       marker = marker->next) {
+    if (marker->marker == JPEG_APP0 + 1 && *orientation == 1)
+      *orientation = ExifOrientation(marker->data, marker->data_length);
+  }
+  jpeg_destroy_decompress(&cinfo);
+  return true;
+}
+
+// Where pixel (x, y) of a 'width' x 'height' image goes once it's
+// turned as Exif 'orientation' says.
+void OrientPixel(int orientation, int x, int y, int width, int height,
+                 int* out_x, int* out_y) {
+  switch (orientation) {
+    default: *out_x = x; *out_y = y; break;
+    case 2: *out_x = width - 1 - x; *out_y = y; break;  // mirrored
+    case 3: *out_x = width - 1 - x; *out_y = height - 1 - y; break;
+    case 4: *out_x = x; *out_y = height - 1 - y; break;  // mirrored
+    case 5: *out_x = y; *out_y = x; break;  // mirrored
+    case 6: *out_x = height - 1 - y; *out_y = x; break;  // turned right
+    case 7: *out_x = height - 1 - y; *out_y = width - 1 - x; break;
+    case 8: *out_x = y; *out_y = width - 1 - x; break;  // turned left
+  }
+}
+
+// Decodes a JPEG at 1/'scale' of full size (1, 2, 4 or 8), turned as
+// Exif 'orientation' says. Returns NULL if it can't be decoded.
+cairo_surface_t* DecodeJPEG(const char* data, size_t len, int scale,
+                            int orientation) {
+  jpeg_decompress_struct cinfo;
+  JPEGError error;
+  cairo_surface_t* volatile surface = NULL;
+  InitJPEGError(&cinfo, &error);
+  if (setjmp(error.jump)) {
+    jpeg_destroy_decompress(&cinfo);
+    if (surface)
+      cairo_surface_destroy(surface);
+    return NULL;
+  }
+  OpenJPEG(data, len, &cinfo);
+  jpeg_read_header(&cinfo, TRUE);
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = scale;
+  if (cinfo.jpeg_color_space == JCS_CMYK ||
+      cinfo.jpeg_color_space == JCS_YCCK)
+    cinfo.out_color_space = JCS_CMYK;
+  else if (cinfo.num_components == 1)
+    cinfo.out_color_space = JCS_GRAYSCALE;
+  else
+    cinfo.out_color_space = JCS_RGB;
+  jpeg_start_decompress(&cinfo);
+  int width = cinfo.output_width;
+  int height = cinfo.output_height;
+  int components = cinfo.output_components;
+  bool transposed = orientation >= 5;
+  surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+                                       transposed ? height : width,
+                                       transposed ? width : height);
+  if (cairo_surface_status(surface)) {
+    printf("%s: can't make %dx%d surface: %d\n", __func__, width, height,
+           cairo_surface_status(surface));
+    cairo_surface_destroy(surface);
+    jpeg_destroy_decompress(&cinfo);
+    return NULL;
+  }
+  cairo_surface_flush(surface);
+  unsigned char* pixels = cairo_image_surface_get_data(surface);
+  int stride = cairo_image_surface_get_stride(surface) / 4;
+  JSAMPARRAY row = (*cinfo.mem->alloc_sarray)(
+      reinterpret_cast<j_common_ptr>(&cinfo), JPOOL_IMAGE,
+      width * components, 1);
+  // Adobe's CMYK JPEGs store ink amounts inverted
+  bool inverted_cmyk = cinfo.saw_Adobe_marker;
+  while (cinfo.output_scanline < cinfo.output_height) {
+    int y = cinfo.output_scanline;
+    jpeg_read_scanlines(&cinfo, row, 1);
+    // Where this row's pixels go, and how far apart
+    int x0, y0, x1, y1;
+    OrientPixel(orientation, 0, y, width, height, &x0, &y0);
+    OrientPixel(orientation, 1, y, width, height, &x1, &y1);
+    uint32_t* out = reinterpret_cast<uint32_t*>(pixels) + y0 * stride + x0;
+    ptrdiff_t step = (x1 - x0) + (y1 - y0) * stride;
+    const JSAMPLE* in = row[0];
+    for (int x = 0; x < width; x++, in += components, out += step) {
+      uint32_t r, g, b;
+      if (components == 1) {
+        r = g = b = in[0];
+      } else if (components == 3) {
+        r = in[0];
+        g = in[1];
+        b = in[2];
+      } else {
+        uint32_t c = in[0], m = in[1], yellow = in[2], k = in[3];
+        if (!inverted_cmyk) {
+          c = 255 - c;
+          m = 255 - m;
+          yellow = 255 - yellow;
+          k = 255 - k;
+        }
+        r = c * k / 255;
+        g = m * k / 255;
+        b = yellow * k / 255;
+      }
+      *out = 0xff000000 | (r << 16) | (g << 8) | b;
+    }
+  }
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  cairo_surface_mark_dirty(surface);
+  return surface;
+}
+
+// Returns a new surface of 'src' at half the size (rounded up), each
+// pixel the average of the 2x2 pixels it covers. Returns NULL if the
+// surface can't be made.
+cairo_surface_t* HalfSize(cairo_surface_t* src) {
+  int width = cairo_image_surface_get_width(src);
+  int height = cairo_image_surface_get_height(src);
+  int half_width = (width + 1) / 2;
+  int half_height = (height + 1) / 2;
+  cairo_surface_t* dst = cairo_image_surface_create(
+      cairo_image_surface_get_format(src), half_width, half_height);
+  if (cairo_surface_status(dst)) {
+    printf("%s: can't make %dx%d surface: %d\n", __func__, half_width,
+           half_height, cairo_surface_status(dst));
+    cairo_surface_destroy(dst);
+    return NULL;
+  }
+  cairo_surface_flush(src);
+  cairo_surface_flush(dst);
+  const unsigned char* in = cairo_image_surface_get_data(src);
+  unsigned char* out = cairo_image_surface_get_data(dst);
+  int in_stride = cairo_image_surface_get_stride(src);
+  int out_stride = cairo_image_surface_get_stride(dst);
+  // Both formats a PNG decodes to (ARGB32 and RGB24) are 4 bytes per
+  // pixel, and premultiplied, so channels can be averaged separately.
+  for (int y = 0; y < half_height; y++) {
+    const unsigned char* row0 = in + 2 * y * in_stride;
+    const unsigned char* row1 = 2 * y + 1 < height ? row0 + in_stride : row0;
+    unsigned char* out_row = out + y * out_stride;
+    for (int x = 0; x < half_width; x++) {
+      int x0 = 2 * x * 4;
+      int x1 = 2 * x + 1 < width ? x0 + 4 : x0;
+      for (int channel = 0; channel < 4; channel++) {
+        out_row[x * 4 + channel] =
+            (row0[x0 + channel] + row0[x1 + channel] +
+             row1[x0 + channel] + row1[x1 + channel] + 2) / 4;
+      }
+    }
+  }
+  cairo_surface_mark_dirty(dst);
+  return dst;
+}
+}  // namespace {}
+
+mutex Image::levels_lock_;
+Image::LevelList Image::levels_lru_;
+size_t Image::levels_bytes_ = 0;
+
 Image::Image(const char* data, size_t len)
     : data_(data, data + len) {
-  InitSurface();
+  ReadHeader();
+  natural_size_ = Size(width_, height_);
+  frame_.size_ = natural_size_;
+  // Scale to fit in an allowable square
+  double max_len = std::max(frame_.size_.width_, frame_.size_.height_);
+  double max_allowed = 500.0;
+  if (max_len > max_allowed) {
+    frame_.size_.height_ *= max_allowed / max_len;
+    frame_.size_.width_ *= max_allowed / max_len;
+  }
 }
 
 Image::Image(const pdfsketchproto::Graphic& msg)
     : Graphic(msg),
       data_(msg.image().data().begin(), msg.image().data().end()) {
-  InitSurface();
+  ReadHeader();
+  natural_size_ = Size(width_, height_);
+}
+
+void Image::ReadHeader() {
+  const char* data = data_.empty() ? "" : &data_[0];
+  size_t size = data_.size();
+  const char kPNGSignature[] = "\x89PNG\r\n\x1a\n";
+  if (size >= 24 && !memcmp(data, kPNGSignature, sizeof(kPNGSignature) - 1) &&
+      !memcmp(data + 12, "IHDR", 4)) {
+    // The IHDR chunk comes first, and starts with the width and height.
+    format_ = kPNG;
+    width_ = ReadBigEndian32(data + 16);
+    height_ = ReadBigEndian32(data + 20);
+  } else if (size >= 3 && !memcmp(data, "\xff\xd8\xff", 3)) {
+    format_ = kJPEG;
+    int components = 0;
+    if (!ReadJPEGHeader(data, size, &width_, &height_, &components,
+                        &orientation_)) {
+      decode_failed_ = true;
+      return;
+    }
+    if (orientation_ >= 5)
+      std::swap(width_, height_);
+    // cairo can't turn an embedded JPEG, and Adobe's inverted CMYK
+    // doesn't survive it.
+    jpeg_embeddable_ = orientation_ == 1 && components != 4;
+  } else if (size >= 12 && !memcmp(data, "RIFF", 4) &&
+             !memcmp(data + 8, "WEBP", 4)) {
+    format_ = kWebP;
+    printf("image load err: WebP isn't supported\n");
+    decode_failed_ = true;
+  } else {
+    printf("image load err: unknown format\n");
+    decode_failed_ = true;
+  }
 }
 
-void Image::InitSurface() {
-  ImageReadData source = {&data_[0], data_.size()};
-  surface_ = cairo_image_surface_create_from_png_stream(ImageRead, &source);
-  if (!surface_) {
-    printf("NULL surface\n");
+cairo_surface_t* Image::Decode(int level, int* decoded_level) {
+  if (decode_failed_)
+    return NULL;
+  TRACE_EVENT("Image::Decode");
+  cairo_surface_t* surface = NULL;
+  *decoded_level = 0;
+  if (format_ == kJPEG) {
+    // libjpeg can scale by up to 1/8 while decoding.
+    *decoded_level = std::min(level, 3);
+    surface = DecodeJPEG(&data_[0], data_.size(), 1 << *decoded_level,
+                         orientation_);
   } else {
-    switch (cairo_surface_status(surface_)) {
+    ImageReadData source = {&data_[0], data_.size()};
+    surface = cairo_image_surface_create_from_png_stream(ImageRead, &source);
+    switch (cairo_surface_status(surface)) {
 #define ERRSTR(x) case x : printf("image load err: %s\n", #x ); break;
       case 0: break;  // Success
       ERRSTR(CAIRO_STATUS_NO_MEMORY);
       ERRSTR(CAIRO_STATUS_READ_ERROR);
-      default: printf("err: %d\n", cairo_surface_status(surface_));
+      default: printf("err: %d\n", cairo_surface_status(surface));
+#undef ERRSTR
+    }
+    if (cairo_surface_status(surface)) {
+      cairo_surface_destroy(surface);
+      surface = NULL;
     }
   }
-  natural_size_ = Size(cairo_image_surface_get_width(surface_),
-                       cairo_image_surface_get_height(surface_));
-  frame_.size_ = natural_size_;
-  // Scale to fit in an allowable square
-  double max_len = std::max(frame_.size_.width_, frame_.size_.height_);
-  double max_allowed = 500.0;
-  if (max_len > max_allowed) {
-    frame_.size_.height_ *= max_allowed / max_len;
-    frame_.size_.width_ *= max_allowed / max_len;
-  }
+  if (!surface)
+    decode_failed_ = true;
+  return surface;
 }
 
 Image::~Image() {
-  if (surface_) {
-    cairo_surface_finish(surface_);
-    cairo_surface_destroy(surface_);
-    surface_ = nullptr;
-  }
+  lock_guard<mutex> guard(levels_lock_);
+  for (size_t i = 0; i < levels_.size(); i++)
+    DropLevel(i);
 }
 
 void Image::Serialize(pdfsketchproto::Graphic* out) const {
@@ -75,14 +388,115 @@ void Image::Serialize(pdfsketchproto::Graphic* out) const {
   msg->mutable_data()->assign(data_.begin(), data_.end());
 }
 
+int Image::LevelForContext(cairo_t* cr) const {
+  // Size of the frame in device pixels
+  double wx = frame_.size_.width_;
+  double wy = 0.0;
+  cairo_user_to_device_distance(cr, &wx, &wy);
+  double hx = 0.0;
+  double hy = frame_.size_.height_;
+  cairo_user_to_device_distance(cr, &hx, &hy);
+  // Image pixels per device pixel, along the less dense axis
+  double density = std::min(width_ / hypot(wx, wy), height_ / hypot(hx, hy));
+  int level = 0;
+  while (density >= 2.0 && (width_ >> (level + 1)) > 0 &&
+         (height_ >> (level + 1)) > 0) {
+    density /= 2.0;
+    level++;
+  }
+  return level;
+}
+
+cairo_surface_t* Image::GetLevel(int level) {
+  lock_guard<mutex> guard(levels_lock_);
+  if (levels_.size() <= static_cast<size_t>(level))
+    levels_.resize(level + 1);
+  if (levels_[level].surface) {
+    levels_lru_.splice(levels_lru_.begin(), levels_lru_,
+                       levels_[level].lru_it);
+    return cairo_surface_reference(levels_[level].surface);
+  }
+  TRACE_EVENT("Image::BuildLevel");
+  // Start from the nearest more detailed level that's still around, or
+  // from the encoded image.
+  int from = level - 1;
+  while (from >= 0 && !levels_[from].surface)
+    from--;
+  cairo_surface_t* surface = NULL;
+  if (from >= 0) {
+    surface = cairo_surface_reference(levels_[from].surface);
+  } else {
+    surface = Decode(level, &from);
+    if (!surface)
+      return NULL;
+  }
+  for (; from < level; from++) {
+    cairo_surface_t* half = HalfSize(surface);
+    cairo_surface_destroy(surface);
+    if (!half)
+      return NULL;
+    surface = half;
+  }
+  levels_[level].surface = surface;
+  levels_lru_.push_front(std::make_pair(this, level));
+  levels_[level].lru_it = levels_lru_.begin();
+  levels_bytes_ += cairo_image_surface_get_stride(surface) *
+      cairo_image_surface_get_height(surface);
+  EvictLevels();
+  return cairo_surface_reference(surface);
+}
+
+void Image::DropLevel(int level) {
+  cairo_surface_t* surface = levels_[level].surface;
+  if (!surface)
+    return;
+  levels_bytes_ -= cairo_image_surface_get_stride(surface) *
+      cairo_image_surface_get_height(surface);
+  levels_lru_.erase(levels_[level].lru_it);
+  cairo_surface_destroy(surface);
+  levels_[level].surface = nullptr;
+}
+
+void Image::EvictLevels() {
+  // Always keep the most recently drawn level, as it's about to be drawn.
+  while (levels_bytes_ > kLevelByteBudget && levels_lru_.size() > 1) {
+    std::pair<Image*, int> least_recent = levels_lru_.back();
+    least_recent.first->DropLevel(least_recent.second);
+  }
+}
+
 void Image::Draw(cairo_t* cr, bool selected) {
+  TRACE_EVENT("Image::Draw");
+  if (decode_failed_ || width_ <= 0 || height_ <= 0 ||
+      frame_.size_.width_ <= 0.0 || frame_.size_.height_ <= 0.0)
+    return;
+  cairo_surface_t* surface = NULL;
+  if (cairo_surface_get_type(cairo_get_target(cr)) ==
+      CAIRO_SURFACE_TYPE_IMAGE) {
+    surface = GetLevel(LevelForContext(cr));
+  } else {
+    // Vector output (PDF export) keeps every pixel. It's drawn once, so
+    // the full size image isn't kept around.
+    int decoded_level = 0;
+    surface = Decode(0, &decoded_level);
+    // A JPEG can go into the PDF as it is, rather than as pixels.
+    if (surface && format_ == kJPEG && jpeg_embeddable_) {
+      unsigned char* jpeg = static_cast<unsigned char*>(malloc(data_.size()));
+      memcpy(jpeg, &data_[0], data_.size());
+      cairo_surface_set_mime_data(surface, CAIRO_MIME_TYPE_JPEG, jpeg,
+                                  data_.size(), free, jpeg);
+    }
+  }
+  if (!surface)
+    return;
   cairo_save(cr);
   cairo_translate(cr, frame_.Left(), frame_.Top());
-  cairo_scale(cr, frame_.size_.width_ / cairo_image_surface_get_width(surface_),
-              frame_.size_.height_ / cairo_image_surface_get_height(surface_));
-  cairo_set_source_surface(cr, surface_, 0, 0);
+  cairo_scale(cr, frame_.size_.width_ / cairo_image_surface_get_width(surface),
+              frame_.size_.height_ / cairo_image_surface_get_height(surface));
+  cairo_set_source_surface(cr, surface, 0, 0);
   cairo_paint(cr);
   cairo_restore(cr);
+  cairo_surface_destroy(surface);
 }
 
 }  // namespace pdfsketch
@@ -3,25 +3,84 @@
 #ifndef PDFSKETCH_IMAGE_H__
 #define PDFSKETCH_IMAGE_H__
 
+#include <list>
+#include <mutex>
+#include <utility>
 #include <vector>
 
 #include "graphic.h"
 
 namespace pdfsketch {
 
-// Class that represents an image. Currently only supports PNG.
+// Class that represents an image: a PNG or a JPEG. The format is
+// sniffed from the bytes; WebP is recognized, but can't be decoded.
+//
+// The encoded bytes are all that's kept for good; pixels are decoded
+// when first drawn. On screen, an image is drawn from a pyramid of
+// copies at 1/2, 1/4, ... of full size, using the smallest copy that
+// still has a pixel per device pixel. Levels are built as they're
+// needed and dropped, least recently drawn first, once all images'
+// levels take more than kLevelByteBudget. JPEGs decode straight to a
+// level of up to 1/8 size, using libjpeg's DCT scaling.
 
 class Image : public Graphic {
  public:
+  static const size_t kLevelByteBudget = 48 * 1024 * 1024;
+
   Image(const char* data, size_t len);
   explicit Image(const pdfsketchproto::Graphic& msg);
-  void InitSurface();
   ~Image();
   virtual void Serialize(pdfsketchproto::Graphic* out) const;
   virtual void Draw(cairo_t* cr, bool selected);
+  virtual bool WantsRasterCache() const { return true; }
+  // False if the image isn't in a format that can be drawn, or is
+  // corrupt.
+  bool Readable() const { return !decode_failed_; }
+
  private:
+  enum Format {
+    kUnknownFormat,
+    kPNG,
+    kJPEG,
+    kWebP
+  };
+  // (image, level) of every built level, most recently drawn first
+  typedef std::list<std::pair<Image*, int>> LevelList;
+  struct Level {
+    cairo_surface_t* surface{nullptr};
+    LevelList::iterator lru_it;
+  };
+
+  // Reads the format, and the size in pixels as displayed, from the
+  // image's header.
+  void ReadHeader();
+  // Returns a new surface holding pyramid level 'level' or a more
+  // detailed one, and sets 'decoded_level' to which it is. Returns NULL
+  // if the image can't be decoded.
+  cairo_surface_t* Decode(int level, int* decoded_level);
+  // The pyramid level with the fewest pixels that's still at least as
+  // detailed as 'cr' will show.
+  int LevelForContext(cairo_t* cr) const;
+  // Returns a new reference to the surface for 'level', building it if
+  // needed, or NULL if the image can't be decoded.
+  cairo_surface_t* GetLevel(int level);
+  // Must hold levels_lock_.
+  void DropLevel(int level);
+  static void EvictLevels();
+
   std::vector<char> data_;
-  cairo_surface_t* surface_{nullptr};
+  Format format_{kUnknownFormat};
+  int width_{0};  // full size, in pixels, as displayed
+  int height_{0};
+  int orientation_{1};  // of a JPEG, as in its Exif data
+  bool jpeg_embeddable_{false};  // can go into PDFs as it is
+  bool decode_failed_{false};
+  std::vector<Level> levels_;  // index n is 1/2^n of full size
+
+  // Protects the members below, and levels_ of all images
+  static std::mutex levels_lock_;
+  static LevelList levels_lru_;
+  static size_t levels_bytes_;
 };
 
 }  // namespace pdfsketch
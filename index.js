@@ -53,49 +53,25 @@ function errorHandler(err) {
     console.log(err);
 }
 
-function isPDFSketch(array_buf) {
-    var intarr = new Int8Array(array_buf);
-    return intarr[0] == 's'.charCodeAt(0) &&
-	intarr[1] == 'k'.charCodeAt(0) &&
-	intarr[2] == 'c'.charCodeAt(0) &&
-	intarr[3] == 'h'.charCodeAt(0);
-}
-
 function onPluginMessage(message_event) {
-    if (message_event.data instanceof ArrayBuffer) {
-	if (isPDFSketch(message_event.data)) {
-	    handlePDFSketchSave(message_event.data);
-	    return;
-	}
-	console.log("got PDF i assume");
-
-	if (gOpenFileEntry) {
-	    // Save to existing file
-	    gOpenFileEntry.createWriter(function(fileWriter) {
-		fileWriter.onwriteend = function(evt) {
-		    fileWriter.onwriteend = function(evt) {
-			console.log('saved');
-			document.getElementById('statusField').innerText = 'Saved';
-		    };
-		    fileWriter.write(new Blob([new Int8Array(message_event.data)], {type: 'application/x-pdf'}));
-		}
-		fileWriter.seek(0);
-		fileWriter.truncate(0);
-	    }, errorHandler);
-	    return;
+    if (message_event.data && message_event.data.cmd === 'exportChunk') {
+	if (gExport) {
+	    gExport.queue.push(new Blob(
+		[new Int8Array(message_event.data.data, 0,
+			       message_event.data.length)],
+		{type: 'application/x-pdf'}));
+	    writeNextExportChunk(gExport);
 	}
-
-	chrome.fileSystem.chooseEntry({'type': 'saveFile'}, function(entry) {
-	    entry.createWriter(function(fileWriter) {
-		fileWriter.onwriteend = function(evt) {
-		    fileWriter.onwriteend = function(evt) { console.log('saved'); };
-		    fileWriter.write(new Blob([new Int8Array(message_event.data)], {type: 'application/x-pdf'}));
-		}
-		fileWriter.seek(0);
-		fileWriter.truncate(0);
-	    }, errorHandler);
-	});
-
+	return;
+    }
+    if (message_event.data && message_event.data.cmd === 'save') {
+	queueSaveWrite({id: message_event.data.id, append: false,
+			data: message_event.data.data});
+	return;
+    }
+    if (message_event.data && message_event.data.cmd === 'appendSave') {
+	queueSaveWrite({id: message_event.data.id, append: true,
+			data: message_event.data.data});
 	return;
     }
     if (typeof(message_event.data) === 'string') {
@@ -115,6 +91,14 @@ function onPluginMessage(message_event) {
 	if (stringStartsWith(message_event.data, REDO_ENABLED_PREFIX)) {
 	    setRedoEnabled(message_event.data.slice(REDO_ENABLED_PREFIX.length));
 	}
+	var PROGRESS_PREFIX = 'progress:';
+	if (stringStartsWith(message_event.data, PROGRESS_PREFIX)) {
+	    jobProgress(message_event.data.slice(PROGRESS_PREFIX.length));
+	}
+	var JOB_DONE_PREFIX = 'jobDone:';
+	if (stringStartsWith(message_event.data, JOB_DONE_PREFIX)) {
+	    jobDone(message_event.data.slice(JOB_DONE_PREFIX.length));
+	}
 	var COPY_PREFIX = 'copy:';
 	if (stringStartsWith(message_event.data, COPY_PREFIX)) {
 	    copyString(message_event.data.slice(COPY_PREFIX.length));
@@ -160,7 +144,8 @@ function openPDF() {
 gSaveFileEntry = null;
 
 function save() {
-    HelloTutorialModule.postMessage('save');
+    // Once there's a saved file, only changes need to be appended
+    HelloTutorialModule.postMessage(gSaveFileEntry ? 'saveDelta' : 'save');
 }
 
 function saveAs() {
@@ -168,34 +153,158 @@ function saveAs() {
     HelloTutorialModule.postMessage('save');
 }
 
-function handlePDFSketchSave(arraybuf) {
-    var write = function() {
-	gSaveFileEntry.createWriter(function(fileWriter) {
-	    fileWriter.onwriteend = function(evt) {
-		fileWriter.onwriteend = function(evt) { console.log('saved'); };
-		fileWriter.write(new Blob([new Int8Array(arraybuf)], {type: 'application/x-pdfsketch'}));
+// Writes to the .pdfsketch file, one at a time in the order native
+// asked for them, so an append can't land while the full save before it
+// is still being written. Native is told how each went, with
+// 'saveWritten:<id>:<ok|failed>', and makes the next save a full one
+// after a failure.
+var gSaveQueue = [];
+var gSaveWriting = false;
+
+function queueSaveWrite(write) {
+    gSaveQueue.push(write);
+    if (!gSaveWriting)
+	writeNextSave();
+}
+
+function writeNextSave() {
+    var write = gSaveQueue.shift();
+    if (!write) {
+	gSaveWriting = false;
+	return;
+    }
+    gSaveWriting = true;
+    var blob = new Blob([new Int8Array(write.data)],
+			{type: 'application/x-pdfsketch'});
+    var finish = function(ok) {
+	HelloTutorialModule.postMessage(
+	    'saveWritten:' + write.id + ':' + (ok ? 'ok' : 'failed'));
+	document.getElementById('statusField').innerText =
+	    ok ? 'Saved' : 'Save failed';
+	if (!ok) {
+	    // Appends queued behind it would go onto a file that's missing
+	    // this write. Fail them too, up to the next full save.
+	    while (gSaveQueue.length && gSaveQueue[0].append) {
+		HelloTutorialModule.postMessage(
+		    'saveWritten:' + gSaveQueue.shift().id + ':failed');
 	    }
-	    fileWriter.seek(0);
+	}
+	writeNextSave();
+    };
+    var writeTo = function(entry) {
+	entry.createWriter(function(fileWriter) {
+	    var failed = false;
+	    fileWriter.onerror = function(err) {
+		console.log(err);
+		failed = true;
+	    };
+	    var writeData = function() {
+		fileWriter.onwriteend = function(evt) {
+		    finish(!failed);
+		};
+		fileWriter.write(blob);
+	    };
+	    if (write.append) {
+		fileWriter.seek(fileWriter.length);
+		writeData();
+		return;
+	    }
+	    fileWriter.onwriteend = function(evt) {
+		if (failed)
+		    finish(false);
+		else
+		    writeData();
+	    };
 	    fileWriter.truncate(0);
-	}, errorHandler);
+	}, function(err) {
+	    errorHandler(err);
+	    finish(false);
+	});
     };
 
-    if (!gSaveFileEntry) {
+    if (gSaveFileEntry) {
+	writeTo(gSaveFileEntry);
+    } else if (write.append) {
+	// Nothing to append to
+	finish(false);
+    } else {
 	chrome.fileSystem.chooseEntry(
 	    {type: 'saveFile',
 	     accepts: [{ extensions: ['html']}]
 	    }, function(entry) {
+		if (!entry) {
+		    finish(false);
+		    return;
+		}
 		gSaveFileEntry = entry;
-		write();
+		writeTo(entry);
 	    });
-    } else {
-	write();
     }
 }
 
+// The export in progress. Its chunks are written to the file as they
+// arrive, one write at a time from onwriteend, so the whole PDF is never
+// held here. The file is left alone until the first chunk comes.
+var gExport = null;
+
 function exportPDF() {
-    document.getElementById('statusField').innerText = 'Saving...';
-    HelloTutorialModule.postMessage('exportPDF');
+    if (gExport) {
+	document.getElementById('statusField').innerText =
+	    'Busy, try again when done';
+	return;
+    }
+    var startExport = function(entry) {
+	entry.createWriter(function(fileWriter) {
+	    var exp = {writer: fileWriter, queue: [], writing: false,
+		       started: false, failed: false, result: null};
+	    fileWriter.onerror = function(err) {
+		console.log(err);
+		exp.failed = true;
+	    };
+	    fileWriter.onwriteend = function(evt) {
+		exp.writing = false;
+		writeNextExportChunk(exp);
+	    };
+	    gExport = exp;
+	    document.getElementById('statusField').innerText = 'Exporting...';
+	    document.getElementById('buttonCancel').disabled = false;
+	    HelloTutorialModule.postMessage('exportPDF');
+	}, errorHandler);
+    };
+    if (gOpenFileEntry) {
+	// Save to existing file
+	startExport(gOpenFileEntry);
+	return;
+    }
+    chrome.fileSystem.chooseEntry({'type': 'saveFile'}, function(entry) {
+	if (entry)
+	    startExport(entry);
+    });
+}
+
+function writeNextExportChunk(exp) {
+    if (exp.writing)
+	return;
+    if (exp.failed) {
+	exp.queue = [];
+    } else if (exp.queue.length) {
+	exp.writing = true;
+	if (!exp.started) {
+	    exp.started = true;
+	    exp.writer.truncate(0);
+	} else {
+	    exp.writer.write(exp.queue.shift());
+	}
+	return;
+    }
+    if (!exp.result)
+	return;
+    // Native is done and every chunk has landed
+    if (gExport === exp)
+	gExport = null;
+    var result = exp.failed ? 'failed' : exp.result;
+    var messages = {ok: 'Saved', failed: 'Failed', cancelled: 'Cancelled'};
+    document.getElementById('statusField').innerText = messages[result];
 }
 
 function insertImage() {
@@ -302,6 +411,48 @@ function setRedoEnabled(enabled) {
     document.getElementById('buttonRedo').disabled = enabled != 'true';
 }
 
+var JOB_NAMES = {save: 'Saving', 'export': 'Exporting'};
+
+// 'progress' is "<job>:<done>/<total>"
+function jobProgress(progress) {
+    var parts = progress.split(':');
+    var counts = parts[1].split('/');
+    var percent = Math.floor(100 * counts[0] / Math.max(1, counts[1]));
+    document.getElementById('statusField').innerText =
+	(JOB_NAMES[parts[0]] || parts[0]) + ' ' + percent + '%';
+    document.getElementById('buttonCancel').disabled = false;
+}
+
+// 'result' is "<job>:<ok|failed|cancelled|busy>"
+function jobDone(result) {
+    var parts = result.split(':');
+    if (parts[1] == 'busy') {
+	// The other job is still running; leave its state alone
+	document.getElementById('statusField').innerText =
+	    'Busy, try again when done';
+	// Nothing was sent, so there's nothing to write
+	if (parts[0] == 'export')
+	    gExport = null;
+	return;
+    }
+    document.getElementById('buttonCancel').disabled = true;
+    // A save's file write is still to come, and reports itself
+    if (parts[0] == 'save' && parts[1] == 'ok')
+	return;
+    // An export finishes once its remaining chunks are written
+    if (parts[0] == 'export' && gExport) {
+	gExport.result = parts[1];
+	writeNextExportChunk(gExport);
+	return;
+    }
+    var messages = {ok: 'Saved', failed: 'Failed', cancelled: 'Cancelled'};
+    document.getElementById('statusField').innerText = messages[parts[1]];
+}
+
+function cancelJob() {
+    HelloTutorialModule.postMessage('cancel');
+}
+
 var gStrokeSelect = null;
 var gFillSelect = null;
 
@@ -389,6 +540,7 @@ window.onload = function() {
 
     document.getElementById('buttonOpen').onclick = openPDF;
     document.getElementById('buttonExportPDF').onclick = exportPDF;
+    document.getElementById('buttonCancel').onclick = cancelJob;
     document.getElementById('buttonInsertImage').onclick = insertImage;
     document.getElementById('buttonZoomIn').onclick = zoomIn;
     document.getElementById('buttonZoomOut').onclick = zoomOut;
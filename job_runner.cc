@@ -0,0 +1,33 @@
+// Copyright...
+
+#include "job_runner.h"
+
+#include "trace.h"
+
+namespace pdfsketch {
+
+bool JobRunner::Start(const Job& job, const ProgressCallback& report,
+                      const DoneCallback& done) {
+  if (busy_.exchange(true))
+    return false;
+  cancelled_ = false;
+  thread_.Post(0, 0, [this, job, report, done] (int worker) {
+      TRACE_EVENT("JobRunner job");
+      bool ok = job([this, report] (uint64_t done, uint64_t total) {
+          if (cancelled_)
+            return false;
+          if (report)
+            report(done, total);
+          return true;
+        });
+      bool cancelled = cancelled_;
+      // Free before 'done' runs, so whoever it notifies can start the
+      // next job straight away.
+      busy_ = false;
+      if (done)
+        done(ok, cancelled);
+    });
+  return true;
+}
+
+}  // namespace pdfsketch
@@ -0,0 +1,56 @@
+// Copyright...
+
+#ifndef PDFSKETCH_JOB_RUNNER_H__
+#define PDFSKETCH_JOB_RUNNER_H__
+
+#include <atomic>
+#include <functional>
+#include <stdint.h>
+
+#include "progress.h"
+#include "worker_pool.h"
+
+namespace pdfsketch {
+
+// Runs long jobs, like saving and exporting, one at a time on a
+// background thread, so the thread that owns the document stays free.
+// Jobs must work from a snapshot of whatever they need. A running job
+// can be cancelled; it finds out the next time it reports progress.
+
+class JobRunner {
+ public:
+  // Runs on the job thread. Should pass 'progress' down to whatever
+  // does the work, and give up once it returns false. Returns whether
+  // the job succeeded.
+  typedef std::function<bool (const ProgressFunction& progress)> Job;
+  // Called on the job thread each time the job reports progress.
+  typedef std::function<void (uint64_t done, uint64_t total)> ProgressCallback;
+  // Called on the job thread once the job has returned 'ok', after the
+  // runner is free to start another. 'cancelled' is whether the job had
+  // been asked to stop.
+  typedef std::function<void (bool ok, bool cancelled)> DoneCallback;
+
+  JobRunner() {}
+  // Cancels the running job, if any, and waits for it to stop.
+  ~JobRunner() { Cancel(); }
+
+  // Starts 'job', unless another is still running, in which case this
+  // returns false. 'report' and 'done' may be empty.
+  bool Start(const Job& job, const ProgressCallback& report,
+             const DoneCallback& done);
+  void Cancel() { cancelled_ = true; }
+  bool busy() const { return busy_; }
+  // Whether the current job has been asked to stop. Jobs can check
+  // this to tell cancellation from failure.
+  bool cancelled() const { return cancelled_; }
+
+ private:
+  std::atomic<bool> busy_{false};
+  std::atomic<bool> cancelled_{false};
+  // Last, so it's destroyed (waiting for the running job) first.
+  WorkerPool thread_{1};
+};
+
+}  // namespace pdfsketch
+
+#endif  // PDFSKETCH_JOB_RUNNER_H__
@@ -0,0 +1,55 @@
+// Copyright...
+
+#include "page_index.h"
+
+#include <algorithm>
+
+using std::vector;
+
+namespace pdfsketch {
+
+void PageIndex::Layout(const vector<Size>& page_sizes, double spacing) {
+  rects_.clear();
+  tops_.clear();
+  bottoms_.clear();
+  double max_page_width = 0.0;  // w/o spacing
+  double total_height = spacing;  // w/ spacing
+  for (const Size& size : page_sizes) {
+    rects_.push_back(Rect(0.0, total_height, size.width_, size.height_));
+    tops_.push_back(total_height);
+    bottoms_.push_back(total_height + size.height_);
+    max_page_width = std::max(max_page_width, size.width_);
+    total_height += size.height_ + spacing;
+  }
+  size_ = Size(max_page_width + 2 * spacing, total_height);
+  // Center pages horizontally
+  for (Rect& rect : rects_) {
+    rect.origin_.x_ =
+        static_cast<int>(size_.width_ / 2 - rect.size_.width_ / 2);
+  }
+}
+
+int PageIndex::PageForPoint(const Point& point) const {
+  if (rects_.empty())
+    return -1;
+  // First page whose bottom is at or below the point
+  vector<double>::const_iterator it =
+      std::lower_bound(bottoms_.begin(), bottoms_.end(), point.y_);
+  if (it == bottoms_.end())
+    return pages() - 1;
+  return it - bottoms_.begin();
+}
+
+int PageIndex::MinPageForRect(const Rect& rect) const {
+  // First page whose bottom is below the top of rect
+  return std::upper_bound(bottoms_.begin(), bottoms_.end(), rect.Top()) -
+      bottoms_.begin();
+}
+
+int PageIndex::MaxPageForRect(const Rect& rect) const {
+  // Last page whose top is above the bottom of rect
+  return std::lower_bound(tops_.begin(), tops_.end(), rect.Bottom()) -
+      tops_.begin() - 1;
+}
+
+}  // namespace pdfsketch
@@ -0,0 +1,48 @@
+// Copyright...
+
+#ifndef PDFSKETCH_PAGE_INDEX_H__
+#define PDFSKETCH_PAGE_INDEX_H__
+
+#include <vector>
+
+#include "view.h"
+
+namespace pdfsketch {
+
+// Positions of pages stacked top to bottom and centered horizontally,
+// as in DocumentView. Lookups are O(log n) in the number of pages and
+// don't allocate.
+
+class PageIndex {
+ public:
+  // Lays out pages with the given sizes (view units), with 'spacing'
+  // around and between them.
+  void Layout(const std::vector<Size>& page_sizes, double spacing);
+
+  int pages() const { return rects_.size(); }
+  // Size of the area holding all the pages, including spacing.
+  Size size() const { return size_; }
+
+  Rect PageRect(int page) const { return rects_[page]; }
+
+  // Returns the page containing 'point', or the page below it if the
+  // point is in the spacing above a page. Points below the last page
+  // map to the last page. Returns -1 if there are no pages.
+  int PageForPoint(const Point& point) const;
+
+  // Returns the lowest/highest page that intersects with 'rect'. If no
+  // page does, the returned min is greater than the returned max.
+  int MinPageForRect(const Rect& rect) const;
+  int MaxPageForRect(const Rect& rect) const;
+
+ private:
+  std::vector<Rect> rects_;
+  // Top and bottom of each page, for binary searches.
+  std::vector<double> tops_;
+  std::vector<double> bottoms_;
+  Size size_;
+};
+
+}  // namespace pdfsketch
+
+#endif  // PDFSKETCH_PAGE_INDEX_H__
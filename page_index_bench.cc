@@ -0,0 +1,80 @@
+// Copyright...
+
+// Measures the cost of the page lookups done for each mouse drag
+// event (point -> page, then page -> rect for the coordinate
+// conversion) as the number of pages grows. With PageIndex the cost
+// per event should stay roughly flat from 10 to 5000 pages. A linear
+// scan, like the one PageForPoint used to do, is timed for comparison.
+
+#include <chrono>
+#include <stdio.h>
+#include <vector>
+
+#include "page_index.h"
+
+using std::vector;
+
+namespace pdfsketch {
+
+namespace {
+const int kDragEvents = 200000;
+const double kSpacing = 20.0;
+
+int LinearPageForPoint(const PageIndex& index, const Point& point) {
+  for (int i = 0; i < index.pages(); i++) {
+    if (point.y_ <= index.PageRect(i).Bottom())
+      return i;
+  }
+  return index.pages() - 1;
+}
+
+// Returns nanoseconds per simulated drag event. The drag sweeps from
+// the top to the bottom of the document.
+template<typename Lookup>
+double TimeDrag(const PageIndex& index, Lookup lookup, double* checksum) {
+  double height = index.size().height_;
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  for (int i = 0; i < kDragEvents; i++) {
+    Point point(300.0, height * i / kDragEvents);
+    int page = lookup(index, point);
+    Rect page_rect = index.PageRect(page);
+    // Same math as DocumentView::ConvertPointToPage()
+    *checksum += point.y_ - page_rect.Top();
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / kDragEvents;
+}
+}  // namespace {}
+
+void RunBenchmark() {
+  const int kPageCounts[] = { 10, 100, 1000, 5000 };
+  double checksum = 0.0;
+  printf("%8s %16s %16s\n", "pages", "indexed ns/evt", "linear ns/evt");
+  for (int pages : kPageCounts) {
+    // US Letter pages, with every third one landscape
+    vector<Size> sizes;
+    for (int i = 0; i < pages; i++)
+      sizes.push_back(i % 3 ? Size(612.0, 792.0) : Size(792.0, 612.0));
+    PageIndex index;
+    index.Layout(sizes, kSpacing);
+    double indexed = TimeDrag(
+        index,
+        [] (const PageIndex& index, const Point& point) {
+          return index.PageForPoint(point);
+        },
+        &checksum);
+    double linear = TimeDrag(index, LinearPageForPoint, &checksum);
+    printf("%8d %16.1f %16.1f\n", pages, indexed, linear);
+  }
+  // Keeps the loops from being optimized away
+  printf("checksum: %f\n", checksum);
+}
+
+}  // namespace pdfsketch
+
+int main(int argc, char** argv) {
+  pdfsketch::RunBenchmark();
+  return 0;
+}
@@ -0,0 +1,92 @@
+// Copyright...
+
+#include "page_tile_cache.h"
+
+#include <math.h>
+
+using std::make_pair;
+using std::map;
+using std::pair;
+
+namespace pdfsketch {
+
+namespace {
+const double kScaleBucketsPerUnit = 1000.0;
+}  // namespace {}
+
+int PageTileCache::ScaleBucket(double scale) {
+  int ret = static_cast<int>(round(scale * kScaleBucketsPerUnit));
+  return ret > 0 ? ret : 1;
+}
+
+double PageTileCache::BucketScale(int bucket) {
+  return bucket / kScaleBucketsPerUnit;
+}
+
+void PageTileCache::SetByteBudget(size_t byte_budget) {
+  byte_budget_ = byte_budget;
+  EvictToBudget();
+}
+
+cairo_surface_t* PageTileCache::Get(const TileKey& key) {
+  map<TileKey, Entry>::iterator it = tiles_.find(key);
+  if (it == tiles_.end())
+    return NULL;
+  // Move to front of LRU list
+  lru_.splice(lru_.begin(), lru_, it->second.lru_it);
+  return it->second.surface;
+}
+
+void PageTileCache::Put(const TileKey& key, cairo_surface_t* surface) {
+  map<TileKey, Entry>::iterator it = tiles_.find(key);
+  if (it != tiles_.end())
+    Erase(it);
+  Entry entry;
+  entry.surface = surface;
+  entry.bytes = cairo_image_surface_get_stride(surface) *
+      cairo_image_surface_get_height(surface);
+  lru_.push_front(key);
+  entry.lru_it = lru_.begin();
+  tiles_[key] = entry;
+  page_scales_[make_pair(key.page, key.scale)]++;
+  bytes_used_ += entry.bytes;
+  EvictToBudget();
+}
+
+int PageTileCache::NearestCachedScale(int page, int scale) const {
+  int best = 0;
+  map<pair<int, int>, int>::const_iterator it =
+      page_scales_.lower_bound(make_pair(page, 0));
+  for (; it != page_scales_.end() && it->first.first == page; ++it) {
+    int candidate = it->first.second;
+    if (candidate == scale)
+      continue;
+    if (!best || abs(candidate - scale) < abs(best - scale))
+      best = candidate;
+  }
+  return best;
+}
+
+void PageTileCache::Clear() {
+  while (!tiles_.empty())
+    Erase(tiles_.begin());
+}
+
+void PageTileCache::Erase(map<TileKey, Entry>::iterator it) {
+  pair<int, int> page_scale = make_pair(it->first.page, it->first.scale);
+  if (--page_scales_[page_scale] == 0)
+    page_scales_.erase(page_scale);
+  bytes_used_ -= it->second.bytes;
+  lru_.erase(it->second.lru_it);
+  cairo_surface_destroy(it->second.surface);
+  tiles_.erase(it);
+}
+
+void PageTileCache::EvictToBudget() {
+  // Always keep the most recently used tile, even if it alone is over
+  // budget, as it's likely about to be drawn.
+  while (bytes_used_ > byte_budget_ && lru_.size() > 1)
+    Erase(tiles_.find(lru_.back()));
+}
+
+}  // namespace pdfsketch
@@ -0,0 +1,94 @@
+// Copyright...
+
+#ifndef PDFSKETCH_PAGE_TILE_CACHE_H__
+#define PDFSKETCH_PAGE_TILE_CACHE_H__
+
+#include <list>
+#include <map>
+#include <stdlib.h>
+#include <utility>
+
+#include <cairo.h>
+
+namespace pdfsketch {
+
+// A tile is a kTileSize x kTileSize pixel rendering of part of a PDF
+// page. Tiles are addressed by page, scale bucket and tile coordinate
+// (in units of kTileSize device pixels from the page's upper-left).
+struct TileKey {
+  TileKey() : page(0), scale(0), x(0), y(0) {}
+  TileKey(int page_in, int scale_in, int x_in, int y_in)
+      : page(page_in), scale(scale_in), x(x_in), y(y_in) {}
+  bool operator<(const TileKey& that) const {
+    if (page != that.page) return page < that.page;
+    if (scale != that.scale) return scale < that.scale;
+    if (y != that.y) return y < that.y;
+    return x < that.x;
+  }
+  bool operator==(const TileKey& that) const {
+    return page == that.page && scale == that.scale &&
+        x == that.x && y == that.y;
+  }
+  int page;
+  int scale;  // see PageTileCache::ScaleBucket()
+  int x, y;
+};
+
+// Holds rendered page tiles. When the total memory used by tile
+// surfaces exceeds the byte budget, least recently used tiles are
+// evicted.
+class PageTileCache {
+ public:
+  static const int kTileSize = 512;  // in device pixels
+  static const size_t kDefaultByteBudget = 64 * 1024 * 1024;
+
+  explicit PageTileCache(size_t byte_budget = kDefaultByteBudget)
+      : byte_budget_(byte_budget) {}
+  ~PageTileCache() { Clear(); }
+
+  // Render scale (zoom * device scale) is quantized into buckets so
+  // that tiles can be found again after floating point round trips.
+  static int ScaleBucket(double scale);
+  static double BucketScale(int bucket);
+
+  void SetByteBudget(size_t byte_budget);
+  size_t bytes_used() const { return bytes_used_; }
+
+  // Returns the tile for 'key', or NULL if it's not cached. The
+  // returned surface is owned by the cache; it's valid until the next
+  // call to Put(), SetByteBudget() or Clear().
+  cairo_surface_t* Get(const TileKey& key);
+  // Like Get(), but doesn't affect LRU order.
+  bool Contains(const TileKey& key) const {
+    return tiles_.find(key) != tiles_.end();
+  }
+  // Takes ownership of 'surface'.
+  void Put(const TileKey& key, cairo_surface_t* surface);
+
+  // Returns the scale bucket closest to 'scale' (but not equal to it)
+  // for which there are tiles of 'page' cached, or 0 if there are none.
+  int NearestCachedScale(int page, int scale) const;
+
+  void Clear();
+
+ private:
+  typedef std::list<TileKey> LRUList;
+  struct Entry {
+    cairo_surface_t* surface;
+    size_t bytes;
+    LRUList::iterator lru_it;
+  };
+  void Erase(std::map<TileKey, Entry>::iterator it);
+  void EvictToBudget();
+
+  std::map<TileKey, Entry> tiles_;
+  LRUList lru_;  // front is most recently used
+  // (page, scale bucket) -> number of tiles cached
+  std::map<std::pair<int, int>, int> page_scales_;
+  size_t byte_budget_;
+  size_t bytes_used_{0};
+};
+
+}  // namespace pdfsketch
+
+#endif  // PDFSKETCH_PAGE_TILE_CACHE_H__
@@ -0,0 +1,251 @@
+// Copyright...
+
+#include "pdf_exporter.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <stdio.h>
+#include <streambuf>
+#include <utility>
+
+#include <cairo-pdf.h>
+#include <podofo/base/PdfArray.h>
+#include <podofo/base/PdfDictionary.h>
+#include <podofo/base/PdfError.h>
+#include <podofo/base/PdfName.h>
+#include <podofo/base/PdfObject.h>
+#include <podofo/base/PdfOutputDevice.h>
+#include <podofo/base/PdfReference.h>
+#include <podofo/base/PdfStream.h>
+#include <podofo/base/PdfVecObjects.h>
+#include <podofo/doc/PdfFileSpec.h>
+#include <podofo/doc/PdfMemDocument.h>
+#include <podofo/doc/PdfPage.h>
+#include <podofo/doc/PdfXObject.h>
+
+#include "trace.h"
+#include "worker_pool.h"
+
+using std::string;
+using std::vector;
+
+namespace pdfsketch {
+
+namespace {
+cairo_status_t HandleCairoStreamWrite(void* closure,
+                                      const unsigned char *data,
+                                      unsigned int length) {
+  ByteSink* out = reinterpret_cast<ByteSink*>(closure);
+  if (!out->Write(reinterpret_cast<const char*>(data), length))
+    return CAIRO_STATUS_WRITE_ERROR;
+  return CAIRO_STATUS_SUCCESS;
+}
+
+// Draws the graphics for 'page' into a one-page scratch PDF of the
+// given size.
+bool RenderOverlay(double width, double height, int page,
+                   const PDFExporter::DrawPageFunction& draw,
+                   vector<char>* out) {
+  TRACE_EVENT("PDFExporter RenderOverlay");
+  VectorByteSink sink(out);
+  cairo_surface_t* surface = cairo_pdf_surface_create_for_stream(
+      HandleCairoStreamWrite, &sink, width, height);
+  cairo_t* cr = cairo_create(surface);
+  draw(page, cr);
+  cairo_destroy(cr);
+  cairo_surface_finish(surface);
+  bool ret = cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS;
+  cairo_surface_destroy(surface);
+  return ret;
+}
+
+// Makes a new content stream object holding 'data' and returns a
+// reference to it.
+PoDoFo::PdfReference NewContentStream(const string& data,
+                                      PoDoFo::PdfMemDocument* doc) {
+  PoDoFo::PdfObject* stream = doc->GetObjects()->CreateObject();
+  stream->GetStream()->Set(data.data(), data.size());
+  return stream->Reference();
+}
+
+// Imports the scratch PDF in 'overlay_data' as a form XObject and draws
+// it over 'page' from a newly appended content stream. The existing
+// content streams are left alone, but put between streams holding just
+// "q" and "Q", so graphics state they leave behind (a transform, a
+// clip) doesn't apply to the overlay.
+void DrawOverlay(const vector<char>& overlay_data, PoDoFo::PdfPage* page,
+                 PoDoFo::PdfMemDocument* doc) {
+  TRACE_EVENT("PDFExporter DrawOverlay");
+  PoDoFo::PdfMemDocument overlay;
+  overlay.Load(&overlay_data[0], overlay_data.size());
+  PoDoFo::PdfXObject xobject(overlay, 0, doc);
+  page->AddResource(xobject.GetIdentifier(), xobject.GetObjectReference(),
+                    PoDoFo::PdfName("XObject"));
+  PoDoFo::PdfRect box = page->GetCropBox();
+  char draw[128];
+  snprintf(draw, sizeof(draw), "q 1 0 0 1 %.4f %.4f cm /",
+           box.GetLeft(), box.GetBottom());
+  PoDoFo::PdfReference overlay_stream = NewContentStream(
+      draw + xobject.GetIdentifier().GetName() + " Do Q\n", doc);
+
+  // /Contents is a stream or an array of them. An existing array is
+  // changed in place, as the page keeps a pointer to it.
+  PoDoFo::PdfObject* contents = page->GetContents();
+  if (contents && contents->IsArray()) {
+    PoDoFo::PdfArray& streams = contents->GetArray();
+    if (!streams.empty()) {
+      streams.insert(streams.begin(), NewContentStream("q\n", doc));
+      streams.push_back(NewContentStream("Q\n", doc));
+    }
+    streams.push_back(overlay_stream);
+    return;
+  }
+  PoDoFo::PdfArray streams;
+  if (contents) {
+    streams.push_back(NewContentStream("q\n", doc));
+    streams.push_back(contents->Reference());
+    streams.push_back(NewContentStream("Q\n", doc));
+  }
+  streams.push_back(overlay_stream);
+  page->GetObject()->GetDictionary().AddKey(PoDoFo::PdfName("Contents"),
+                                            streams);
+}
+
+// Lets PoDoFo write through a std::ostream straight into a ByteSink.
+// Unbuffered; sinks do their own buffering.
+class SinkStreamBuf : public std::streambuf {
+ public:
+  explicit SinkStreamBuf(ByteSink* out) : out_(out) {}
+  bool ok() const { return ok_; }
+
+ protected:
+  virtual std::streamsize xsputn(const char* data, std::streamsize len) {
+    if (!ok_ || !out_->Write(data, len)) {
+      ok_ = false;
+      return 0;
+    }
+    written_ += len;
+    return len;
+  }
+  virtual int_type overflow(int_type c) {
+    if (traits_type::eq_int_type(c, traits_type::eof()))
+      return traits_type::not_eof(c);
+    char ch = traits_type::to_char_type(c);
+    return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+  }
+  // Only supports asking for the current position.
+  virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                           std::ios_base::openmode which) {
+    if (off != 0 || dir != std::ios_base::cur || !(which & std::ios_base::out))
+      return pos_type(off_type(-1));
+    return pos_type(written_);
+  }
+  virtual int sync() {
+    return ok_ && out_->Flush() ? 0 : -1;
+  }
+
+ private:
+  ByteSink* out_;
+  bool ok_{true};
+  off_type written_{0};
+};
+
+// A page's scratch PDF, once a worker has drawn it.
+struct RenderedOverlay {
+  bool ok{false};
+  vector<char> data;
+};
+}  // namespace {}
+
+bool PDFExporter::Export(const ByteBuffer& pdf,
+                         const vector<int>& pages,
+                         const DrawPageFunction& draw,
+                         const string& attachment_name,
+                         const ByteBuffer& attachment,
+                         int num_threads,
+                         const ProgressFunction& progress,
+                         ByteSink* out) {
+  TRACE_EVENT("PDFExporter::Export");
+  try {
+    PoDoFo::PdfMemDocument doc;
+    doc.Load(pdf.data(), pdf.size(), true);  // for incremental update
+    // Looked up here, since PoDoFo objects mustn't be touched by workers.
+    vector<PoDoFo::PdfRect> boxes;
+    for (int page : pages) {
+      if (page < 0 || page >= doc.GetPageCount()) {
+        printf("%s: no page %d\n", __func__, page);
+        return false;
+      }
+      boxes.push_back(doc.GetPage(page)->GetCropBox());
+    }
+
+    // Overlays drawn but not yet imported, by index into 'pages'.
+    std::mutex lock;
+    std::condition_variable overlay_done;
+    std::map<size_t, RenderedOverlay> overlays;
+    // Declared after everything its tasks use, so that it's destroyed
+    // first, waiting for running tasks, if we bail out early.
+    WorkerPool pool(std::max(1, num_threads));
+    // Workers stay at most this many pages ahead of the import, which
+    // bounds the scratch PDFs held at once.
+    const size_t max_ahead = 2 * pool.num_threads();
+    size_t posted = 0;
+    for (size_t i = 0; i < pages.size(); i++) {
+      for (; posted < pages.size() && posted < i + max_ahead; posted++) {
+        size_t index = posted;
+        pool.Post(0, 0, [&, index] (int worker) {
+            RenderedOverlay overlay;
+            overlay.ok = RenderOverlay(boxes[index].GetWidth(),
+                                       boxes[index].GetHeight(),
+                                       pages[index], draw, &overlay.data);
+            std::lock_guard<std::mutex> guard(lock);
+            overlays[index] = std::move(overlay);
+            overlay_done.notify_one();
+          });
+      }
+      RenderedOverlay overlay;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        overlay_done.wait(guard, [&overlays, i] () {
+            return overlays.count(i) > 0;
+          });
+        overlay = std::move(overlays[i]);
+        overlays.erase(i);
+      }
+      if (!overlay.ok) {
+        printf("%s: drawing over page %d failed\n", __func__, pages[i]);
+        return false;
+      }
+      DrawOverlay(overlay.data, doc.GetPage(pages[i]), &doc);
+      if (progress && !progress(i + 1, pages.size())) {
+        printf("%s: cancelled\n", __func__);
+        return false;
+      }
+    }
+
+    if (!attachment.empty()) {
+      PoDoFo::PdfFileSpec filespec(
+          attachment_name.c_str(),
+          reinterpret_cast<const unsigned char*>(attachment.data()),
+          attachment.size(), &doc);
+      doc.AttachFile(filespec);
+    }
+
+    // Writes the original document followed by the changed objects,
+    // a new xref section and trailer.
+    SinkStreamBuf buf(out);
+    std::ostream stream(&buf);
+    PoDoFo::PdfOutputDevice device(&stream);
+    doc.WriteUpdate(&device, true);
+    device.Flush();
+    return buf.ok() && out->Flush();
+  } catch (const PoDoFo::PdfError& err) {
+    printf("%s: PoDoFo error: %s\n", __func__, err.what());
+    return false;
+  }
+}
+
+}  // namespace pdfsketch
@@ -0,0 +1,54 @@
+// Copyright...
+
+#ifndef PDFSKETCH_PDF_EXPORTER_H__
+#define PDFSKETCH_PDF_EXPORTER_H__
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <cairo.h>
+
+#include "byte_buffer.h"
+#include "byte_sink.h"
+#include "progress.h"
+
+namespace pdfsketch {
+
+// Exports an annotated PDF as an incremental update of the original:
+// the original bytes are written out unchanged, followed by new objects
+// that draw the graphics over the pages that have any. Untouched pages
+// aren't rewritten or re-rendered, so the time taken and the bytes
+// added depend on the graphics, not on the PDF.
+//
+// Each annotated page's graphics are drawn with cairo into a scratch
+// one-page PDF on a worker thread. The calling thread imports those in
+// page order as form XObjects, each drawn from a content stream
+// appended to its page, and frees them as it goes, so only a few
+// pages' scratch PDFs exist at once. The output, ending with the
+// attachment, new xref section and trailer, is streamed to the sink.
+
+class PDFExporter {
+ public:
+  // Draws the graphics for 'page' into 'cr', in page coordinates.
+  // Called on worker threads, possibly for several pages at once.
+  typedef std::function<void (int page, cairo_t* cr)> DrawPageFunction;
+
+  // 'pages' lists the pages to draw over, in increasing order. If
+  // 'attachment' isn't empty, it's embedded as a file named
+  // 'attachment_name'. 'progress' is called on the calling thread after
+  // each page. Returns false on failure or cancellation, in which case
+  // 'out' may have been partly written.
+  static bool Export(const ByteBuffer& pdf,
+                     const std::vector<int>& pages,
+                     const DrawPageFunction& draw,
+                     const std::string& attachment_name,
+                     const ByteBuffer& attachment,
+                     int num_threads,
+                     const ProgressFunction& progress,
+                     ByteSink* out);
+};
+
+}  // namespace pdfsketch
+
+#endif  // PDFSKETCH_PDF_EXPORTER_H__
@@ -2,6 +2,7 @@
 
 #include "pdfsketch.h"
 
+#include <algorithm>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -16,10 +17,7 @@
 
 #include <cairo-pdf.h>
 #include <cairo.h>
-#include <libtar.h>
 #include <nacl_io/nacl_io.h>
-#include <podofo/doc/PdfFileSpec.h>
-#include <podofo/doc/PdfMemDocument.h>
 #include <poppler/cpp/poppler-document.h>
 #include <poppler/cpp/poppler-embedded-file.h>
 #include <ppapi/c/ppb_image_data.h>
@@ -29,10 +27,15 @@
 #include <ppapi/cpp/mouse_cursor.h>
 #include <ppapi/cpp/var.h>
 #include <ppapi/cpp/var_array_buffer.h>
+#include <ppapi/cpp/var_dictionary.h>
 #include <ppapi/utility/completion_callback_factory.h>
 
+#include "asset_fs.h"
 #include "file_io.h"
+#include "font_manager.h"
 #include "scroll_bar_view.h"
+#include "trace.h"
+#include "worker_pool.h"
 
 using std::string;
 using std::unique_ptr;
@@ -42,14 +45,112 @@ namespace pdfsketch {
   Color *create_color_;
 }
 
-cairo_status_t HandleCairoStreamWrite(void* closure,
-                                      const unsigned char *data,
-                                      unsigned int length) {
-  vector<char>* out = reinterpret_cast<vector<char>*>(closure);
-  out->insert(out->end(), data, data + length);
-  return CAIRO_STATUS_SUCCESS;
+namespace {
+// Makes system.tar's fonts and fontconfig setup available without
+// unpacking it: fontconfig's configuration and caches, which it reads
+// in full as it starts, are copied out, and the fonts directory is
+// mounted so each font is fetched only when it's opened.
+void LoadSystemFiles() {
+  static pdfsketch::AssetArchive* archive = new pdfsketch::AssetArchive;
+  if (!archive->Open("/mnt/http/system.idx", "/mnt/http/system.tar"))
+    return;
+  archive->Extract("etc", "");
+  archive->Extract("var/cache/fontconfig", "");
+  mkdir("/usr", 0777);
+  mkdir("/usr/share", 0777);
+  mkdir("/usr/share/fonts", 0777);
+  pdfsketch::MountAssetArchive(archive, "usr/share/fonts", "/usr/share/fonts");
 }
 
+// Writes straight into an array buffer of the final size, so a save
+// doesn't need a second copy of the file to hand to JS.
+class ArrayBufferSink : public pdfsketch::ByteSink {
+ public:
+  virtual ~ArrayBufferSink() {
+    if (data_)
+      buffer_.Unmap();
+  }
+  virtual bool Reserve(uint64_t size) {
+    if (size > 0xffffffffULL)
+      return false;
+    buffer_ = pp::VarArrayBuffer(size);
+    data_ = static_cast<char*>(buffer_.Map());
+    size_ = size;
+    return data_ != NULL;
+  }
+  virtual bool Write(const char* data, size_t len) {
+    if (len > size_ - used_)
+      return false;
+    memcpy(data_ + used_, data, len);
+    used_ += len;
+    return true;
+  }
+  // Unmaps and returns the buffer
+  pp::VarArrayBuffer Finish() {
+    if (data_)
+      buffer_.Unmap();
+    data_ = NULL;
+    return buffer_;
+  }
+
+ private:
+  pp::VarArrayBuffer buffer_;
+  char* data_{NULL};
+  size_t size_{0};
+  size_t used_{0};
+};
+
+// Posts the bytes to JS as a series of {cmd: "exportChunk", data, length}
+// messages, so a whole exported file is never held here at once. Safe
+// to use off the main thread. JS writes each to the file as it arrives.
+class MessageChunkSink : public pdfsketch::ByteSink {
+ public:
+  explicit MessageChunkSink(pp::Instance* instance) : instance_(instance) {}
+  virtual ~MessageChunkSink() {
+    if (data_)
+      buffer_.Unmap();
+  }
+  virtual bool Write(const char* data, size_t len) {
+    while (len) {
+      if (!data_) {
+        buffer_ = pp::VarArrayBuffer(kChunkSize);
+        data_ = static_cast<char*>(buffer_.Map());
+        used_ = 0;
+        if (!data_)
+          return false;
+      }
+      size_t count = std::min(len, kChunkSize - used_);
+      memcpy(data_ + used_, data, count);
+      used_ += count;
+      data += count;
+      len -= count;
+      if (used_ == kChunkSize)
+        Flush();
+    }
+    return true;
+  }
+  virtual bool Flush() {
+    if (!data_)
+      return true;
+    buffer_.Unmap();
+    data_ = NULL;
+    pp::VarDictionary dict;
+    dict.Set(pp::Var("cmd"), pp::Var("exportChunk"));
+    dict.Set(pp::Var("data"), buffer_);
+    dict.Set(pp::Var("length"), pp::Var(static_cast<int32_t>(used_)));
+    instance_->PostMessage(dict);
+    return true;
+  }
+
+ private:
+  static const size_t kChunkSize = 1024 * 1024;
+  pp::Instance* instance_;
+  pp::VarArrayBuffer buffer_;
+  char* data_{NULL};
+  size_t used_{0};
+};
+}  // namespace {}
+
 void FlushCompletionCallback(void* user_data, int32_t result) {
   std::function<void (int32_t)>* func_p =
       reinterpret_cast<std::function<void (int32_t)>*>(user_data);
@@ -95,8 +196,10 @@ int PDFSketchInstance::SetupFS() {
   if (!data_url)
     data_url = "./";
 
+  // Without caching, reads of part of a file are ranged requests, so
+  // single files can be read out of system.tar.
   ret = mount(data_url, "/mnt/http", "httpfs", 0,
-              "");
+              "cache_content=false");
   if (ret) {
     printf("mounting http filesystem failed\n");
     return 1;
@@ -104,36 +207,20 @@ int PDFSketchInstance::SetupFS() {
 
   ListAndRemove("/mnt/html5");
 
-  TAR* tar = NULL;
-  const char kTarPath[] = "/mnt/http/system.tar";
-  char tar_path[sizeof(kTarPath)];
-  memcpy(tar_path, kTarPath, sizeof(kTarPath));
-  ret = tar_open(&tar, tar_path, NULL, O_RDONLY, 0, 0);
-  if (ret) {
-    printf("tar open failed\n");
-    return 1;    }
-  const char kPrefix[] = "/";
-  char prefix[sizeof(kPrefix)];
-  memcpy(prefix, kPrefix, sizeof(kPrefix));
-  ret = tar_extract_all(tar, prefix);
-  if (ret) {
-    printf("tar extract failed: %s\n", strerror(errno));
-    tar_close(tar);
-    return 1;
-  }
-  ret = tar_close(tar);
-  if (ret) {
-    printf("tar close failed\n");
-    return 1;
-  }
+  // Fonts and their fontconfig setup aren't needed to show the UI or
+  // most PDFs, so they're only loaded when something needs them.
+  pdfsketch::FontManager::Get()->SetFontLoader(LoadSystemFiles);
   return 0;
 }
 
-void PDFSketchInstance::SetPDF(const char* doc, size_t doc_len) {
-  pdfsketch::FileIO::OpenPDF(doc, doc_len, &document_view_);
+void PDFSketchInstance::SetPDF(const pdfsketch::ByteBuffer& doc) {
+  pdfsketch::FileIO::OpenPDF(doc, &document_view_);
+  delta_saves_ = -1;
 }
 
 void PDFSketchInstance::SetSize(const pp::Size& size, float scale) {
+  frame_buffers_.SetSize(pp::Size(size.width() * scale,
+                                  size.height() * scale));
   scroll_view_.SetScale(scale_);
   root_view_.Resize(pdfsketch::Size(size_.width() * scale_,
                                     size_.height() * scale_));
@@ -157,9 +244,10 @@ PDFSketchInstance::PDFSketchInstance(PP_Instance instance)
       scale_(1.0),
       render_thread_(this),
       setup_(false),
-      image_data_(NULL),
-      surface_(NULL),
-      cr_(NULL) {
+      frame_buffers_(this),
+      frame_buffer_(NULL),
+      delta_saves_(-1),
+      next_save_id_(1) {
 }
 
 bool PDFSketchInstance::ListAndRemove(const char* dir) {
@@ -264,6 +352,9 @@ bool PDFSketchInstance::Init(uint32_t argc,
   root_view_.AddSubview(&scroll_view_);
   document_view_.SetToolbox(&toolbox_);
   document_view_.SetUndoManager(&undo_manager_);
+  document_view_.SetRenderThreadRunner([this] (std::function<void ()> func) {
+      RunOnRenderThread(func);
+    });
   scroll_view_.SetDocumentView(&document_view_);
   scroll_view_.SetResizeParams(true, false, true, false);
   scroll_view_.SetFrame(root_view_.Frame());
@@ -316,20 +407,14 @@ void PDFSketchInstance::Paint(int32_t result,
   }
 }
 
-void PDFSketchInstance::SendPDFOut(const vector<char>& out) {
-  pp::VarArrayBuffer out_var(out.size());
-  char* out_var_buf = (char*)out_var.Map();
-  memcpy(out_var_buf, &out[0], out.size());
-  out_var.Unmap();
-  PostMessage(out_var);
-}
-
 void PDFSketchInstance::SetPDF(const pp::Var& doc) {
   pp::VarArrayBuffer vab(doc);
-  void* buf = vab.Map();
+  const char* buf = static_cast<const char*>(vab.Map());
   size_t length = vab.ByteLength();
-  SetPDF(reinterpret_cast<char*>(buf), length);
-  vab.Unmap();
+  // The document refers to the mapped bytes directly. Unmap them once
+  // it's done with them.
+  SetPDF(pdfsketch::ByteBuffer::Wrap(buf, length,
+                                     [vab] () mutable { vab.Unmap(); }));
 }
 
 void PDFSketchInstance::InsertImage(const pp::Var& img) {
@@ -423,9 +508,54 @@ void PDFSketchInstance::HandleMessage(const pp::Var& var_message) {
         root_view_.OnPaste(contents);
       });
   }
+  if (message == "paintStats") {
+    RunOnRenderThread([this] () {
+        const pdfsketch::RootView::PaintStats& stats =
+            root_view_.paint_stats();
+        char buf[200];
+        snprintf(buf, sizeof(buf),
+                 "paintStats:{\"frames\":%llu,\"lastFramePixels\":%llu,"
+                 "\"totalPixels\":%llu}",
+                 static_cast<unsigned long long>(stats.frames),
+                 static_cast<unsigned long long>(stats.last_frame_pixels),
+                 static_cast<unsigned long long>(stats.total_pixels));
+        PostMessage(pp::Var(buf));
+      });
+    return;
+  }
+  if (message == "dumpTrace") {
+    RunOnRenderThread([this] () {
+        string json;
+        if (!pdfsketch::TraceToJSON(&json)) {
+          PostMessage(pp::Var("trace:unavailable"));
+          return;
+        }
+        PostMessage(pp::Var("trace:" + json));
+      });
+    return;
+  }
   if (message == "save") {
     RunOnRenderThread([this] () {
-        SaveFile();
+        SaveFile(false);
+      });
+    return;
+  }
+  const char kSaveWrittenPrefix[] = "saveWritten:";
+  if (!strncmp(message.c_str(),
+               kSaveWrittenPrefix,
+               sizeof(kSaveWrittenPrefix) - 1)) {
+    char* end = NULL;
+    int id = strtol(message.c_str() + sizeof(kSaveWrittenPrefix) - 1, &end,
+                    10);
+    bool ok = !strcmp(end, ":ok");
+    RunOnRenderThread([this, id, ok] () {
+        SaveWritten(id, ok);
+      });
+    return;
+  }
+  if (message == "saveDelta") {
+    RunOnRenderThread([this] () {
+        SaveFile(true);
       });
     return;
   }
@@ -435,6 +565,10 @@ void PDFSketchInstance::HandleMessage(const pp::Var& var_message) {
       });
     return;
   }
+  if (message == "cancel") {
+    jobs_.Cancel();
+    return;
+  }
   if (message == "undo") {
     RunOnRenderThread([this] () {
         undo_manager_.PerformUndo();
@@ -449,41 +583,28 @@ void PDFSketchInstance::HandleMessage(const pp::Var& var_message) {
   }
 }
 
-cairo_t* PDFSketchInstance::AllocateCairo() {
-  if (size_.width() == 0 || size_.height() == 0)
-    return NULL;
-  if (cr_) {
+cairo_t* PDFSketchInstance::AllocateCairo(vector<pdfsketch::Rect>* stale) {
+  if (frame_buffer_) {
     printf("Already have Cairo!\n");
     return NULL;
   }
-  if (image_data_) {
-    printf("Bug: image_data_ already allocated\n");
+  frame_buffer_ = frame_buffers_.Acquire(stale);
+  if (!frame_buffer_)
     return NULL;
-  }
-  image_data_ = new pp::ImageData(this,
-                                  PP_IMAGEDATAFORMAT_BGRA_PREMUL,
-                                  pp::Size(size_.width() * scale_,
-                                           size_.height() * scale_),
-                                  true);
-  surface_ =
-      cairo_image_surface_create_for_data((unsigned char*)image_data_->data(),
-                                          CAIRO_FORMAT_ARGB32,
-                                          size_.width() * scale_,
-                                          size_.height() * scale_,
-                                          image_data_->stride());
-  cr_ = cairo_create(surface_);
-  return cr_;
+  return frame_buffer_->cr;
 }
 
 bool PDFSketchInstance::FlushCairo(
+    const vector<pdfsketch::Rect>& damage,
     std::function<void(int32_t)> complete_callback) {
-  cairo_destroy(cr_);
-  cr_ = NULL;
-  cairo_surface_finish(surface_);
-  cairo_surface_destroy(surface_);
-  surface_ = NULL;
-
-  graphics_.PaintImageData(*image_data_, pp::Point());
+  frame_buffers_.Present(frame_buffer_, damage);
+  for (const pdfsketch::Rect& rect : damage) {
+    pdfsketch::Rect src = rect.RoundedOut();
+    graphics_.PaintImageData(frame_buffer_->image_data, pp::Point(),
+                             pp::Rect(src.Left(), src.Top(),
+                                      src.size_.width_, src.size_.height_));
+  }
+  frame_buffer_ = NULL;
   std::function<void(int32_t)> render_callback =
       [this, complete_callback] (int32_t result) {
     RunOnRenderThread([complete_callback, result] () {
@@ -493,8 +614,6 @@ bool PDFSketchInstance::FlushCairo(
   std::function<void(int32_t)>* callback_pointer =
       new std::function<void(int32_t)>(render_callback);
   int32_t rc = graphics_.Flush(pp::CompletionCallback(FlushCompletionCallback, callback_pointer));
-  delete image_data_;
-  image_data_ = NULL;
   if (rc != PP_OK_COMPLETIONPENDING) {
     printf("paint cairo bad return\n");
     delete callback_pointer;
@@ -511,40 +630,97 @@ void PDFSketchInstance::RequestPaste() {
   PostMessage(pp::Var("paste"));
 }
 
-void PDFSketchInstance::SaveFile() {
-  vector<char> out;
-  pdfsketch::FileIO::Save(document_view_, &out);
-  SendPDFOut(out);
+void PDFSketchInstance::SaveFile(bool incremental) {
+  // Another save could land in the file before the running one does
+  if (jobs_.busy()) {
+    PostMessage(pp::Var("jobDone:save:busy"));
+    return;
+  }
+  // After this many delta records, the next save writes a full
+  // snapshot again, so files (and load times) don't grow forever.
+  const int kMaxDeltaSaves = 32;
+  if (incremental && delta_saves_ >= 0 && delta_saves_ < kMaxDeltaSaves) {
+    // Small enough to write right here
+    ArrayBufferSink sink;
+    if (!pdfsketch::FileIO::SaveDelta(document_view_, &sink)) {
+      printf("delta save failed\n");
+      return;
+    }
+    int id = next_save_id_++;
+    pp::VarDictionary dict;
+    dict.Set(pp::Var("cmd"), pp::Var("appendSave"));
+    dict.Set(pp::Var("id"), pp::Var(id));
+    dict.Set(pp::Var("data"), sink.Finish());
+    PostMessage(dict);
+    document_view_.BeginSave(id);
+    delta_saves_++;
+    return;
+  }
+  auto snapshot = std::make_shared<pdfsketch::DocumentSnapshot>();
+  pdfsketch::FileIO::Snapshot(document_view_, snapshot.get());
+  // Changes from here on go in the next delta. If this save isn't
+  // stored, the next one is a full save again.
+  int id = next_save_id_++;
+  document_view_.BeginSave(id);
+  delta_saves_ = 0;
+  StartJob("save", [this, snapshot, id] (
+      const pdfsketch::ProgressFunction& progress) {
+      ArrayBufferSink sink;
+      if (!pdfsketch::FileIO::Save(*snapshot, progress, &sink)) {
+        RunOnRenderThread([this, id] () { SaveWritten(id, false); });
+        return false;
+      }
+      pp::VarDictionary dict;
+      dict.Set(pp::Var("cmd"), pp::Var("save"));
+      dict.Set(pp::Var("id"), pp::Var(id));
+      dict.Set(pp::Var("data"), sink.Finish());
+      PostMessage(dict);
+      return true;
+    });
+}
+
+void PDFSketchInstance::SaveWritten(int id, bool ok) {
+  document_view_.FinishSave(id, ok);
+  if (ok)
+    return;
+  printf("save %d wasn't stored\n", id);
+  // The file may now be missing this save, or have part of it, so
+  // appending to it would lose changes.
+  delta_saves_ = -1;
 }
 
 void PDFSketchInstance::ExportPDF() {
-  // Get flattened .pdf file
-  vector<char> pdf;
-  // Get native .pdfsketch file
-  document_view_.ExportPDF(&pdf);
-  vector<char> out;
-  pdfsketch::FileIO::Save(document_view_, &out);
-  // Insert .pdfsketch file into flattened .pdf
-
-  PoDoFo::PdfMemDocument doc;
-  doc.Load(&pdf[0], pdf.size());
-  PoDoFo::PdfFileSpec filespec(
-      "source.pdfsketch",
-      reinterpret_cast<const unsigned char*>(&out[0]),
-      out.size(), &doc);
-  out.clear();
-  doc.AttachFile(filespec);
-
-  PoDoFo::PdfRefCountedBuffer out_buf;
-  PoDoFo::PdfOutputDevice out_dev(&out_buf);
-  doc.Write(&out_dev);
-
-  pdf.clear();
-  pdf.insert(pdf.begin(),
-             out_buf.GetBuffer(),
-             out_buf.GetBuffer() + out_buf.GetSize());
-
-  SendPDFOut(pdf);
+  auto snapshot = std::make_shared<pdfsketch::DocumentSnapshot>();
+  pdfsketch::FileIO::Snapshot(document_view_, snapshot.get());
+  StartJob("export", [this, snapshot] (
+      const pdfsketch::ProgressFunction& progress) {
+      MessageChunkSink sink(this);
+      return pdfsketch::FileIO::ExportPDF(
+          *snapshot, pdfsketch::WorkerPool::DefaultNumThreads(), progress,
+          &sink) && sink.Flush();
+    });
+}
+
+void PDFSketchInstance::StartJob(
+    const string& name,
+    const std::function<bool (const pdfsketch::ProgressFunction&)>& job) {
+  bool started = jobs_.Start(
+      job,
+      [this, name] (uint64_t done, uint64_t total) {
+        char buf[80];
+        snprintf(buf, sizeof(buf), "progress:%s:%llu/%llu", name.c_str(),
+                 static_cast<unsigned long long>(done),
+                 static_cast<unsigned long long>(total));
+        PostMessage(pp::Var(buf));
+      },
+      [this, name] (bool ok, bool cancelled) {
+        const char* result = ok ? "ok" : (cancelled ? "cancelled" : "failed");
+        if (!ok)
+          printf("%s %s\n", name.c_str(), result);
+        PostMessage(pp::Var("jobDone:" + name + ":" + result));
+      });
+  if (!started)
+    PostMessage(pp::Var("jobDone:" + name + ":busy"));
 }
 
 class HelloTutorialModule : public pp::Module {
@@ -17,7 +17,10 @@
 #include <ppapi/cpp/size.h>
 #include <ppapi/utility/threading/simple_thread.h>
 
+#include "byte_buffer.h"
 #include "document_view.h"
+#include "frame_buffer_pool.h"
+#include "job_runner.h"
 #include "root_view.h"
 #include "scroll_view.h"
 #include "toolbox.h"
@@ -39,13 +42,23 @@ class PDFSketchInstance : public pp::Instance,
   void ExecOnRenderThread(std::function<void ()> func);
   void Exec(int32_t resize, std::function<void ()> func);
   void Paint(int32_t result, const pp::ImageData& data);
-  void SendPDFOut(const std::vector<char>& out);
   void PostMessageOut(int32_t result, const std::string& msg);
 
  private:
   void SetPDF(const pp::Var& doc);
-  void SaveFile();
+  // Posts either the whole file, or (if 'incremental' and there's a
+  // file from an earlier save to append to) just a delta record. Full
+  // saves run as a job. Each is tagged with an id, which JS sends back
+  // in "saveWritten:<id>:<ok|failed>" once it's stored it, or couldn't.
+  void SaveFile(bool incremental);
+  void SaveWritten(int id, bool ok);
   void ExportPDF();
+  // Runs 'job' on the job thread, posting "progress:<name>:done/total"
+  // as it goes and then "jobDone:<name>:<result>", where result is ok,
+  // failed, cancelled or (if another job is running) busy.
+  void StartJob(
+      const std::string& name,
+      const std::function<bool (const pdfsketch::ProgressFunction&)>& job);
   void InsertImage(const pp::Var& img);
   virtual bool HandleInputEvent(const pp::InputEvent& event);
   virtual void HandleMessage(const pp::Var& var_message);
@@ -57,15 +70,18 @@ class PDFSketchInstance : public pp::Instance,
   virtual void SetUndoEnabled(bool enabled);
   virtual void SetRedoEnabled(bool enabled);
   int SetupFS();
-  void SetPDF(const char* doc, size_t doc_len);
+  void SetPDF(const pdfsketch::ByteBuffer& doc);
   void SetSize(const pp::Size& size, float scale);
-  virtual cairo_t* AllocateCairo();
-  virtual bool FlushCairo(std::function<void(int32_t)> complete_callback);
+  virtual cairo_t* AllocateCairo(std::vector<pdfsketch::Rect>* stale);
+  virtual bool FlushCairo(const std::vector<pdfsketch::Rect>& damage,
+                          std::function<void(int32_t)> complete_callback);
   virtual void CopyToClipboard(const std::string& str);
   virtual void RequestPaste();
 
  public:
-  pp::CompletionCallbackFactory<PDFSketchInstance> callback_factory_;
+  // Thread safe, since tile rasterizer threads use RunOnRenderThread().
+  pp::CompletionCallbackFactory<PDFSketchInstance, pp::ThreadSafeThreadTraits>
+      callback_factory_;
   pp::Size size_;
   float scale_;
   pp::SimpleThread render_thread_;
@@ -78,7 +94,17 @@ class PDFSketchInstance : public pp::Instance,
   pdfsketch::Toolbox toolbox_;
   pdfsketch::UndoManager undo_manager_;
 
-  pp::ImageData* image_data_;
-  cairo_surface_t* surface_;
-  cairo_t* cr_;
+  // Reused between frames, so only damaged parts need to be redrawn
+  pdfsketch::FrameBufferPool frame_buffers_;
+  // Buffer being drawn into, between AllocateCairo() and FlushCairo()
+  pdfsketch::FrameBufferPool::FrameBuffer* frame_buffer_;
+
+  // Delta records appended since the last full save, or -1 if there
+  // hasn't been a full save of this document yet.
+  int delta_saves_;
+  int next_save_id_;
+
+  // Saves and exports. Last, so it's destroyed first, finishing any
+  // running job while the rest is still around.
+  pdfsketch::JobRunner jobs_;
 };
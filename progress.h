@@ -0,0 +1,18 @@
+// Copyright...
+
+#ifndef PDFSKETCH_PROGRESS_H__
+#define PDFSKETCH_PROGRESS_H__
+
+#include <functional>
+#include <stdint.h>
+
+namespace pdfsketch {
+
+// Told how far a long operation (save, export) has got, in units of the
+// operation's choosing. Returning false asks the operation to stop, in
+// which case it fails. An empty function means nobody's listening.
+typedef std::function<bool (uint64_t done, uint64_t total)> ProgressFunction;
+
+}  // namespace pdfsketch
+
+#endif  // PDFSKETCH_PROGRESS_H__
@@ -2,6 +2,8 @@
 
 #include "rectangle.h"
 
+#include "trace.h"
+
 namespace pdfsketch {
 
 Rectangle::~Rectangle() {
@@ -13,6 +15,7 @@ void Rectangle::Serialize(pdfsketchproto::Graphic* out) const {
 }
 
 void Rectangle::Draw(cairo_t* cr, bool selected) {
+  TRACE_EVENT("Rectangle::Draw");
   frame_.CairoRectangle(cr);
   fill_color_.CairoSetSourceRGBA(cr);
   cairo_fill_preserve(cr);
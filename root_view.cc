@@ -4,6 +4,7 @@
 #include <stdio.h>
 
 #include "root_view.h"
+#include "trace.h"
 
 namespace pdfsketch {
 
@@ -18,6 +19,10 @@ void RootView::SetNeedsDisplayInRect(const Rect& rect) {
     printf("%s: can't draw, no delegate\n", __func__);
     return;
   }
+  Rect damage = rect.Intersect(Bounds());
+  if (damage.Empty())
+    return;
+  damage_.Add(damage);
   if (!draw_requested_ && !flush_in_progress_) {
     pp::MessageLoop::GetCurrent().PostWork(
         callback_factory_.NewCallback(&RootView::HandleDrawRequest));
@@ -26,12 +31,45 @@ void RootView::SetNeedsDisplayInRect(const Rect& rect) {
 }
 
 void RootView::HandleDrawRequest(int32_t result) {
+  TRACE_EVENT("RootView::HandleDrawRequest");
+  if (flush_in_progress_) {
+    // A view asked for display while drawing the frame that's now being
+    // flushed. FlushComplete() will draw again.
+    draw_requested_ = true;
+    return;
+  }
   draw_requested_ = false;
-  cairo_t* cr = delegate_->AllocateCairo();
+  if (damage_.empty())
+    return;
+  std::vector<Rect> stale;
+  cairo_t* cr = delegate_->AllocateCairo(&stale);
   if (!cr)
     return;
-  DrawRect(cr, Bounds());
-  if (delegate_->FlushCairo([this] (int32_t result) { FlushComplete(); }))
+  for (const Rect& rect : stale)
+    damage_.Add(rect);
+  // Views may ask for display while drawing; that goes into the next
+  // frame.
+  std::vector<Rect> damage = damage_.rects();
+  damage_.Clear();
+  uint64_t pixels = 0;
+  for (const Rect& rect : damage) {
+    cairo_save(cr);
+    rect.CairoRectangle(cr);
+    cairo_clip(cr);
+    // Frame buffers keep old frames, so clear what's under this rect
+    // before drawing.
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+    DrawRect(cr, rect);
+    cairo_restore(cr);
+    pixels += static_cast<uint64_t>(rect.Area());
+  }
+  paint_stats_.frames++;
+  paint_stats_.last_frame_pixels = pixels;
+  paint_stats_.total_pixels += pixels;
+  if (delegate_->FlushCairo(damage,
+                            [this] (int32_t result) { FlushComplete(); }))
     flush_in_progress_ = true;
 }
 
@@ -7,20 +7,35 @@
 #include <ppapi/cpp/message_loop.h>
 #include <ppapi/cpp/input_event.h>
 
+#include "damage_region.h"
 #include "view.h"
 
 namespace pdfsketch {
 
 class RootViewDelegate {
  public:
-  virtual cairo_t* AllocateCairo() = 0;
-  virtual bool FlushCairo(std::function<void(int32_t)> complete_callback) = 0;
+  // Returns a context for drawing into a frame buffer, which keeps its
+  // contents between frames. Appends to 'stale' the rects that must be
+  // redrawn, besides the new damage, to bring that buffer up to date.
+  virtual cairo_t* AllocateCairo(std::vector<Rect>* stale) = 0;
+  // Pushes the parts of the frame buffer within 'damage' to the
+  // screen.
+  virtual bool FlushCairo(const std::vector<Rect>& damage,
+                          std::function<void(int32_t)> complete_callback) = 0;
   virtual void CopyToClipboard(const std::string& str) = 0;
   virtual void RequestPaste() = 0;
 };
 
+// RootView coordinates are device pixels.
+
 class RootView : public View {
  public:
+  struct PaintStats {
+    uint64_t frames{0};
+    uint64_t last_frame_pixels{0};
+    uint64_t total_pixels{0};
+  };
+
   RootView()
       : draw_requested_(false),
         flush_in_progress_(false),
@@ -37,11 +52,14 @@ class RootView : public View {
   void FlushComplete();
   void HandlePepperInputEvent(const pp::InputEvent& event,
                               float scale);
+  const PaintStats& paint_stats() const { return paint_stats_; }
 
  private:
   RootViewDelegate* delegate_;
   bool draw_requested_;
   bool flush_in_progress_;
+  DamageRegion damage_;
+  PaintStats paint_stats_;
   pp::CompletionCallbackFactory<RootView> callback_factory_;
   View* down_mouse_handler_;
 };
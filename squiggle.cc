@@ -3,18 +3,33 @@
 #include "squiggle.h"
 
 #include <algorithm>
+#include <cmath>
+#include <utility>
 
+#include "trace.h"
+
+using std::make_pair;
 using std::max;
 using std::min;
+using std::pair;
+using std::vector;
 
 namespace pdfsketch {
 
 Squiggle::Squiggle(const pdfsketchproto::Graphic& msg)
     : Graphic(msg),
       original_origin_(msg.squiggle().original_origin()) {
-  for (int i = 0; i < msg.squiggle().point_size(); i++) {
-    points_.push_back(Point(msg.squiggle().point(i)));
+  const pdfsketchproto::Squiggle& squiggle = msg.squiggle();
+  if (squiggle.packed_point_size() > 0) {
+    points_.assign(squiggle.packed_point().begin(),
+                   squiggle.packed_point().end());
+    if (points_.size() % 2)
+      points_.pop_back();
+    return;
   }
+  points_.reserve(squiggle.point_size() * 2);
+  for (int i = 0; i < squiggle.point_size(); i++)
+    AddPoint(Point(squiggle.point(i)));
 }
 
 void Squiggle::Serialize(pdfsketchproto::Graphic* out) const {
@@ -22,22 +37,40 @@ void Squiggle::Serialize(pdfsketchproto::Graphic* out) const {
   out->set_type(pdfsketchproto::Graphic::SQUIGGLE);
   pdfsketchproto::Squiggle* msg = out->mutable_squiggle();
   original_origin_.Serialize(msg->mutable_original_origin());
-  for (auto it = points_.begin(), e = points_.end(); it != e; ++it) {
-    it->Serialize(msg->add_point());
-  }
+  msg->mutable_packed_point()->Reserve(points_.size());
+  for (float coordinate : points_)
+    msg->add_packed_point(coordinate);
+}
+
+void Squiggle::AddPoint(const Point& point) {
+  points_.push_back(point.x_);
+  points_.push_back(point.y_);
 }
 
 void Squiggle::Place(int page, const Point& location) {
   page_ = page;
-  points_.push_back(location);
+  AddPoint(location);
   frame_ = Rect(location);
   original_origin_ = location;
+  InvalidatePath();
 }
 
 void Squiggle::PlaceUpdate(const Point& location) {
-  if (points_.back() == location)
+  size_t size = points_.size();
+  float x = location.x_;
+  float y = location.y_;
+  if (points_[size - 2] == x && points_[size - 1] == y)
     return;
-  points_.push_back(location);
+  // If the last point is within the tolerance of the one before, the
+  // stroke doesn't need it: move it along instead of adding another.
+  if (size >= 4 &&
+      hypot(points_[size - 2] - points_[size - 4],
+            points_[size - 1] - points_[size - 3]) < place_tolerance_) {
+    points_[size - 2] = x;
+    points_[size - 1] = y;
+  } else {
+    AddPoint(location);
+  }
   if (location.x_ < frame_.Left())
     frame_.SetLeftAbs(location.x_);
   if (location.x_ > frame_.Right())
@@ -48,48 +81,73 @@ void Squiggle::PlaceUpdate(const Point& location) {
     frame_.SetBottomAbs(location.y_);
   original_origin_ = frame_.origin_;
   natural_size_ = frame_.size_;
+  InvalidatePath();
   SetNeedsDisplay(false);
 }
 
 bool Squiggle::PlaceComplete() {
   if (frame_.size_ == Size())
     return true;  // empty, so delete
+  Simplify(place_tolerance_);
   return false;
+}
 
-  // Now that all points are placed, compute proper frame, and update
-  // points_
-  double left = frame_.origin_.x_;
-  double right = left;
-  double top = frame_.origin_.y_;
-  double bottom = top;
-  for (auto it = points_.begin(), e = points_.end(); it != e; ++it) {
-    left = min(left, it->x_ + frame_.Left());
-    right = max(right, it->x_ + frame_.Left());
-    top = min(top, it->y_ + frame_.Top());
-    bottom = max(bottom, it->y_ + frame_.Top());
+void Squiggle::Simplify(double tolerance) {
+  TRACE_EVENT("Squiggle::Simplify");
+  const size_t count = num_points();
+  if (count < 3)
+    return;
+  vector<bool> keep(count, false);
+  keep[0] = keep[count - 1] = true;
+  // Spans to simplify, by their first and last points, which are kept
+  vector<pair<size_t, size_t>> spans;
+  spans.push_back(make_pair(0, count - 1));
+  const double max_distance2 = tolerance * tolerance;
+  while (!spans.empty()) {
+    size_t first = spans.back().first;
+    size_t last = spans.back().second;
+    spans.pop_back();
+    double ax = points_[first * 2];
+    double ay = points_[first * 2 + 1];
+    double dx = points_[last * 2] - ax;
+    double dy = points_[last * 2 + 1] - ay;
+    double length2 = dx * dx + dy * dy;
+    // Find the point farthest from the segment first-last. Strokes can
+    // double back, so this is distance to the segment, not the line.
+    size_t farthest = 0;
+    double farthest_distance2 = max_distance2;
+    for (size_t i = first + 1; i < last; i++) {
+      double px = points_[i * 2] - ax;
+      double py = points_[i * 2 + 1] - ay;
+      double t = length2 > 0.0 ? (px * dx + py * dy) / length2 : 0.0;
+      t = max(0.0, min(1.0, t));
+      px -= t * dx;
+      py -= t * dy;
+      double distance2 = px * px + py * py;
+      if (distance2 > farthest_distance2) {
+        farthest = i;
+        farthest_distance2 = distance2;
+      }
+    }
+    if (!farthest)
+      continue;  // all within tolerance
+    keep[farthest] = true;
+    spans.push_back(make_pair(first, farthest));
+    spans.push_back(make_pair(farthest, last));
   }
-  Point old_origin = frame_.origin_;
-  frame_ = Rect(Point(left, top), Point(right, bottom));
-  if (frame_.size_ == Size())
-    return true;  // empty, so delete
-  Point delta = frame_.origin_.Subtract(old_origin);
-  for (auto it = points_.begin(), e = points_.end(); it != e; ++it) {
-    *it = it->Add(delta);
-  }  
-  natural_size_ = frame_.size_;
-
-  return false;
+  size_t out = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!keep[i])
+      continue;
+    points_[out++] = points_[i * 2];
+    points_[out++] = points_[i * 2 + 1];
+  }
+  points_.resize(out);
+  points_.shrink_to_fit();
+  InvalidatePath();
 }
 
-void Squiggle::Draw(cairo_t* cr, bool selected) {
-  if (points_.size() < 2)
-    return;
-  if (natural_size_.height_ <= 0.0 ||
-      natural_size_.width_ <= 0.0)
-    return;  // Avoid divide by 0 below
-  if (frame_.size_.width_ < 1.0e-7 ||
-      frame_.size_.height_ < 1.0e-7)
-    return;  // too skinny to draw
+void Squiggle::BuildPath(cairo_t* cr) const {
   cairo_save(cr);  // transform for h/v flip
   if (h_flip_) {
     cairo_translate(cr,
@@ -107,14 +165,27 @@ void Squiggle::Draw(cairo_t* cr, bool selected) {
   cairo_scale(cr, frame_.size_.width_ / natural_size_.width_,
               frame_.size_.height_ / natural_size_.height_);
   cairo_translate(cr, -original_origin_.x_, -original_origin_.y_);
-  points_.begin()->CairoMoveTo(cr);
-  for (auto it = ++(points_.begin()), e = points_.end(); it != e; ++it)
-    it->CairoLineTo(cr);
+  cairo_move_to(cr, points_[0], points_[1]);
+  for (size_t i = 2; i < points_.size(); i += 2)
+    cairo_line_to(cr, points_[i], points_[i + 1]);
   cairo_restore(cr);
+  cairo_restore(cr);  // h/v flip
+}
+
+void Squiggle::Draw(cairo_t* cr, bool selected) {
+  TRACE_EVENT("Squiggle::Draw");
+  if (num_points() < 2)
+    return;
+  if (natural_size_.height_ <= 0.0 ||
+      natural_size_.width_ <= 0.0)
+    return;  // Avoid divide by 0 in BuildPath()
+  if (frame_.size_.width_ < 1.0e-7 ||
+      frame_.size_.height_ < 1.0e-7)
+    return;  // too skinny to draw
+  AppendCachedPath(cr);
   stroke_color_.CairoSetSourceRGBA(cr);
   cairo_set_line_width(cr, line_width_);
   cairo_stroke(cr);
-  cairo_restore(cr);  // h/v flip
 }
 
 }  // namespace pdfsketch
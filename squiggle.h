@@ -16,9 +16,22 @@ class Squiggle : public Graphic {
   virtual void PlaceUpdate(const Point& location);
   virtual bool PlaceComplete();
   virtual void Draw(cairo_t* cr, bool selected);
+  // Short strokes are as quick to draw as to blit.
+  virtual bool WantsRasterCache() const { return num_points() > 64; }
+
+ protected:
+  virtual void BuildPath(cairo_t* cr) const;
 
  private:
-  std::vector<Point> points_;
+  size_t num_points() const { return points_.size() / 2; }
+  void AddPoint(const Point& point);
+  // Drops points that are within 'tolerance' of the stroke through the
+  // points around them (Ramer-Douglas-Peucker).
+  void Simplify(double tolerance);
+
+  // x, y pairs. Floats are plenty for page coordinates, and pack into
+  // the saved file as they are.
+  std::vector<float> points_;
 
   // original_origin_ combined with natural_size_ form a rectangle
   // that represents where the original points came down. These points
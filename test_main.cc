@@ -1,68 +1,819 @@
 // Copyright...
 
-#include <fcntl.h>
+// Headless benchmark harness. Runs named scenarios against a corpus of
+// PDF and .pdfsketch files and writes the results as JSON, so that
+// runs can be compared between releases.
+//
+// Usage: test [--scenarios=a,b,...] [--out=results.json]
+//             [--trace=trace.json]
+//             [--width=W] [--height=H] [--graphics=N] [--chars=N]
+//             [--threads=N] [--assets=DIR]
+//             FILE_OR_DIR...
+//
+// Each result reports wall time, per-frame time percentiles (for
+// scenarios that draw), peak RSS during the scenario and the number
+// of heap allocations made during the scenario.
+//
+// cold_start is only cold the first time in a process (fonts stay
+// loaded, and fontconfig only reads its setup once), so run it on its own
+// with a single file. Results say whether fonts had been loaded by the
+// end of the scenario, since most PDFs embed theirs and show without.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <dirent.h>
+#include <errno.h>
+#include <ftw.h>
+#include <functional>
+#include <math.h>
+#include <mutex>
+#include <new>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <vector>
 
-#include "scroll_view.h"
+#include <google/protobuf/text_format.h>
+
+#include "asset_archive.h"
+#include "byte_buffer.h"
+#include "byte_sink.h"
+#include "damage_region.h"
+#include "document.pb.h"
 #include "document_view.h"
 #include "file_io.h"
+#include "font_manager.h"
+#include "graphic_factory.h"
+#include "scroll_view.h"
+#include "toolbox.h"
+#include "trace.h"
+#include "undo_manager.h"
+#include "worker_pool.h"
 
+using std::string;
 using std::vector;
 
+namespace {
+std::atomic<uint64_t> g_allocations(0);
+
+void* CountedAlloc(size_t size) {
+  g_allocations++;
+  void* ret = malloc(size ? size : 1);
+  if (!ret)
+    throw std::bad_alloc();
+  return ret;
+}
+}  // namespace {}
+
+void* operator new(size_t size) { return CountedAlloc(size); }
+void* operator new[](size_t size) { return CountedAlloc(size); }
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+
 namespace pdfsketch {
 
-void Test(const char* data, size_t length) {
-  size_t width = 512;
-  size_t height = 512;
-  ScrollView scroll;
-  DocumentView doc;
-  FileIO::Open(data, length, &doc);
-  scroll.SetDocumentView(&doc);
-  scroll.SetResizeParams(true, false, true, false);
-  scroll.SetFrame(Rect(0.0, 0.0, width + 0.0, height + 0.0));
+// Color for new graphics; the app defines and updates this in
+// pdfsketch.cc.
+Color* create_color_ = new Color(0.0, 0.0, 0.0, 1.0);
+
+namespace {
+typedef std::chrono::steady_clock Clock;
+
+double MillisecondsSince(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+      Clock::now() - start).count();
+}
+
+// Starts PeakRSSKB() over from the current RSS. Linux only; elsewhere
+// the peak is the process' so far.
+void ResetPeakRSS() {
+  FILE* file = fopen("/proc/self/clear_refs", "w");
+  if (!file)
+    return;
+  fputs("5", file);
+  fclose(file);
+}
+
+// Peak resident set size since ResetPeakRSS(), in KB
+long PeakRSSKB() {
+  FILE* file = fopen("/proc/self/status", "r");
+  if (file) {
+    char line[256];
+    long ret = -1;
+    while (fgets(line, sizeof(line), file)) {
+      if (sscanf(line, "VmHWM: %ld kB", &ret) == 1)
+        break;
+    }
+    fclose(file);
+    if (ret >= 0)
+      return ret;
+  }
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) < 0)
+    return -1;
+  return usage.ru_maxrss;
+}
+
+double Percentile(vector<double> samples, double fraction) {
+  if (samples.empty())
+    return 0.0;
+  std::sort(samples.begin(), samples.end());
+  size_t index = static_cast<size_t>(fraction * (samples.size() - 1) + 0.5);
+  return samples[index];
+}
+
+bool HasSuffix(const string& str, const string& suffix) {
+  return str.size() >= suffix.size() &&
+      !str.compare(str.size() - suffix.size(), suffix.size(), suffix);
+}
+
+// Expands directories to the .pdf/.pdfsketch files in them.
+void AddCorpusPath(const string& path, vector<string>* out) {
+  struct stat stbuf;
+  if (stat(path.c_str(), &stbuf) < 0) {
+    printf("can't stat %s\n", path.c_str());
+    return;
+  }
+  if (!S_ISDIR(stbuf.st_mode)) {
+    out->push_back(path);
+    return;
+  }
+  DIR* dirp = opendir(path.c_str());
+  if (!dirp)
+    return;
+  vector<string> names;
+  while (struct dirent* entry = readdir(dirp)) {
+    string name = entry->d_name;
+    if (HasSuffix(name, ".pdf") || HasSuffix(name, ".pdfsketch"))
+      names.push_back(path + "/" + name);
+  }
+  closedir(dirp);
+  std::sort(names.begin(), names.end());
+  out->insert(out->end(), names.begin(), names.end());
+}
+
+string JSONEscape(const string& str) {
+  string ret;
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      ret += '\\';
+      ret += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      ret += buf;
+    } else {
+      ret += c;
+    }
+  }
+  return ret;
+}
+
+// Stands in for RootView: collects damage instead of posting draws to
+// a Pepper message loop.
+class HeadlessRootView : public View {
+ public:
+  virtual std::string Name() const { return "HeadlessRootView"; }
+  virtual void SetNeedsDisplayInRect(const Rect& rect) {
+    damage_.Add(rect.Intersect(Bounds()));
+  }
+  DamageRegion* damage() { return &damage_; }
+
+ private:
+  DamageRegion damage_;
+};
+
+struct Options {
+  int width{1024};
+  int height{768};
+  int graphics{200};  // for drag_move
+  int chars{2000};  // for text_typing*
+  int threads{WorkerPool::DefaultNumThreads()};  // for export
+  // Directory with system.tar and system.idx, for cold_start
+  string assets;
+};
+
+struct Result {
+  string file;
+  string scenario;
+  double wall_ms{0.0};
+  vector<double> frame_ms;
+  long peak_rss_kb{0};
+  uint64_t allocations{0};
+  uint64_t pixels{0};
+  bool fonts_loaded{false};
+};
+
+// One document, as the app would show it: a scroll view in a root
+// view, drawn into an offscreen surface.
+class Session {
+ public:
+  Session(const Options& options, const ByteBuffer& data)
+      : options_(options), data_(data) {
+    undo_manager_.reset(new UndoManager);
+    doc_.SetToolbox(&toolbox_);
+    doc_.SetUndoManager(undo_manager_.get());
+    root_.SetSize(Size(options.width, options.height));
+    root_.AddSubview(&scroll_);
+    scroll_.SetDocumentView(&doc_);
+    scroll_.SetResizeParams(true, false, true, false);
+    scroll_.SetFrame(root_.Bounds());
+    // Like the app, render tiles in the background and accept them on
+    // this thread, between frames.
+    doc_.SetRenderThreadRunner([this] (std::function<void ()> func) {
+        std::lock_guard<std::mutex> guard(queue_lock_);
+        queue_.push_back(func);
+        queue_cond_.notify_one();
+      });
+    surface_ = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                          options.width, options.height);
+    cr_ = cairo_create(surface_);
+  }
+  ~Session() {
+    cairo_destroy(cr_);
+    cairo_surface_destroy(surface_);
+  }
+
+  void Open() {
+    FileIO::OpenPDF(data_, &doc_);
+  }
+
+  // Draws the damaged part of the view, if any. Returns false if
+  // there was nothing to draw.
+  bool DrawFrame(Result* result) {
+    RunQueued();
+    DamageRegion* damage = root_.damage();
+    if (damage->empty())
+      return false;
+    Clock::time_point start = Clock::now();
+    vector<Rect> rects = damage->rects();
+    damage->Clear();
+    for (const Rect& rect : rects) {
+      cairo_save(cr_);
+      rect.CairoRectangle(cr_);
+      cairo_clip(cr_);
+      cairo_set_source_rgb(cr_, 0.8, 0.8, 0.8);
+      cairo_paint(cr_);
+      root_.DrawRect(cr_, rect);
+      cairo_restore(cr_);
+      result->pixels += static_cast<uint64_t>(rect.Area());
+    }
+    cairo_surface_flush(surface_);
+    result->frame_ms.push_back(MillisecondsSince(start));
+    return true;
+  }
+  // Draws until nothing is left to draw and the rasterizer has
+  // delivered every tile requested.
+  void DrawUntilIdle(Result* result) {
+    for (int i = 0; i < kMaxFramesUntilIdle; i++) {
+      if (DrawFrame(result))
+        continue;
+      if (!doc_.TilesOutstanding())
+        return;
+      std::unique_lock<std::mutex> lock(queue_lock_);
+      if (!queue_cond_.wait_for(lock, std::chrono::seconds(kMaxTileWaitSec),
+                                [this] { return !queue_.empty(); })) {
+        printf("gave up waiting for tiles\n");
+        return;
+      }
+    }
+  }
+
+  const Options& options() const { return options_; }
+  DocumentView* doc() { return &doc_; }
+  ScrollView* scroll() { return &scroll_; }
+  Toolbox* toolbox() { return &toolbox_; }
+
+ private:
+  static const int kMaxFramesUntilIdle = 1000;
+  static const int kMaxTileWaitSec = 30;
+
+  // Runs the functions passed to the render thread runner so far
+  void RunQueued() {
+    std::deque<std::function<void ()>> queue;
+    {
+      std::lock_guard<std::mutex> guard(queue_lock_);
+      queue.swap(queue_);
+    }
+    for (auto& func : queue)
+      func();
+  }
+
+  const Options& options_;
+  ByteBuffer data_;
+  Toolbox toolbox_;
+  std::unique_ptr<UndoManager> undo_manager_;
+  // Declared before doc_, whose rasterizer threads add to them until
+  // it's destroyed.
+  std::mutex queue_lock_;
+  std::condition_variable queue_cond_;
+  std::deque<std::function<void ()>> queue_;
+  HeadlessRootView root_;
+  ScrollView scroll_;
+  DocumentView doc_;
+  cairo_surface_t* surface_;
+  cairo_t* cr_;
+};
+
+MouseInputEvent MouseEvent(const Point& position,
+                           MouseInputEvent::Type type) {
+  return MouseInputEvent(position, type, 1, 0);
+}
+
+// Scenarios. Each runs on a fresh Session; setup that isn't being
+// measured happens before Run() starts the clock.
+
+struct Scenario {
+  const char* name;
+  // Untimed setup
+  std::function<void (Session*, Result*)> setup;
+  // Timed part
+  std::function<void (Session*, const Options&, Result*)> run;
+};
+
+void OpenAndPaint(Session* session, Result* result) {
+  session->Open();
+  session->DrawUntilIdle(result);
+  result->frame_ms.clear();
+  result->pixels = 0;
+}
+
+void RunScrollSweep(Session* session, const Options& options,
+                    Result* result) {
+  const int kMaxSteps = 400;
+  double step = options.height / 4.0;
+  double doc_height = session->doc()->size().height_;
+  for (int i = 0; i < kMaxSteps && i * step < doc_height; i++) {
+    session->scroll()->OnScrollEvent(ScrollInputEvent(0.0, -step));
+    session->DrawFrame(result);
+  }
+  session->DrawUntilIdle(result);
+}
+
+void RunZoomChange(Session* session, const Options& options,
+                   Result* result) {
+  const double kZooms[] = { 0.5, 1.0, 1.5, 2.0, 3.0, 1.0 };
+  for (double zoom : kZooms) {
+    session->doc()->SetZoom(zoom);
+    session->DrawUntilIdle(result);
+  }
+}
+
+void SetUpDrag(Session* session, Result* result) {
+  OpenAndPaint(session, result);
+}
+
+// Pastes a grid of rectangles onto the visible page. Pasting selects
+// them all.
+void PasteRectangles(DocumentView* doc, int count) {
+  pdfsketchproto::Document msg;
+  for (int i = 0; i < count; i++) {
+    pdfsketchproto::Graphic* gr = msg.add_graphic();
+    Rect frame(40.0 + (i % 20) * 25.0, 40.0 + (i / 20) * 25.0, 20.0, 20.0);
+    frame.Serialize(gr->mutable_frame());
+    gr->set_page(0);
+    Color(0.0, 0.0, 0.0, 0.0).Serialize(gr->mutable_fill_color());
+    Color(0.0, 0.0, 1.0, 1.0).Serialize(gr->mutable_stroke_color());
+    gr->set_line_width(1.0);
+    gr->set_h_flip(false);
+    gr->set_v_flip(false);
+    gr->set_type(pdfsketchproto::Graphic::RECTANGLE);
+  }
+  string text;
+  google::protobuf::TextFormat::PrintToString(msg, &text);
+  doc->OnPaste(text);
+}
+
+void RunDragMove(Session* session, const Options& options,
+                 Result* result) {
+  DocumentView* doc = session->doc();
+  PasteRectangles(doc, options.graphics);
+  session->DrawUntilIdle(result);
+
+  // Grab the first one (pasting offsets by 10,10) and drag it around.
+  // The view is still scrolled to the top, so page 0 is on screen.
+  Point grab = doc->ConvertPointFromGraphic(0, Point(55.0, 55.0));
+  session->toolbox()->SelectTool(Toolbox::ARROW);
+  doc->OnMouseDown(MouseEvent(grab, MouseInputEvent::DOWN));
+  const int kDragEvents = 120;
+  for (int i = 1; i <= kDragEvents; i++) {
+    Point pos = grab.TranslatedBy(i * 2.0, i * 1.0);
+    doc->OnMouseDrag(MouseEvent(pos, MouseInputEvent::DRAG));
+    session->DrawFrame(result);
+  }
+  doc->OnMouseUp(MouseEvent(grab.TranslatedBy(kDragEvents * 2.0,
+                                              kDragEvents * 1.0),
+                            MouseInputEvent::UP));
+  session->DrawUntilIdle(result);
+}
+
+void RunTextTyping(Session* session, const Options& options,
+                   Result* result) {
+  DocumentView* doc = session->doc();
+  Point where = doc->ConvertPointFromGraphic(0, Point(72.0, 72.0));
+  session->toolbox()->SelectTool(Toolbox::TEXT);
+  doc->OnMouseDown(MouseEvent(where, MouseInputEvent::DOWN));
+  doc->OnMouseUp(MouseEvent(where, MouseInputEvent::UP));
+  session->DrawUntilIdle(result);
+  const char kText[] = "The quick brown fox jumps over the lazy dog. ";
+  for (int i = 0; i < options.chars; i++) {
+    string ch(1, kText[i % (sizeof(kText) - 1)]);
+    doc->OnKeyText(KeyboardInputEvent(KeyboardInputEvent::TEXT, ch, 0));
+    session->DrawFrame(result);
+  }
+  session->DrawUntilIdle(result);
+}
 
-  // Render a bunch of times
-  for (size_t i = 0; i < 1000; i++) {
-    unsigned char dummy[width * height * 4];
-    cairo_surface_t* surface =
-        cairo_image_surface_create_for_data(dummy,
-                                            CAIRO_FORMAT_ARGB32,
-                                            width, height,
-                                            width * 4);
-    cairo_t* cr = cairo_create(surface);
+// Types --chars characters into the middle of a text box that already
+// holds about 50KB, so per-keystroke layout cost shows up.
+void RunTextTypingLarge(Session* session, const Options& options,
+                        Result* result) {
+  const size_t kTextSize = 50 * 1024;
+  DocumentView* doc = session->doc();
+  Point where = doc->ConvertPointFromGraphic(0, Point(72.0, 72.0));
+  session->toolbox()->SelectTool(Toolbox::TEXT);
+  doc->OnMouseDown(MouseEvent(where, MouseInputEvent::DOWN));
+  doc->OnMouseUp(MouseEvent(where, MouseInputEvent::UP));
+  const char kText[] = "The quick brown fox jumps over the lazy dog. ";
+  string text;
+  while (text.size() < kTextSize / 2)
+    text += kText;
+  text += "\n";
+  doc->OnPaste(text);
+  session->DrawUntilIdle(result);
+  // The cursor is at the end of the first half; the second half goes
+  // after it, and then the cursor goes back to the middle.
+  doc->OnPaste(text);
+  const int kLeftArrow = 37;
+  for (size_t i = 0; i < text.size(); i++)
+    doc->OnKeyDown(KeyboardInputEvent(KeyboardInputEvent::DOWN, kLeftArrow, 0));
+  session->DrawUntilIdle(result);
+  result->frame_ms.clear();
+  result->pixels = 0;
 
-    scroll.DrawRect(cr, scroll.Frame());
+  for (int i = 0; i < options.chars; i++) {
+    string ch(1, kText[i % (sizeof(kText) - 1)]);
+    doc->OnKeyText(KeyboardInputEvent(KeyboardInputEvent::TEXT, ch, 0));
+    session->DrawFrame(result);
+  }
+  session->DrawUntilIdle(result);
+}
 
-    cairo_destroy(cr);
-    cairo_surface_finish(surface);
-    cairo_surface_destroy(surface);
+// Saves to a temp file, fully or incrementally
+void SaveToTempFile(const DocumentView& doc, bool incremental) {
+  FILE* file = tmpfile();
+  if (!file) {
+    printf("can't make temp file\n");
+    return;
+  }
+  {
+    FdByteSink sink(fileno(file));
+    if (incremental)
+      FileIO::SaveDelta(doc, &sink);
+    else
+      FileIO::Save(doc, &sink);
   }
-  printf("done rendering\n");
+  fclose(file);
+}
+
+void RunSave(Session* session, const Options& options, Result* result) {
+  SaveToTempFile(*session->doc(), false);
+}
+
+// A document with --graphics graphics that was saved, and then had one
+// more added.
+void SetUpSaveDelta(Session* session, Result* result) {
+  OpenAndPaint(session, result);
+  PasteRectangles(session->doc(), session->options().graphics);
+  session->doc()->MarkSaved();
+  PasteRectangles(session->doc(), 1);
+}
+
+void RunSaveDelta(Session* session, const Options& options,
+                  Result* result) {
+  SaveToTempFile(*session->doc(), true);
+}
+
+// Puts a rectangle and a line of text on every page, so export has to
+// draw over all of them.
+void OpenAndAnnotatePages(Session* session, Result* result) {
+  OpenAndPaint(session, result);
+  DocumentView* doc = session->doc();
+  for (int page = 0; page < doc->page_count(); page++) {
+    pdfsketchproto::Graphic msg;
+    Rect(40.0, 40.0, 100.0, 60.0).Serialize(msg.mutable_frame());
+    msg.set_page(page);
+    Color(0.0, 0.0, 0.0, 0.0).Serialize(msg.mutable_fill_color());
+    Color(1.0, 0.0, 0.0, 1.0).Serialize(msg.mutable_stroke_color());
+    msg.set_line_width(2.0);
+    msg.set_h_flip(false);
+    msg.set_v_flip(false);
+    msg.set_type(pdfsketchproto::Graphic::RECTANGLE);
+    doc->AddGraphic(GraphicFactory::NewGraphic(msg));
+
+    Rect(40.0, 110.0, 200.0, 20.0).Serialize(msg.mutable_frame());
+    Color(0.0, 0.0, 0.0, 1.0).Serialize(msg.mutable_stroke_color());
+    msg.set_line_width(1.0);
+    msg.set_type(pdfsketchproto::Graphic::TEXT);
+    msg.mutable_text_area()->set_text("Exported text");
+    doc->AddGraphic(GraphicFactory::NewGraphic(msg));
+  }
+}
+
+// Puts a long squiggle and a few paragraphs of text on every page, so
+// scrolling has annotations to repaint.
+void OpenAndScribblePages(Session* session, Result* result) {
+  OpenAndPaint(session, result);
+  DocumentView* doc = session->doc();
+  const int kSquigglePoints = 2000;
+  const char kText[] = "The quick brown fox jumps over the lazy dog. ";
+  string text;
+  for (int paragraph = 0; paragraph < 4; paragraph++) {
+    for (int i = 0; i < 8; i++)
+      text += kText;
+    text += "\n";
+  }
+  for (int page = 0; page < doc->page_count(); page++) {
+    pdfsketchproto::Graphic msg;
+    Rect frame(40.0, 200.0, 300.0, 100.0);
+    frame.Serialize(msg.mutable_frame());
+    frame.size_.Serialize(msg.mutable_natural_size());
+    msg.set_page(page);
+    Color(0.0, 0.0, 0.0, 0.0).Serialize(msg.mutable_fill_color());
+    Color(0.0, 0.0, 1.0, 1.0).Serialize(msg.mutable_stroke_color());
+    msg.set_line_width(2.0);
+    msg.set_h_flip(false);
+    msg.set_v_flip(false);
+    msg.set_type(pdfsketchproto::Graphic::SQUIGGLE);
+    pdfsketchproto::Squiggle* squiggle = msg.mutable_squiggle();
+    frame.origin_.Serialize(squiggle->mutable_original_origin());
+    for (int i = 0; i < kSquigglePoints; i++) {
+      double t = static_cast<double>(i) / kSquigglePoints;
+      squiggle->add_packed_point(frame.Left() + t * frame.size_.width_);
+      squiggle->add_packed_point(
+          frame.Top() + frame.size_.height_ * (0.5 + 0.5 * sin(t * 80.0)));
+    }
+    doc->AddGraphic(GraphicFactory::NewGraphic(msg));
+
+    msg.Clear();
+    Rect(40.0, 320.0, 400.0, 20.0).Serialize(msg.mutable_frame());
+    msg.set_page(page);
+    Color(0.0, 0.0, 0.0, 0.0).Serialize(msg.mutable_fill_color());
+    Color(0.0, 0.0, 0.0, 1.0).Serialize(msg.mutable_stroke_color());
+    msg.set_line_width(1.0);
+    msg.set_h_flip(false);
+    msg.set_v_flip(false);
+    msg.set_type(pdfsketchproto::Graphic::TEXT);
+    msg.mutable_text_area()->set_text(text);
+    doc->AddGraphic(GraphicFactory::NewGraphic(msg));
+  }
+  session->DrawUntilIdle(result);
+  result->frame_ms.clear();
+  result->pixels = 0;
+}
+
+void RunExport(Session* session, const Options& options, Result* result) {
+  DocumentSnapshot snapshot;
+  FileIO::Snapshot(*session->doc(), &snapshot);
+  vector<char> out;
+  VectorByteSink sink(&out);
+  FileIO::ExportPDF(snapshot, options.threads, ProgressFunction(), &sink);
+}
+
+// Where cold_start unpacked the system files, removed at exit
+string* g_assets_dir = nullptr;
+
+int RemoveEntry(const char* path, const struct stat* stbuf, int type,
+                struct FTW* ftw) {
+  if (remove(path))
+    printf("can't remove %s: %s\n", path, strerror(errno));
+  return 0;
+}
+
+void RemoveAssetsDir() {
+  nftw(g_assets_dir->c_str(), RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// Startup to the first page on screen. With --assets, the system fonts
+// are loaded from the archive when first needed, as the app does:
+// fontconfig's files are copied out and the index is read. This can't
+// mount the archive, so the fonts are copied out too, and fontconfig is
+// pointed at the copy as its sysroot; that makes loading fonts slower
+// here than in the app.
+void RunColdStart(Session* session, const Options& options,
+                  Result* result) {
+  if (!options.assets.empty()) {
+    string dir = options.assets;
+    FontManager::Get()->SetFontLoader([dir] () {
+        static AssetArchive* archive = new AssetArchive;
+        char temp_dir[] = "/tmp/pdfsketch_assetsXXXXXX";
+        if (!archive->Open(dir + "/system.idx", dir + "/system.tar") ||
+            !mkdtemp(temp_dir))
+          return;
+        g_assets_dir = new string(temp_dir);
+        atexit(RemoveAssetsDir);
+        archive->Extract("etc", temp_dir);
+        archive->Extract("var/cache/fontconfig", temp_dir);
+        archive->Extract("usr/share/fonts", temp_dir);
+        // As the app sets them, but under the copy. Read when fontconfig
+        // first starts, which is after this.
+        setenv("FONTCONFIG_SYSROOT", temp_dir, 1);
+        setenv("FONTCONFIG_FILE", "/etc/fonts/fonts.conf", 1);
+        setenv("FONTCONFIG_PATH", "/etc/fonts", 1);
+      });
+  }
+  session->Open();
+  session->DrawUntilIdle(result);
+}
+
+const Scenario kScenarios[] = {
+  { "open",
+    nullptr,
+    [] (Session* session, const Options& options, Result* result) {
+      session->Open();
+    } },
+  { "first_paint",
+    nullptr,
+    [] (Session* session, const Options& options, Result* result) {
+      session->Open();
+      session->DrawUntilIdle(result);
+    } },
+  { "cold_start", nullptr, RunColdStart },
+  { "scroll_sweep", OpenAndPaint, RunScrollSweep },
+  { "scroll_annotated", OpenAndScribblePages, RunScrollSweep },
+  { "zoom_change", OpenAndPaint, RunZoomChange },
+  { "drag_move", SetUpDrag, RunDragMove },
+  { "text_typing", OpenAndPaint, RunTextTyping },
+  { "text_typing_50k", OpenAndPaint, RunTextTypingLarge },
+  { "save", OpenAndPaint, RunSave },
+  { "save_delta", SetUpSaveDelta, RunSaveDelta },
+  { "export", OpenAndAnnotatePages, RunExport },
+};
+
+Result RunScenario(const Scenario& scenario, const string& file,
+                   const ByteBuffer& data, const Options& options) {
+  Result result;
+  result.file = file;
+  result.scenario = scenario.name;
+  Session session(options, data);
+  if (scenario.setup)
+    scenario.setup(&session, &result);
+  uint64_t allocations = g_allocations;
+  ResetPeakRSS();
+  Clock::time_point start = Clock::now();
+  scenario.run(&session, options, &result);
+  result.wall_ms = MillisecondsSince(start);
+  result.allocations = g_allocations - allocations;
+  result.peak_rss_kb = PeakRSSKB();
+  result.fonts_loaded = FontManager::Get()->fonts_loaded();
+  return result;
+}
+
+void WriteResult(FILE* out, const Result& result, bool last) {
+  fprintf(out,
+          "  {\"file\": \"%s\", \"scenario\": \"%s\", \"wall_ms\": %.3f, "
+          "\"frames\": %zu, \"frame_p50_ms\": %.3f, \"frame_p99_ms\": %.3f, "
+          "\"pixels_painted\": %llu, \"peak_rss_kb\": %ld, "
+          "\"allocations\": %llu, \"fonts_loaded\": %s}%s\n",
+          JSONEscape(result.file).c_str(),
+          JSONEscape(result.scenario).c_str(),
+          result.wall_ms,
+          result.frame_ms.size(),
+          Percentile(result.frame_ms, 0.5),
+          Percentile(result.frame_ms, 0.99),
+          static_cast<unsigned long long>(result.pixels),
+          result.peak_rss_kb,
+          static_cast<unsigned long long>(result.allocations),
+          result.fonts_loaded ? "true" : "false",
+          last ? "" : ",");
+}
+
+bool ParseIntFlag(const char* arg, const char* name, int* out) {
+  size_t len = strlen(name);
+  if (strncmp(arg, name, len))
+    return false;
+  *out = atoi(arg + len);
+  return true;
+}
+
+void Usage(const char* argv0) {
+  printf("Usage: %s [--scenarios=a,b,...] [--out=results.json]\n"
+         "       [--trace=trace.json]\n"
+         "       [--width=W] [--height=H] [--graphics=N] [--chars=N]\n"
+         "       [--threads=N] [--assets=DIR]\n"
+         "       FILE_OR_DIR...\n"
+         "Scenarios:", argv0);
+  for (const Scenario& scenario : kScenarios)
+    printf(" %s", scenario.name);
+  printf("\n");
+}
+}  // namespace {}
+
+int BenchmarkMain(int argc, char** argv) {
+  Options options;
+  string out_path = "benchmark_results.json";
+  string trace_path;
+  vector<string> scenario_names;
+  vector<string> files;
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    const char kScenariosFlag[] = "--scenarios=";
+    const char kOutFlag[] = "--out=";
+    const char kTraceFlag[] = "--trace=";
+    const char kAssetsFlag[] = "--assets=";
+    if (!strncmp(arg, kScenariosFlag, sizeof(kScenariosFlag) - 1)) {
+      string list = arg + sizeof(kScenariosFlag) - 1;
+      size_t pos = 0;
+      while (pos <= list.size()) {
+        size_t comma = list.find(',', pos);
+        if (comma == string::npos)
+          comma = list.size();
+        if (comma > pos)
+          scenario_names.push_back(list.substr(pos, comma - pos));
+        pos = comma + 1;
+      }
+    } else if (!strncmp(arg, kOutFlag, sizeof(kOutFlag) - 1)) {
+      out_path = arg + sizeof(kOutFlag) - 1;
+    } else if (!strncmp(arg, kTraceFlag, sizeof(kTraceFlag) - 1)) {
+      trace_path = arg + sizeof(kTraceFlag) - 1;
+    } else if (!strncmp(arg, kAssetsFlag, sizeof(kAssetsFlag) - 1)) {
+      options.assets = arg + sizeof(kAssetsFlag) - 1;
+    } else if (ParseIntFlag(arg, "--width=", &options.width) ||
+               ParseIntFlag(arg, "--height=", &options.height) ||
+               ParseIntFlag(arg, "--graphics=", &options.graphics) ||
+               ParseIntFlag(arg, "--chars=", &options.chars) ||
+               ParseIntFlag(arg, "--threads=", &options.threads)) {
+      // handled
+    } else if (arg[0] == '-') {
+      Usage(argv[0]);
+      return 1;
+    } else {
+      AddCorpusPath(arg, &files);
+    }
+  }
+  if (files.empty()) {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  vector<const Scenario*> scenarios;
+  for (const Scenario& scenario : kScenarios) {
+    if (scenario_names.empty() ||
+        std::find(scenario_names.begin(), scenario_names.end(),
+                  scenario.name) != scenario_names.end())
+      scenarios.push_back(&scenario);
+  }
+
+  vector<Result> results;
+  for (const string& file : files) {
+    // Mapped, so that big files don't have to be read in up front
+    ByteBuffer data = ByteBuffer::MapFile(file);
+    if (data.empty())
+      continue;
+    for (const Scenario* scenario : scenarios) {
+      printf("running %s on %s\n", scenario->name, file.c_str());
+      results.push_back(RunScenario(*scenario, file, data, options));
+    }
+  }
+
+  FILE* out = out_path == "-" ? stdout : fopen(out_path.c_str(), "w");
+  if (!out) {
+    printf("can't open %s for writing\n", out_path.c_str());
+    return 1;
+  }
+  fprintf(out, "[\n");
+  for (size_t i = 0; i < results.size(); i++)
+    WriteResult(out, results[i], i + 1 == results.size());
+  fprintf(out, "]\n");
+  if (out != stdout)
+    fclose(out);
+  printf("wrote %zu results to %s\n", results.size(), out_path.c_str());
+
+  if (!trace_path.empty()) {
+    string json;
+    if (!TraceToJSON(&json)) {
+      printf("tracing isn't compiled in; rebuild with TRACING=1\n");
+      return 1;
+    }
+    FILE* trace = fopen(trace_path.c_str(), "w");
+    if (!trace) {
+      printf("can't open %s for writing\n", trace_path.c_str());
+      return 1;
+    }
+    fwrite(json.data(), 1, json.size(), trace);
+    fclose(trace);
+  }
+  return 0;
 }
 
 }  // namespace pdfsketch
 
 int main(int argc, char** argv) {
-  assert(argc >= 2);
-
-  printf("opening %s\n", argv[1]);
-  int fd = open(argv[1], O_RDONLY);
-  assert(fd >= 0);
-  vector<char> data;
-  while (true) {
-    char buf[1024 * 512];
-    int rc = read(fd, buf, sizeof(buf));
-    printf("read rc: %d\n", rc);
-    assert(rc >= 0);
-    data.insert(data.end(), buf, buf + rc);
-    if (rc < (int)sizeof(buf))
-      break;
-  }
-  close(fd);
-
-  printf("%zu - %x %x %x %x\n", data.size(), data[0], data[1], data[2], data[3]);
-
-  pdfsketch::Test(&data[0], data.size());
-  return 0;
+  return pdfsketch::BenchmarkMain(argc, argv);
 }
@@ -3,10 +3,14 @@
 #include "text_area.h"
 
 #include <algorithm>
+#include <cctype>
 #include <cmath>
 #include <cstring>
 #include <string>
 
+#include "font_manager.h"
+#include "trace.h"
+
 using std::string;
 using std::unique_ptr;
 using std::vector;
@@ -15,6 +19,19 @@ namespace pdfsketch {
 
 void Dbg(const char* str);
 
+namespace {
+// Bytes of multi-byte characters count as letters, so words in other
+// scripts are whole words too.
+bool IsWordByte(char c) {
+  return isalpha(static_cast<unsigned char>(c)) ||
+      (static_cast<unsigned char>(c) & 0x80);
+}
+
+// Shaped characters are looked up in chunks of about this many bytes as
+// layout gets to them.
+const size_t kShapeChunkSize = 256;
+}  // namespace {}
+
 void TextArea::Serialize(pdfsketchproto::Graphic* out) const {
   Graphic::Serialize(out);
   out->set_type(pdfsketchproto::Graphic::TEXT);
@@ -60,6 +77,7 @@ void TextArea::OnKeyText(const KeyboardInputEvent& event) {
   if (!strcmp(event.text().c_str(), "\r"))
     use = &newline;
   text_.insert(selection_start_, *use);
+  TextEdited(selection_start_, 0, use->size());
   selection_start_ += event.text().size();
   cursor_x_ = -1.0;
   SetNeedsDisplay(false);
@@ -138,24 +156,29 @@ void TextArea::OnKeyDown(const KeyboardInputEvent& event) {
       // do backspace
       if (selection_start_ == 0)
         return;
-      string trimmed = text_.substr(selection_start_ - 1, 1);
-      text_.erase(text_.begin() + selection_start_ - 1);
-      selection_start_--;
+      size_t start = PrevCharIndex(selection_start_);
+      size_t len = selection_start_ - start;
+      string trimmed = text_.substr(start, len);
+      text_.erase(start, len);
+      TextEdited(start, len, 0);
+      selection_start_ = start;
 
       unique_ptr<UndoOp> op(
           new TextAreaTransformUndoOp(this,
                                       selection_start_,
                                       0,
                                       trimmed,
-                                      selection_start_ + 1,
+                                      selection_start_ + len,
                                       0));
       undo_manager_->AddUndoOp(std::move(op));
     } else {
       // do delete
       if (selection_start_ >= text_.size())
         return;
-      string trimmed = text_.substr(selection_start_, 1);
-      text_.erase(text_.begin() + selection_start_);
+      size_t len = NextCharIndex(selection_start_) - selection_start_;
+      string trimmed = text_.substr(selection_start_, len);
+      text_.erase(selection_start_, len);
+      TextEdited(selection_start_, len, 0);
 
       unique_ptr<UndoOp> op(
           new TextAreaTransformUndoOp(this,
@@ -170,6 +193,7 @@ void TextArea::OnKeyDown(const KeyboardInputEvent& event) {
   if (use_event.keycode() == 36 || use_event.keycode() == 35 ||
       use_event.keycode() == 38 || use_event.keycode() == 40 ||
       use_event.keycode() == 37 || use_event.keycode() == 39) {
+    UpdateLayout();
     size_t new_cursor = 0;
     if (use_event.keycode() == 36 || use_event.keycode() == 35) {
       new_cursor = GetNewCursorPositionForHomeEnd(
@@ -229,7 +253,7 @@ size_t TextArea::GetNewCursorPositionForHomeEnd(bool is_home) const {
     return text_.size();
   }
   if (!is_home)
-    return *needle - 1;
+    return PrevCharIndex(*needle);
   if (needle == new_row_indexes_.begin())
     return 0;
   return *(needle - 1);
@@ -270,19 +294,14 @@ size_t TextArea::GetNewCursorPositionForLeftRightArrow(
   }
   size_t cursor = CursorPos();
   if (!control_down) {
-    if (is_left && cursor > 0)
-      return cursor - 1;
-    if (!is_left && cursor < text_.size())
-      return cursor + 1;
-    return cursor;
+    return is_left ? PrevCharIndex(cursor) : NextCharIndex(cursor);
   }
   // control is down
   if (is_left) {
     // Scan backwards for word boundary
-    if (cursor > 0)
-      cursor--;
+    cursor = PrevCharIndex(cursor);
     while (cursor > 0) {
-      if (isalpha(text_[cursor - 1]))
+      if (IsWordByte(text_[cursor - 1]))
         cursor--;
       else
         break;
@@ -290,10 +309,9 @@ size_t TextArea::GetNewCursorPositionForLeftRightArrow(
     return cursor;
   }
   // Scan forwards for word boundary
-  if (cursor < text_.size())
-    cursor++;
+  cursor = NextCharIndex(cursor);
   while (cursor < text_.size()) {
-    if (isalpha(text_[cursor]))
+    if (IsWordByte(text_[cursor]))
       cursor++;
     else
       break;
@@ -309,6 +327,7 @@ void TextArea::OnKeyUp(const KeyboardInputEvent& event) {
 }
 
 bool TextArea::OnMouseDown(const Point& position) {
+  UpdateLayout();
   selection_start_ = IndexForPoint(position);
   selection_size_ = 0;
   SetNeedsDisplay(false);
@@ -323,6 +342,7 @@ void TextArea::SetSelection(size_t non_cursor_pos, size_t cursor_pos) {
 }
 
 void TextArea::OnMouseDrag(const Point& position) {
+  UpdateLayout();
   size_t drag_start = NonCursorPos();
   size_t drag_end = IndexForPoint(position);
   SetSelection(drag_start, drag_end);
@@ -335,35 +355,108 @@ bool TextArea::OnPaste(const std::string& str) {
   if (str.empty())
     return false;
   text_.replace(selection_start_, selection_size_, str);
+  TextEdited(selection_start_, selection_size_, str.size());
   selection_start_ += str.size();
   selection_size_ = 0;
   SetNeedsDisplay(false);
   return true;
 }
 
-void TextArea::UpdateLeftEdges(cairo_t* cr) {
+void TextArea::UpdateLayout() {
+  bool full = !layout_valid_ || layout_width_ != frame_.size_.width_;
+  if (!full && !text_edited_)
+    return;
+  TRACE_EVENT("TextArea::UpdateLayout");
+  if (!shaper_) {
+    shaper_ = FontManager::Get()->Shaper("Helvetica", CAIRO_FONT_SLANT_NORMAL,
+                                         CAIRO_FONT_WEIGHT_NORMAL, 13);
+  }
+  if (full) {
+    font_extents_ = shaper_->font_extents();
+    left_edges_.clear();
+    new_row_indexes_.clear();
+    row_glyphs_.clear();
+    Reflow(0, NULL);
+  } else {
+    // The edited word may now fit at the end of the row before the one
+    // it started on, so start there.
+    size_t word_start = edit_.start;
+    while (word_start > 0 && text_[word_start - 1] != ' ' &&
+           text_[word_start - 1] != '\n')
+      word_start--;
+    size_t row = GetRowIndex(word_start);
+    Reflow(row > 0 ? row - 1 : 0, &edit_);
+  }
+  layout_width_ = frame_.size_.width_;
+  layout_valid_ = true;
+  text_edited_ = false;
+}
+
+void TextArea::TextEdited(size_t pos, size_t removed, size_t inserted) {
+  if (!text_edited_) {
+    edit_.start = pos;
+    edit_.old_end = pos + removed;
+    edit_.new_end = pos + inserted;
+    text_edited_ = true;
+    return;
+  }
+  // Merge with the edit already pending. Both ranges are in the
+  // current text before this edit; past edit_.new_end it lines up with
+  // the old text, offset by old_end - new_end.
+  size_t start = std::min(edit_.start, pos);
+  size_t end = std::max(edit_.new_end, pos + removed);
+  edit_.old_end += end - edit_.new_end;
+  edit_.new_end = end - removed + inserted;
+  edit_.start = start;
+}
+
+void TextArea::Reflow(size_t from_row, const TextEdit* edit) {
+  TRACE_EVENT("TextArea::Reflow");
   const double max_width = frame_.size_.width_;
+  const size_t from = from_row == 0 ? 0 : new_row_indexes_[from_row - 1];
+  // The new layout of text_[from...], until it rejoins the old one
+  vector<double> edges;
+  vector<size_t> rows;
+  // Shaped characters of text_[from, shaped_end), indexed by offset
+  // from 'from'. Entries for bytes within a character are unused.
+  vector<TextShaper::ShapedChar> chars;
+  vector<TextShaper::ShapedChar> chunk;
+  size_t shaped_end = from;
+  // Where the new layout rejoined the old one, if it did
+  size_t resume = text_.size() + 1;
   double left_edge = 0.0;
-  //double cursor_pos = 0.0;
-  left_edges_.resize(text_.size() + 1, 0.0);
-  new_row_indexes_.clear();
-  size_t start_of_word = 0;  // index into text_
-  for (size_t i = 0, e = text_.size(); i != e; ++i) {
-    // TODO(adlr): handle UTF-8
-    char str[2] = { text_[i], '\0' };
-    
+  size_t start_of_word = from;  // index into text_
+  size_t i = from;
+  while (i < text_.size()) {
+    if (i >= shaped_end) {
+      size_t chunk_end = std::min(text_.size(), shaped_end + kShapeChunkSize);
+      while (chunk_end < text_.size() && IsUTF8Continuation(text_[chunk_end]))
+        chunk_end++;
+      chunk.clear();
+      shaper_->Shape(text_.data() + shaped_end, chunk_end - shaped_end,
+                     &chunk);
+      chars.resize(chunk_end - from);
+      for (const TextShaper::ShapedChar& ch : chunk) {
+        chars[shaped_end - from] = ch;
+        shaped_end += ch.length;
+      }
+    }
+    const TextShaper::ShapedChar& ch = chars[i - from];
+    const size_t next = i + ch.length;
+    if (edges.size() < next - from)
+      edges.resize(next - from);
+
     if (text_[i] == '\n') {
-      left_edges_[i] = left_edge;
+      edges[i - from] = left_edge;
       if (left_edge == 0.0 && i != 0)
-        new_row_indexes_.push_back(i);
+        rows.push_back(i);
       left_edge = 0.0;
+      start_of_word = next;
+      i = next;
       continue;
     }
 
-    cairo_text_extents_t ext;
-    cairo_text_extents(cr, str, &ext);
-    double width = ext.x_advance;
-
+    double width = ch.advance;
     double right_edge = left_edge + width;
     if (right_edge > max_width) {
       if (text_[i] == ' ') {
@@ -372,13 +465,9 @@ void TextArea::UpdateLeftEdges(cairo_t* cr) {
       } else {
         // this word is overflowing the width. can we move the
         // whole word down?
-        if (start_of_word > 0 && left_edges_[start_of_word] > 0.0) {
-          if (start_of_word > i) {
-            printf("invalid start of word: %zu vs i=%zu\n",
-                   start_of_word, i);
-          }
+        if (start_of_word < i && edges[start_of_word - from] > 0.0) {
           // Yes, we can
-          i = start_of_word - 1;  // to override ++i in for loop
+          i = start_of_word;
           left_edge = 0.0;
           continue;
         }
@@ -387,21 +476,82 @@ void TextArea::UpdateLeftEdges(cairo_t* cr) {
         right_edge = width;
       }
     }
-    left_edges_[i] = left_edge;
+    if (left_edge == 0.0 && i != from && edit && i >= edit->new_end) {
+      // A row starts here. Layout from a row start depends only on the
+      // text after it, so if the old layout had a row start at the
+      // same text, the rest is unchanged.
+      size_t old_i = i - edit->new_end + edit->old_end;
+      if (std::binary_search(new_row_indexes_.begin(),
+                             new_row_indexes_.end(), old_i)) {
+        resume = i;
+        break;
+      }
+    }
+    for (size_t j = i; j < next; j++)
+      edges[j - from] = left_edge;
     if (left_edge == 0.0 && i != 0)
-      new_row_indexes_.push_back(i);
+      rows.push_back(i);
 
-    if ((i + 1) < text_.size() &&
+    if (next < text_.size() &&
         (text_[i] == ' ' || text_[i] == '\n') &&
-        text_[i + 1] != ' ' && text_[i + 1] != '\n') {
-      start_of_word = i + 1;
+        text_[next] != ' ' && text_[next] != '\n') {
+      start_of_word = next;
     }
 
     left_edge = right_edge;  // update for next iteration
+    i = next;
+  }
+  if (resume > text_.size()) {
+    edges.resize(text_.size() + 1 - from);
+    edges.back() = left_edge;
+    if (left_edge == 0.0 && text_.size() != 0)
+      rows.push_back(text_.size());
+  } else {
+    edges.resize(resume - from);
+  }
+
+  // Patch the new part in over the old one, shifting the rest.
+  size_t old_resume = left_edges_.size();
+  if (resume <= text_.size())
+    old_resume = resume - edit->new_end + edit->old_end;
+  left_edges_.erase(left_edges_.begin() + from,
+                    left_edges_.begin() + old_resume);
+  left_edges_.insert(left_edges_.begin() + from, edges.begin(), edges.end());
+
+  vector<size_t>::iterator old_first = std::lower_bound(
+      new_row_indexes_.begin(), new_row_indexes_.end(), from);
+  vector<size_t>::iterator old_last = std::lower_bound(
+      old_first, new_row_indexes_.end(), old_resume);
+  // Rows starting at or after 'from' that were laid out again
+  size_t old_rows = (from == 0 ? 1 : 0) + (old_last - old_first);
+  size_t new_rows = (from == 0 ? 1 : 0) + rows.size();
+  size_t first = old_first - new_row_indexes_.begin();
+  new_row_indexes_.erase(old_first, old_last);
+  new_row_indexes_.insert(new_row_indexes_.begin() + first,
+                          rows.begin(), rows.end());
+  if (edit) {
+    for (size_t i = first + rows.size(); i < new_row_indexes_.size(); i++)
+      new_row_indexes_[i] = new_row_indexes_[i] - edit->old_end +
+          edit->new_end;
   }
-  left_edges_[left_edges_.size() - 1] = left_edge;
-  if (left_edge == 0.0 && left_edges_.size() != 1)
-    new_row_indexes_.push_back(left_edges_.size() - 1);
+
+  old_rows = std::min(old_rows, row_glyphs_.size() - from_row);
+  row_glyphs_.erase(row_glyphs_.begin() + from_row,
+                    row_glyphs_.begin() + from_row + old_rows);
+  row_glyphs_.insert(row_glyphs_.begin() + from_row, new_rows,
+                     vector<cairo_glyph_t>());
+  for (size_t row = from_row; row < from_row + new_rows; row++)
+    LayOutRowGlyphs(row, &row_glyphs_[row]);
+}
+
+void TextArea::LayOutRowGlyphs(size_t row,
+                               vector<cairo_glyph_t>* out) const {
+  size_t start = row == 0 ? 0 : new_row_indexes_[row - 1];
+  size_t end = row < new_row_indexes_.size() ?
+      new_row_indexes_[row] : text_.size();
+  out->clear();
+  shaper_->ShapeGlyphs(text_.data() + start, end - start, 0.0,
+                       font_extents_.ascent, out);
 }
 
 string TextArea::DebugLeftEdges() {
@@ -416,27 +566,6 @@ string TextArea::DebugLeftEdges() {
   return ret;
 }
 
-string TextArea::GetLine(size_t start_idx, size_t* out_advance) {
-  if (text_.size() + 1 != left_edges_.size()) {
-    printf("Size mismatch!\n");
-    return "";
-  }
-
-  string ret;
-  for (size_t i = start_idx; i < text_.size(); ++i) {
-    ret += text_[i];
-    if ((i + 1) < text_.size()) {
-      if (left_edges_[i + 1] <= left_edges_[i])
-        break;
-    }
-  }
-  if (out_advance)
-    *out_advance = ret.size();
-  if (!ret.empty() && *ret.rbegin() == '\n')
-    ret.resize(ret.size() - 1);
-  return ret;
-}
-
 size_t TextArea::GetRowIndex(size_t index) const {
   vector<size_t>::const_iterator needle =
       std::upper_bound(new_row_indexes_.begin(),
@@ -447,10 +576,29 @@ size_t TextArea::GetRowIndex(size_t index) const {
   return needle - new_row_indexes_.begin();
 }
 
+size_t TextArea::PrevCharIndex(size_t index) const {
+  if (index == 0)
+    return 0;
+  index--;
+  while (index > 0 && IsUTF8Continuation(text_[index]))
+    index--;
+  return index;
+}
+
+size_t TextArea::NextCharIndex(size_t index) const {
+  if (index >= text_.size())
+    return text_.size();
+  index++;
+  while (index < text_.size() && IsUTF8Continuation(text_[index]))
+    index++;
+  return index;
+}
+
 void TextArea::EraseSelection() {
   if (selection_size_) {
     text_.erase(text_.begin() + selection_start_,
                 text_.begin() + selection_start_ + selection_size_);
+    TextEdited(selection_start_, selection_size_, 0);
     selection_size_ = 0;
   }
 }
@@ -468,7 +616,7 @@ size_t TextArea::IndexForRowAndOffset(size_t row,
     // use end of doc
     last_in_row = text_.size();
   } else {
-    last_in_row = new_row_indexes_[row] - 1;
+    last_in_row = PrevCharIndex(new_row_indexes_[row]);
   }
   if (last_in_row == first_in_row) {
     return last_in_row;
@@ -477,10 +625,14 @@ size_t TextArea::IndexForRowAndOffset(size_t row,
       std::lower_bound(left_edges_.begin() + first_in_row,
                        left_edges_.begin() + last_in_row,
                        x_offset);
-  if ((*needle - x_offset == 0.0) ||
-      (*needle - x_offset < x_offset - *(needle - 1)))
-    return needle - left_edges_.begin();
-  return needle - left_edges_.begin() - 1;
+  size_t index = needle - left_edges_.begin();
+  if ((*needle - x_offset != 0.0) &&
+      (*needle - x_offset >= x_offset - *(needle - 1)))
+    index--;
+  // Land on the start of a character, not inside one
+  while (index > first_in_row && IsUTF8Continuation(text_[index]))
+    index--;
+  return index;
 }
 
 size_t TextArea::IndexForPoint(const Point& point) const {
@@ -499,27 +651,17 @@ size_t TextArea::IndexForPoint(const Point& point) const {
 }
 
 void TextArea::Draw(cairo_t* cr, bool selected) {
-  stroke_color_.CairoSetSourceRGBA(cr);
-  cairo_select_font_face(cr, "Helvetica",
-                         CAIRO_FONT_SLANT_NORMAL,
-                         CAIRO_FONT_WEIGHT_NORMAL);
-  cairo_set_font_size(cr, 13);
-
-  cairo_font_extents_t extents;
-  cairo_font_extents(cr, &extents);
-  Point cursor = frame_.origin_;
-  cursor.y_ += extents.ascent;
-
-  UpdateLeftEdges(cr);
-  //printf("DBG: %s\n", DebugLeftEdges().c_str());
+  TRACE_EVENT("TextArea::Draw");
+  UpdateLayout();
+  const cairo_font_extents_t& extents = font_extents_;
   if (IsEditing() && selection_size_) {
     // Draw hilight for selection
     cairo_save(cr);
     for (size_t i = selection_start_;
-         i < (selection_start_ + selection_size_); i++) {
+         i < (selection_start_ + selection_size_); i = NextCharIndex(i)) {
       Point letter_origin(left_edges_[i],
                           GetRowIndex(i) * extents.height);
-      double width = left_edges_[i + 1] - left_edges_[i];
+      double width = left_edges_[NextCharIndex(i)] - left_edges_[i];
       if (width <= 0.0)
         width = frame_.size_.width_ - left_edges_[i];
       Rect box(letter_origin, Size(width, extents.height));
@@ -531,21 +673,24 @@ void TextArea::Draw(cairo_t* cr, bool selected) {
     cairo_restore(cr);
   }
 
-  for (size_t index = 0; index < text_.size(); ) {
-    size_t advance = 0;
-    string line = GetLine(index, &advance);
-    //printf("Line: [%s]. adv: %zu\n", line.c_str(), advance);
-    cursor.CairoMoveTo(cr);
-    // Dbg("Printing:");
-    // Dbg(line.c_str());
-    cairo_show_text(cr, line.c_str());
-    cursor.y_ += extents.height;
-    index += advance;
-    if (advance == 0)
-      break;
+  cairo_save(cr);
+  stroke_color_.CairoSetSourceRGBA(cr);
+  shaper_->SetFont(cr);
+  cairo_translate(cr, frame_.Left(), frame_.Top());
+  for (const vector<cairo_glyph_t>& glyphs : row_glyphs_) {
+    if (!glyphs.empty())
+      cairo_show_glyphs(cr, &glyphs[0], glyphs.size());
+    cairo_translate(cr, 0.0, extents.height);
+  }
+  cairo_restore(cr);
+  double height = (GetRowIndex(text_.size()) + 1) * extents.height;
+  if (frame_.size_.height_ != height) {
+    // Grow/shrink to fit the text. This also lets the delegate know
+    // the bounds changed.
+    SetNeedsDisplay(false);
+    frame_.size_.height_ = height;
+    SetNeedsDisplay(false);
   }
-  frame_.size_.height_ =
-      (GetRowIndex(text_.size()) + 1) * extents.height;
 
   if (IsEditing() || selected) {
     // draw rectangle for clarity
@@ -580,6 +725,7 @@ void TextArea::ApplyUndoOp(const TextAreaTransformUndoOp& op,
 
   text_.erase(op.remove_start(), op.remove_size());
   text_.insert(op.remove_start(), op.insert());
+  TextEdited(op.remove_start(), op.remove_size(), op.insert().size());
   selection_start_ = op.final_selection_start();
   selection_size_ = op.final_selection_size();
   SetNeedsDisplay(false);
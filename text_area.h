@@ -3,7 +3,10 @@
 #ifndef PDFKSETCH_TEXT_AREA_H__
 #define PDFKSETCH_TEXT_AREA_H__
 
+#include <memory>
+
 #include "graphic.h"
+#include "text_shaper.h"
 
 namespace pdfsketch {
 
@@ -46,13 +49,15 @@ class TextArea : public Graphic {
   TextArea() {
     frame_.size_.width_ = 150.0;
   }
+  // Graphic(msg) runs only Graphic::Restore(), so the text is read here.
+  // The frame is kept as restored.
   TextArea(const pdfsketchproto::Graphic& msg)
-      : Graphic(msg) {
-    frame_.size_.width_ = 150.0;
-  }
+      : Graphic(msg),
+        text_(msg.text_area().text()) {}
   virtual void Restore(const pdfsketchproto::Graphic& msg) {
     Graphic::Restore(msg);
     text_ = msg.text_area().text();
+    layout_valid_ = false;
   }
   virtual void Serialize(pdfsketchproto::Graphic* out) const;
   virtual void Place(int page, const Point& location);
@@ -79,9 +84,11 @@ class TextArea : public Graphic {
 
   void set_text(const std::string& str) {
     text_ = str;
+    layout_valid_ = false;
   }
 
   virtual void Draw(cairo_t* cr, bool selected);
+  virtual bool WantsRasterCache() const { return !text_.empty(); }
 
   void ApplyUndoOp(const TextAreaTransformUndoOp& op,
                    UndoManager* undo_manager);
@@ -90,10 +97,24 @@ class TextArea : public Graphic {
   virtual int Knobs() const { return kKnobMiddleLeft | kKnobMiddleRight; }
 
  private:
-  void UpdateLeftEdges(cairo_t* cr);
-  std::string GetLine(size_t start_idx, size_t* out_advance);
+  // Lays out the text again if it, the width or the font has changed
+  // since the last layout. After text edits, only the rows around the
+  // edit are redone.
+  void UpdateLayout();
+  // Records that text_[pos, pos + removed) was replaced with 'inserted'
+  // bytes, for the next UpdateLayout().
+  void TextEdited(size_t pos, size_t removed, size_t inserted);
+  // Lays out from the start of row 'from_row' until the row breaks
+  // line up with the old layout again past 'edit', or to the end if
+  // 'edit' is NULL, and patches the layout in place.
+  struct TextEdit;
+  void Reflow(size_t from_row, const TextEdit* edit);
+  void LayOutRowGlyphs(size_t row, std::vector<cairo_glyph_t>* out) const;
   std::string DebugLeftEdges();
   size_t GetRowIndex(size_t index) const;
+  // Start of the character before / after the one at 'index'
+  size_t PrevCharIndex(size_t index) const;
+  size_t NextCharIndex(size_t index) const;
 
   size_t CursorPos() const {
     return (cursor_side_ == kLeft) ? selection_start_
@@ -113,10 +134,33 @@ class TextArea : public Graphic {
 
   // Left edges is one longer than text_
   std::string text_;
+
+  std::shared_ptr<TextShaper> shaper_;
+
+  // Layout. Done in unzoomed page units, so it doesn't depend on how
+  // the text is drawn, and only redone when it's invalidated: text
+  // edits are recorded in edit_, and replacing the text or a different
+  // frame width forces a full layout. Bytes after the first in a
+  // UTF-8 character have the same left edge as the first.
+  bool layout_valid_{false};
+  double layout_width_{0.0};
+  cairo_font_extents_t font_extents_;
   std::vector<double> left_edges_;
   // These cursor positions are the start of new rows.
   // Index 0 is implied, not stored in new_row_indexes_.
   std::vector<size_t> new_row_indexes_;
+  // Glyphs for each row, with the row's baseline at y = ascent
+  std::vector<std::vector<cairo_glyph_t>> row_glyphs_;
+
+  // Text changed since the last layout: old text [start, old_end) is
+  // now [start, new_end). Anything after is unchanged.
+  struct TextEdit {
+    size_t start;
+    size_t old_end;
+    size_t new_end;
+  };
+  bool text_edited_{false};
+  TextEdit edit_;
 
   // For use while editing
   UndoManager* undo_manager_{nullptr};
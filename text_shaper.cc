@@ -0,0 +1,165 @@
+// Copyright...
+
+#include "text_shaper.h"
+
+#include <stdio.h>
+
+#include "font_manager.h"
+
+using std::vector;
+
+namespace pdfsketch {
+
+namespace {
+const uint32_t kReplacementChar = 0xfffd;
+
+size_t EncodeUTF8(uint32_t code_point, char* out) {
+  if (code_point < 0x80) {
+    out[0] = code_point;
+    return 1;
+  }
+  if (code_point < 0x800) {
+    out[0] = 0xc0 | (code_point >> 6);
+    out[1] = 0x80 | (code_point & 0x3f);
+    return 2;
+  }
+  if (code_point < 0x10000) {
+    out[0] = 0xe0 | (code_point >> 12);
+    out[1] = 0x80 | ((code_point >> 6) & 0x3f);
+    out[2] = 0x80 | (code_point & 0x3f);
+    return 3;
+  }
+  out[0] = 0xf0 | (code_point >> 18);
+  out[1] = 0x80 | ((code_point >> 12) & 0x3f);
+  out[2] = 0x80 | ((code_point >> 6) & 0x3f);
+  out[3] = 0x80 | (code_point & 0x3f);
+  return 4;
+}
+}  // namespace {}
+
+uint32_t DecodeUTF8(const char* text, size_t len, size_t* char_len) {
+  const unsigned char* in = reinterpret_cast<const unsigned char*>(text);
+  *char_len = 1;
+  if (in[0] < 0x80)
+    return in[0];
+  size_t need = 0;
+  uint32_t code_point = 0;
+  uint32_t min = 0;
+  if (in[0] >= 0xc2 && in[0] <= 0xdf) {
+    need = 2;
+    code_point = in[0] & 0x1f;
+    min = 0x80;
+  } else if (in[0] >= 0xe0 && in[0] <= 0xef) {
+    need = 3;
+    code_point = in[0] & 0x0f;
+    min = 0x800;
+  } else if (in[0] >= 0xf0 && in[0] <= 0xf4) {
+    need = 4;
+    code_point = in[0] & 0x07;
+    min = 0x10000;
+  } else {
+    return kReplacementChar;
+  }
+  if (len < need)
+    return kReplacementChar;
+  for (size_t i = 1; i < need; i++) {
+    if (!IsUTF8Continuation(text[i]))
+      return kReplacementChar;
+    code_point = (code_point << 6) | (in[i] & 0x3f);
+  }
+  if (code_point < min || code_point > 0x10ffff ||
+      (code_point >= 0xd800 && code_point <= 0xdfff))
+    return kReplacementChar;
+  *char_len = need;
+  return code_point;
+}
+
+TextShaper::TextShaper(cairo_font_face_t* face, double size,
+                       const cairo_font_options_t* options)
+    : face_(cairo_font_face_reference(face)), size_(size) {
+  cairo_matrix_t font_matrix;
+  cairo_matrix_t ctm;
+  cairo_matrix_init_scale(&font_matrix, size, size);
+  cairo_matrix_init_identity(&ctm);
+  font_ = cairo_scaled_font_create(face_, &font_matrix, &ctm, options);
+  cairo_scaled_font_extents(font_, &extents_);
+  for (size_t i = 0; i < sizeof(ascii_valid_); i++)
+    ascii_valid_[i] = false;
+}
+
+TextShaper::~TextShaper() {
+  cairo_scaled_font_destroy(font_);
+  cairo_font_face_destroy(face_);
+}
+
+void TextShaper::SetFont(cairo_t* cr) const {
+  FontManager::Get()->SetFont(cr, face_, size_);
+}
+
+const TextShaper::ShapedChar& TextShaper::Lookup(uint32_t code_point) {
+  ShapedChar* entry = NULL;
+  if (code_point < 128) {
+    entry = &ascii_[code_point];
+    if (ascii_valid_[code_point])
+      return *entry;
+    ascii_valid_[code_point] = true;
+  } else {
+    std::unordered_map<uint32_t, ShapedChar>::iterator it =
+        others_.find(code_point);
+    if (it != others_.end())
+      return it->second;
+    entry = &others_[code_point];
+  }
+  entry->glyph = 0;
+  entry->advance = 0.0;
+  char buf[4];
+  size_t len = EncodeUTF8(code_point, buf);
+  cairo_glyph_t* glyphs = NULL;
+  int num_glyphs = 0;
+  cairo_status_t status = cairo_scaled_font_text_to_glyphs(
+      font_, 0.0, 0.0, buf, len, &glyphs, &num_glyphs, NULL, NULL, NULL);
+  if (status != CAIRO_STATUS_SUCCESS || num_glyphs < 1) {
+    printf("%s: no glyph for U+%04X\n", __func__, code_point);
+  } else {
+    cairo_text_extents_t ext;
+    cairo_scaled_font_glyph_extents(font_, glyphs, 1, &ext);
+    entry->glyph = glyphs[0].index;
+    entry->advance = ext.x_advance;
+  }
+  if (glyphs)
+    cairo_glyph_free(glyphs);
+  return *entry;
+}
+
+void TextShaper::Shape(const char* text, size_t len,
+                       vector<ShapedChar>* out) {
+  std::lock_guard<std::mutex> lock(mu_);
+  for (size_t i = 0; i < len;) {
+    size_t char_len = 0;
+    ShapedChar shaped = Lookup(DecodeUTF8(text + i, len - i, &char_len));
+    shaped.length = char_len;
+    out->push_back(shaped);
+    i += char_len;
+  }
+}
+
+void TextShaper::ShapeGlyphs(const char* text, size_t len, double x, double y,
+                             vector<cairo_glyph_t>* out) {
+  std::lock_guard<std::mutex> lock(mu_);
+  for (size_t i = 0; i < len;) {
+    size_t char_len = 0;
+    uint32_t code_point = DecodeUTF8(text + i, len - i, &char_len);
+    i += char_len;
+    if (code_point == '\n')
+      continue;
+    const ShapedChar& shaped = Lookup(code_point);
+    cairo_glyph_t glyph;
+    glyph.index = shaped.glyph;
+    glyph.x = x;
+    glyph.y = y;
+    out->push_back(glyph);
+    x += shaped.advance;
+  }
+}
+
+}  // namespace pdfsketch
@@ -0,0 +1,78 @@
+// Copyright...
+
+#ifndef PDFSKETCH_TEXT_SHAPER_H__
+#define PDFSKETCH_TEXT_SHAPER_H__
+
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+#include <cairo.h>
+
+namespace pdfsketch {
+
+// UTF-8 helpers. Text is kept as UTF-8 bytes, and cursor positions are
+// byte offsets that should never land inside a character.
+inline bool IsUTF8Continuation(char c) {
+  return (static_cast<unsigned char>(c) & 0xc0) == 0x80;
+}
+
+// Decodes the character starting at 'text', which has 'len' > 0 bytes
+// available. Sets '*char_len' to the bytes it takes up. Malformed or
+// truncated sequences decode as U+FFFD, taking up one byte.
+uint32_t DecodeUTF8(const char* text, size_t len, size_t* char_len);
+
+// Turns text into glyphs in one font, using cairo_scaled_font_text_to_glyphs
+// once per character and caching the glyph index and advance after that,
+// so laying out text is table lookups rather than calls into cairo.
+// Shapers come from FontManager, which shares them between everything
+// using the same font, and are thread safe.
+
+class TextShaper {
+ public:
+  struct ShapedChar {
+    unsigned long glyph;
+    double advance;
+    uint32_t length;  // in bytes
+  };
+
+  // Takes a reference to 'face'. Layout uses 'options' at unit scale,
+  // so with unhinted metrics it's the same at every zoom, on screen and
+  // in exported PDFs.
+  TextShaper(cairo_font_face_t* face, double size,
+             const cairo_font_options_t* options);
+  ~TextShaper();
+
+  const cairo_font_extents_t& font_extents() const { return extents_; }
+
+  // Selects the font for drawing into 'cr', through FontManager.
+  void SetFont(cairo_t* cr) const;
+
+  // Appends one entry per character in the UTF-8 'text' to 'out'.
+  void Shape(const char* text, size_t len, std::vector<ShapedChar>* out);
+  // Appends glyphs for 'text', starting at (x, y), to 'out'. Newlines
+  // take no space and have no glyph.
+  void ShapeGlyphs(const char* text, size_t len, double x, double y,
+                   std::vector<cairo_glyph_t>* out);
+
+ private:
+  // Looks up or caches 'code_point'. Call with mu_ held.
+  const ShapedChar& Lookup(uint32_t code_point);
+
+  cairo_font_face_t* face_;
+  double size_;
+  cairo_scaled_font_t* font_;
+  cairo_font_extents_t extents_;
+
+  std::mutex mu_;
+  // ASCII is looked up by far the most, so it has a plain table.
+  ShapedChar ascii_[128];
+  bool ascii_valid_[128];
+  std::unordered_map<uint32_t, ShapedChar> others_;
+};
+
+}  // namespace pdfsketch
+
+#endif  // PDFSKETCH_TEXT_SHAPER_H__
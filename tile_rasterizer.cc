@@ -0,0 +1,202 @@
+// Copyright...
+
+#include "tile_rasterizer.h"
+
+#include <stdio.h>
+
+#include <poppler-font.h>
+#include <poppler-page-renderer.h>
+
+#include "font_manager.h"
+#include "trace.h"
+
+using std::lock_guard;
+using std::make_pair;
+using std::mutex;
+using std::pair;
+using std::unique_ptr;
+using std::vector;
+
+namespace pdfsketch {
+
+TileRasterizer::TileRasterizer(int num_threads)
+    : worker_state_(num_threads < 1 ? 1 : num_threads) {
+  pool_.reset(new WorkerPool(worker_state_.size()));
+}
+
+TileRasterizer::~TileRasterizer() {
+  pool_.reset();
+  for (auto& tile : finished_)
+    cairo_surface_destroy(tile.second);
+}
+
+cairo_surface_t* TileRasterizer::RenderTile(const TileKey& key,
+                                            poppler::page* page) {
+  TRACE_EVENT("TileRasterizer::RenderTile");
+  const int tile_size = PageTileCache::kTileSize;
+  cairo_surface_t* surface =
+      cairo_image_surface_create(CAIRO_FORMAT_ARGB32, tile_size, tile_size);
+  cairo_t* cr = cairo_create(surface);
+  cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
+  cairo_paint(cr);
+  cairo_translate(cr, -key.x * tile_size, -key.y * tile_size);
+  double scale = PageTileCache::BucketScale(key.scale);
+  cairo_scale(cr, scale, scale);
+  poppler::page_renderer renderer;
+  if (!page)
+    printf("BUG- null page in render\n");
+  else
+    // Pages are shown unrotated, whatever their /Rotate says, so that
+    // view and graphic coordinates match what the exporter draws on.
+    renderer.cairo_render_page(cr, page, false);
+  cairo_destroy(cr);
+  return surface;
+}
+
+void TileRasterizer::LoadFontsForPage(const poppler::document& doc,
+                                      int page) {
+  if (FontManager::Get()->fonts_loaded())
+    return;
+  TRACE_EVENT("TileRasterizer::LoadFontsForPage");
+  unique_ptr<poppler::font_iterator> fonts(doc.create_font_iterator(page));
+  if (!fonts.get() || !fonts->has_next())
+    return;
+  for (const poppler::font_info& font : fonts->next()) {
+    if (!font.is_embedded()) {
+      FontManager::Get()->EnsureFontsLoaded();
+      return;
+    }
+  }
+}
+
+void TileRasterizer::SetDocument(const ByteBuffer& pdf_data) {
+  uint64_t request_generation = 0;
+  {
+    lock_guard<mutex> guard(lock_);
+    pdf_data_ = pdf_data;
+    document_generation_++;
+    request_generation = ++request_generation_;
+    requested_.clear();
+    for (auto& tile : finished_)
+      cairo_surface_destroy(tile.second);
+    finished_.clear();
+  }
+  pool_->CancelPendingBefore(request_generation);
+}
+
+void TileRasterizer::Request(const TileKey& key, Priority priority) {
+  ByteBuffer pdf_data;
+  uint64_t document_generation = 0;
+  uint64_t request_generation = 0;
+  {
+    lock_guard<mutex> guard(lock_);
+    if (pdf_data_.empty())
+      return;
+    PendingTile pending = { priority, false };
+    std::pair<std::map<TileKey, PendingTile>::iterator, bool> inserted =
+        requested_.insert(make_pair(key, pending));
+    if (!inserted.second) {
+      // Already queued or rendering. Posted again if it has to come
+      // sooner; whichever task runs first renders it.
+      PendingTile* existing = &inserted.first->second;
+      if (existing->started || existing->priority <= priority)
+        return;
+      existing->priority = priority;
+    }
+    pdf_data = pdf_data_;
+    document_generation = document_generation_;
+    request_generation = request_generation_;
+  }
+  pool_->Post(priority, request_generation,
+              [this, key, pdf_data, document_generation] (int worker) {
+                RenderOnWorker(worker, key, pdf_data, document_generation);
+              });
+}
+
+void TileRasterizer::CancelPending() {
+  uint64_t request_generation = 0;
+  {
+    lock_guard<mutex> guard(lock_);
+    request_generation = ++request_generation_;
+    // Tiles that are already rendering will still be delivered.
+    requested_.clear();
+  }
+  pool_->CancelPendingBefore(request_generation);
+}
+
+void TileRasterizer::CancelPrefetch() {
+  uint64_t request_generation = 0;
+  {
+    lock_guard<mutex> guard(lock_);
+    request_generation = ++request_generation_;
+    for (std::map<TileKey, PendingTile>::iterator it = requested_.begin();
+         it != requested_.end(); ) {
+      if (it->second.priority == kPrefetch && !it->second.started)
+        requested_.erase(it++);
+      else
+        ++it;
+    }
+  }
+  pool_->CancelPendingBefore(request_generation, kPrefetch);
+}
+
+void TileRasterizer::TakeFinished(vector<pair<TileKey, cairo_surface_t*>>* out) {
+  lock_guard<mutex> guard(lock_);
+  out->insert(out->end(), finished_.begin(), finished_.end());
+  finished_.clear();
+}
+
+bool TileRasterizer::HasOutstandingTiles() {
+  lock_guard<mutex> guard(lock_);
+  return !requested_.empty() || !finished_.empty();
+}
+
+void TileRasterizer::RenderOnWorker(int worker, const TileKey& key,
+                                    const ByteBuffer& pdf_data,
+                                    uint64_t document_generation) {
+  {
+    lock_guard<mutex> guard(lock_);
+    // Skip tiles that another task for the same request got to first,
+    // or whose request was cancelled after this task was taken.
+    std::map<TileKey, PendingTile>::iterator it = requested_.find(key);
+    if (it == requested_.end() || it->second.started ||
+        document_generation != document_generation_)
+      return;
+    it->second.started = true;
+  }
+  WorkerState* state = &worker_state_[worker];
+  if (state->document_generation != document_generation) {
+    state->document.reset(poppler::document::load_from_raw_data(
+        pdf_data.data(), pdf_data.size()));
+    state->document_generation = document_generation;
+    state->fonts_checked.clear();
+  }
+  if (!state->document.get()) {
+    printf("%s: can't make poppler doc from data\n", __func__);
+    return;
+  }
+  if (state->fonts_checked.size() <= static_cast<size_t>(key.page))
+    state->fonts_checked.resize(key.page + 1);
+  if (!state->fonts_checked[key.page]) {
+    LoadFontsForPage(*state->document, key.page);
+    state->fonts_checked[key.page] = true;
+  }
+  unique_ptr<poppler::page> page(state->document->create_page(key.page));
+  cairo_surface_t* surface = RenderTile(key, page.get());
+
+  bool notify = false;
+  {
+    lock_guard<mutex> guard(lock_);
+    requested_.erase(key);
+    if (document_generation != document_generation_) {
+      cairo_surface_destroy(surface);
+      return;
+    }
+    notify = finished_.empty();
+    finished_.push_back(make_pair(key, surface));
+  }
+  if (notify && tile_ready_callback_)
+    tile_ready_callback_();
+}
+
+}  // namespace pdfsketch
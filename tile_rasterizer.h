@@ -0,0 +1,100 @@
+// Copyright...
+
+#ifndef PDFSKETCH_TILE_RASTERIZER_H__
+#define PDFSKETCH_TILE_RASTERIZER_H__
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <cairo.h>
+#include <poppler-document.h>
+#include <poppler-page.h>
+
+#include "byte_buffer.h"
+#include "page_tile_cache.h"
+#include "worker_pool.h"
+
+namespace pdfsketch {
+
+// Renders page tiles on background threads. poppler documents can't
+// be shared between threads, so each worker parses its own
+// poppler::document over the shared PDF bytes, on first use.
+
+class TileRasterizer {
+ public:
+  enum Priority {
+    kVisible = 0,  // on screen now
+    kPrefetch = 1  // likely to be scrolled to soon
+  };
+
+  explicit TileRasterizer(int num_threads);
+  ~TileRasterizer();
+
+  // Renders one tile of 'page' into a new surface, which the caller
+  // owns. Safe to call on any thread that owns 'page'.
+  static cairo_surface_t* RenderTile(const TileKey& key,
+                                     poppler::page* page);
+  // Makes sure the system fonts are loaded if 'page' of 'doc' uses
+  // fonts that aren't embedded, before it's rendered.
+  static void LoadFontsForPage(const poppler::document& doc, int page);
+
+  // Switches to a new document. Cancels queued requests and discards
+  // results for the old document.
+  void SetDocument(const ByteBuffer& pdf_data);
+
+  // Called on a worker thread when a tile becomes available after
+  // TakeFinished() last emptied the list of finished tiles.
+  void SetTileReadyCallback(const std::function<void ()>& callback) {
+    tile_ready_callback_ = callback;
+  }
+
+  // Queues the tile for rendering, unless it's already queued. A tile
+  // queued for prefetch is moved up if it's now requested as visible.
+  void Request(const TileKey& key, Priority priority);
+  // Drops requests that haven't started yet.
+  void CancelPending();
+  // Drops kPrefetch requests that haven't started yet.
+  void CancelPrefetch();
+
+  // Moves rendered tiles into 'out'. Caller owns the surfaces.
+  void TakeFinished(std::vector<std::pair<TileKey, cairo_surface_t*>>* out);
+  // Whether any request is still to be rendered or taken.
+  bool HasOutstandingTiles();
+
+ private:
+  struct PendingTile {
+    Priority priority;
+    bool started;  // a worker is rendering it
+  };
+  struct WorkerState {
+    uint64_t document_generation{0};
+    std::unique_ptr<poppler::document> document;
+    // Pages already passed to LoadFontsForPage()
+    std::vector<bool> fonts_checked;
+  };
+  void RenderOnWorker(int worker, const TileKey& key,
+                      const ByteBuffer& pdf_data,
+                      uint64_t document_generation);
+
+  // Only touched by the worker thread with the same index.
+  std::vector<WorkerState> worker_state_;
+  std::function<void ()> tile_ready_callback_;
+  // Destroyed explicitly first, so no task outlives the state above.
+  std::unique_ptr<WorkerPool> pool_;
+
+  // Protects members below.
+  std::mutex lock_;
+  ByteBuffer pdf_data_;
+  uint64_t document_generation_{1};
+  uint64_t request_generation_{1};
+  std::map<TileKey, PendingTile> requested_;
+  std::vector<std::pair<TileKey, cairo_surface_t*>> finished_;
+};
+
+}  // namespace pdfsketch
+
+#endif  // PDFSKETCH_TILE_RASTERIZER_H__
@@ -0,0 +1,146 @@
+// Copyright...
+
+#include "trace.h"
+
+#if PDFSKETCH_TRACING
+
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+
+#endif  // PDFSKETCH_TRACING
+
+using std::string;
+
+namespace pdfsketch {
+
+#if PDFSKETCH_TRACING
+
+namespace {
+
+struct TraceEvent {
+  const char* name;
+  int64_t start_us;
+  int64_t duration_us;
+};
+
+// Events are stored in fixed-size chunks so that a chunk is never
+// moved once a reader may be looking at it. Only the owning thread
+// writes; it publishes each event by bumping 'count'.
+struct TraceChunk {
+  static const size_t kSize = 4096;
+  TraceEvent events[kSize];
+  std::atomic<size_t> count{0};
+  std::atomic<TraceChunk*> next{nullptr};
+};
+
+// Events recorded by one thread. Buffers are never freed, since a
+// reader can't tell when a thread has exited.
+struct TraceBuffer {
+  // Caps memory at about 24MB per thread; later events are dropped.
+  static const size_t kMaxChunks = 256;
+  int tid{0};
+  TraceChunk head;
+  TraceChunk* tail{&head};
+  size_t num_chunks{1};
+  TraceBuffer* next{nullptr};
+};
+
+std::atomic<TraceBuffer*> g_buffers(nullptr);
+std::atomic<int> g_next_tid(1);
+__thread TraceBuffer* g_thread_buffer = nullptr;
+
+int64_t NowMicroseconds() {
+  static const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+TraceBuffer* ThreadBuffer() {
+  if (g_thread_buffer)
+    return g_thread_buffer;
+  TraceBuffer* buffer = new TraceBuffer;
+  buffer->tid = g_next_tid++;
+  buffer->next = g_buffers.load();
+  while (!g_buffers.compare_exchange_weak(buffer->next, buffer)) {}
+  g_thread_buffer = buffer;
+  return buffer;
+}
+
+void Record(const char* name, int64_t start_us, int64_t duration_us) {
+  TraceBuffer* buffer = ThreadBuffer();
+  TraceChunk* chunk = buffer->tail;
+  size_t count = chunk->count.load(std::memory_order_relaxed);
+  if (count == TraceChunk::kSize) {
+    if (buffer->num_chunks == TraceBuffer::kMaxChunks)
+      return;
+    TraceChunk* next = new TraceChunk;
+    chunk->next.store(next, std::memory_order_release);
+    buffer->tail = chunk = next;
+    buffer->num_chunks++;
+    count = 0;
+  }
+  TraceEvent& event = chunk->events[count];
+  event.name = name;
+  event.start_us = start_us;
+  event.duration_us = duration_us;
+  chunk->count.store(count + 1, std::memory_order_release);
+}
+
+void AppendEscaped(const char* str, string* out) {
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\')
+      out->push_back('\\');
+    out->push_back(*str);
+  }
+}
+
+}  // namespace {}
+
+ScopedTrace::ScopedTrace(const char* name)
+    : name_(name), start_us_(NowMicroseconds()) {}
+
+ScopedTrace::~ScopedTrace() {
+  Record(name_, start_us_, NowMicroseconds() - start_us_);
+}
+
+bool TraceToJSON(string* out) {
+  out->append("{\"traceEvents\":[");
+  bool first = true;
+  for (TraceBuffer* buffer = g_buffers.load(); buffer;
+       buffer = buffer->next) {
+    for (TraceChunk* chunk = &buffer->head; chunk;
+         chunk = chunk->next.load(std::memory_order_acquire)) {
+      size_t count = chunk->count.load(std::memory_order_acquire);
+      for (size_t i = 0; i < count; i++) {
+        const TraceEvent& event = chunk->events[i];
+        if (!first)
+          out->push_back(',');
+        first = false;
+        out->append("\n{\"name\":\"");
+        AppendEscaped(event.name, out);
+        char buf[120];
+        snprintf(buf, sizeof(buf),
+                 "\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                 "\"ts\":%lld,\"dur\":%lld}",
+                 buffer->tid,
+                 static_cast<long long>(event.start_us),
+                 static_cast<long long>(event.duration_us));
+        out->append(buf);
+      }
+    }
+  }
+  out->append("\n],\"displayTimeUnit\":\"ms\"}\n");
+  return true;
+}
+
+#else  // PDFSKETCH_TRACING
+
+bool TraceToJSON(string* out) {
+  return false;
+}
+
+#endif  // PDFSKETCH_TRACING
+
+}  // namespace pdfsketch
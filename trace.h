@@ -0,0 +1,61 @@
+// Copyright...
+
+#ifndef PDFSKETCH_TRACE_H__
+#define PDFSKETCH_TRACE_H__
+
+#include <stdint.h>
+#include <string>
+
+// Scoped trace events for finding where frame time goes. Building with
+// PDFSKETCH_TRACING=1 (make TRACING=1) records the duration of every
+// TRACE_EVENT scope; otherwise the macros compile to nothing.
+//
+// Each thread records into its own buffer, so recording takes no
+// locks. The recorded events can be written out as Chrome trace-event
+// JSON and loaded into chrome://tracing or a compatible viewer.
+//
+// Usage:
+//   void Foo::Draw(cairo_t* cr) {
+//     TRACE_EVENT("Foo::Draw");
+//     ...
+//   }
+// The name must be a string literal (or otherwise outlive the trace).
+
+#if PDFSKETCH_TRACING
+
+#define TRACE_EVENT_CONCAT_INNER(a, b) a##b
+#define TRACE_EVENT_CONCAT(a, b) TRACE_EVENT_CONCAT_INNER(a, b)
+#define TRACE_EVENT(name)                                               \
+  ::pdfsketch::ScopedTrace TRACE_EVENT_CONCAT(trace_event_, __LINE__)(name)
+
+#else
+
+#define TRACE_EVENT(name) do {} while (0)
+
+#endif  // PDFSKETCH_TRACING
+
+namespace pdfsketch {
+
+#if PDFSKETCH_TRACING
+
+class ScopedTrace {
+ public:
+  explicit ScopedTrace(const char* name);
+  ~ScopedTrace();
+
+ private:
+  const char* name_;
+  int64_t start_us_;
+};
+
+#endif  // PDFSKETCH_TRACING
+
+// Appends the events recorded so far, on all threads, to 'out' as a
+// Chrome trace-event JSON object. Events still being recorded may or
+// may not be included. Returns false (and appends nothing) if tracing
+// isn't compiled in.
+bool TraceToJSON(std::string* out);
+
+}  // namespace pdfsketch
+
+#endif  // PDFSKETCH_TRACE_H__
@@ -21,6 +21,17 @@ Rect Rect::Intersect(const Rect& that) const {
   return ret;
 }
 
+Rect Rect::Union(const Rect& that) const {
+  if (that.Empty())
+    return *this;
+  if (Empty())
+    return that;
+  return Rect(Point(min(Left(), that.Left()),
+                    min(Top(), that.Top())),
+              Point(max(Right(), that.Right()),
+                    max(Bottom(), that.Bottom())));
+}
+
 bool Rect::Contains(const Point& point) const {
   return origin_.x_ <= point.x_ && point.x_ < (origin_.x_ + size_.width_) &&
       origin_.y_ <= point.y_ && point.y_ < (origin_.y_ + size_.height_);
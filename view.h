@@ -112,6 +112,8 @@ struct Rect {
     size_.Serialize(out->mutable_size());
   }
   Rect Intersect(const Rect& that) const;
+  // Smallest rect containing both. Empty rects are ignored.
+  Rect Union(const Rect& that) const;
   bool Intersects(const Rect& that) const {
     return !(that.Top() >= Bottom() || Top() >= that.Bottom() ||
              that.Left() >= Right() || Left() >= that.Right());
@@ -137,6 +139,15 @@ struct Rect {
   Point UpperRight() const { return Point(Right(), Top()); }
   Point LowerLeft() const { return Point(Left(), Bottom()); }
   Point LowerRight() const { return Point(Right(), Bottom()); }
+  bool Empty() const {
+    return size_.width_ <= 0.0 || size_.height_ <= 0.0;
+  }
+  double Area() const { return size_.width_ * size_.height_; }
+  // Smallest rect with integral edges that contains this one
+  Rect RoundedOut() const {
+    return Rect(Point(floor(Left()), floor(Top())),
+                Point(ceil(Right()), ceil(Bottom())));
+  }
   Point Center() const {
     return Point(origin_.x_ + 0.5 * size_.width_,
                  origin_.y_ + 0.5 * size_.height_);
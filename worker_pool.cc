@@ -0,0 +1,88 @@
+// Copyright...
+
+#include "worker_pool.h"
+
+#include <algorithm>
+
+using std::lock_guard;
+using std::make_pair;
+using std::mutex;
+using std::unique_lock;
+
+namespace pdfsketch {
+
+int WorkerPool::DefaultNumThreads() {
+  int cores = std::thread::hardware_concurrency();
+  return std::max(1, std::min(cores - 1, 4));
+}
+
+WorkerPool::WorkerPool(int num_threads) {
+  if (num_threads < 1)
+    num_threads = 1;
+  for (int i = 0; i < num_threads; i++)
+    threads_.push_back(std::thread(&WorkerPool::Run, this, i));
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    lock_guard<mutex> guard(lock_);
+    shutdown_ = true;
+    queue_.clear();
+  }
+  wake_.notify_all();
+  for (auto& thread : threads_)
+    thread.join();
+}
+
+void WorkerPool::Post(int priority, uint64_t generation, const Task& task) {
+  {
+    lock_guard<mutex> guard(lock_);
+    PendingTask pending = { generation, task };
+    queue_[make_pair(priority, next_sequence_++)] = pending;
+  }
+  wake_.notify_one();
+}
+
+void WorkerPool::CancelPendingBefore(uint64_t generation) {
+  lock_guard<mutex> guard(lock_);
+  for (Queue::iterator it = queue_.begin(); it != queue_.end(); ) {
+    if (it->second.generation < generation)
+      queue_.erase(it++);
+    else
+      ++it;
+  }
+}
+
+void WorkerPool::CancelPendingBefore(uint64_t generation, int priority) {
+  lock_guard<mutex> guard(lock_);
+  Queue::iterator end = queue_.lower_bound(make_pair(priority + 1, 0));
+  for (Queue::iterator it = queue_.lower_bound(make_pair(priority, 0));
+       it != end; ) {
+    if (it->second.generation < generation)
+      queue_.erase(it++);
+    else
+      ++it;
+  }
+}
+
+size_t WorkerPool::NumPending() const {
+  lock_guard<mutex> guard(lock_);
+  return queue_.size();
+}
+
+void WorkerPool::Run(int worker) {
+  while (true) {
+    Task task;
+    {
+      unique_lock<mutex> guard(lock_);
+      wake_.wait(guard, [this] () { return shutdown_ || !queue_.empty(); });
+      if (shutdown_)
+        return;
+      task = queue_.begin()->second.task;
+      queue_.erase(queue_.begin());
+    }
+    task(worker);
+  }
+}
+
+}  // namespace pdfsketch
@@ -0,0 +1,66 @@
+// Copyright...
+
+#ifndef PDFSKETCH_WORKER_POOL_H__
+#define PDFSKETCH_WORKER_POOL_H__
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace pdfsketch {
+
+// Runs tasks on a fixed set of background threads. Queued tasks run in
+// priority order (lowest value first), and in posting order within a
+// priority. Each task carries a generation number so that callers can
+// drop queued work that has gone stale, e.g. after a zoom change.
+
+class WorkerPool {
+ public:
+  // Called on a worker thread with that worker's index, which is in
+  // [0, num_threads). Tasks can use it to keep per-thread state.
+  typedef std::function<void (int worker)> Task;
+
+  explicit WorkerPool(int num_threads);
+  // Drops queued tasks and waits for running ones to finish.
+  ~WorkerPool();
+
+  // A reasonable number of threads for a pool: one per core, less one
+  // for the thread posting the work, and at most 4.
+  static int DefaultNumThreads();
+
+  int num_threads() const { return threads_.size(); }
+
+  void Post(int priority, uint64_t generation, const Task& task);
+  // Drops queued tasks whose generation is less than 'generation'.
+  // Tasks that have already started aren't affected.
+  void CancelPendingBefore(uint64_t generation);
+  // Same, but only for tasks posted with 'priority'.
+  void CancelPendingBefore(uint64_t generation, int priority);
+  size_t NumPending() const;
+
+ private:
+  void Run(int worker);
+
+  struct PendingTask {
+    uint64_t generation;
+    Task task;
+  };
+  // Keyed by (priority, sequence number).
+  typedef std::map<std::pair<int, uint64_t>, PendingTask> Queue;
+
+  mutable std::mutex lock_;
+  std::condition_variable wake_;
+  Queue queue_;
+  uint64_t next_sequence_{0};
+  bool shutdown_{false};
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace pdfsketch
+
+#endif  // PDFSKETCH_WORKER_POOL_H__